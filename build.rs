@@ -0,0 +1,22 @@
+fn main() {
+    #[cfg(feature = "ebpf")]
+    build_ebpf();
+}
+
+#[cfg(feature = "ebpf")]
+fn build_ebpf() {
+    use std::{env, path::PathBuf};
+
+    const BPF_SRC: &str = "src/bpf/tracexec_system.bpf.c";
+    let out = PathBuf::from(env::var_os("OUT_DIR").expect("OUT_DIR must be set in build script"))
+        .join("tracexec_system.skel.rs");
+    // linux/bpf.h includes asm/types.h, which lives in a multiarch directory on some distros
+    let arch = env::var("CARGO_CFG_TARGET_ARCH").unwrap();
+    let multiarch_include = format!("-I/usr/include/{arch}-linux-gnu");
+    libbpf_cargo::SkeletonBuilder::new()
+        .source(BPF_SRC)
+        .clang_args(multiarch_include)
+        .build_and_generate(&out)
+        .expect("failed to build the eBPF program");
+    println!("cargo:rerun-if-changed=src/bpf");
+}
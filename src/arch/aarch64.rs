@@ -2,6 +2,9 @@ use nix::libc::user_regs_struct;
 
 pub type PtraceRegisters = user_regs_struct;
 
+// AUDIT_ARCH_AARCH64 from linux/audit.h
+pub const AUDIT_ARCH: u32 = 0xc00000b7;
+
 macro_rules! syscall_no_from_regs {
     ($regs:ident) => {
         $regs.regs[8] as i64
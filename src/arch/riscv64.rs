@@ -2,6 +2,9 @@ use nix::libc::user_regs_struct;
 
 pub type PtraceRegisters = user_regs_struct;
 
+// AUDIT_ARCH_RISCV64 from linux/audit.h
+pub const AUDIT_ARCH: u32 = 0xc00000f3;
+
 macro_rules! syscall_no_from_regs {
     ($regs:ident) => {
         $regs.a7 as i64
@@ -2,6 +2,9 @@ use nix::libc::user_regs_struct;
 
 pub type PtraceRegisters = user_regs_struct;
 
+// AUDIT_ARCH_X86_64 from linux/audit.h
+pub const AUDIT_ARCH: u32 = 0xc000003e;
+
 macro_rules! syscall_no_from_regs {
     ($regs:ident) => {
         $regs.orig_rax as i64
@@ -0,0 +1,173 @@
+//! Finding the running processes to attach the ptrace backend to.
+//!
+//! A process that forks before it is seized has children that are not attached
+//! automatically. So /proc is scanned again after each round of seizing, until
+//! a round finds nothing new. Children forked after their parent is seized are
+//! attached by the kernel.
+
+use std::{
+    collections::{HashMap, HashSet},
+    io,
+    os::unix::ffi::OsStrExt,
+    path::{Path, PathBuf},
+};
+
+use nix::unistd::Pid;
+
+use crate::cli::TracingArgs;
+
+#[derive(Debug, Clone)]
+pub enum AttachTarget {
+    /// A process and its descendants
+    Pid(Pid),
+    /// The processes in a process group and their descendants
+    Pgid(Pid),
+    /// The processes in a cgroup(v2) and their descendants
+    Cgroup(PathBuf),
+}
+
+impl AttachTarget {
+    pub fn from_cli(tracing_args: &TracingArgs) -> Option<Self> {
+        if let Some(pid) = tracing_args.pid {
+            Some(Self::Pid(Pid::from_raw(pid)))
+        } else if let Some(pgid) = tracing_args.pgid {
+            Some(Self::Pgid(Pid::from_raw(pgid)))
+        } else {
+            tracing_args.cgroup.clone().map(Self::Cgroup)
+        }
+    }
+}
+
+/// A thread to seize
+#[derive(Debug, Clone, Copy)]
+pub struct FoundThread {
+    pub tid: Pid,
+    pub tgid: Pid,
+    /// Parent of the process
+    pub ppid: Pid,
+}
+
+#[derive(Debug, Clone, Copy)]
+struct Stat {
+    pid: Pid,
+    ppid: Pid,
+    pgrp: Pid,
+}
+
+/// Parse the ppid and pgrp from /proc/<pid>/stat
+fn parse_stat(pid: Pid, buf: &[u8]) -> Option<Stat> {
+    // comm might contain anything, so start after its last ')'
+    let rest = &buf[buf.iter().rposition(|&c| c == b')')? + 1..];
+    let mut fields = rest.split(|&c| c == b' ').filter(|x| !x.is_empty()).skip(1); // state
+    let mut next = || -> Option<i32> { std::str::from_utf8(fields.next()?).ok()?.parse().ok() };
+    Some(Stat {
+        pid,
+        ppid: Pid::from_raw(next()?),
+        pgrp: Pid::from_raw(next()?),
+    })
+}
+
+/// The numeric entries of a directory like /proc or /proc/<pid>/task
+fn list_pids(dir: &Path) -> io::Result<Vec<Pid>> {
+    let mut pids = Vec::new();
+    for entry in std::fs::read_dir(dir)? {
+        let name = entry?.file_name();
+        if let Some(pid) = std::str::from_utf8(name.as_bytes())
+            .ok()
+            .and_then(|x| x.parse().ok())
+        {
+            pids.push(Pid::from_raw(pid));
+        }
+    }
+    Ok(pids)
+}
+
+fn read_cgroup_procs(cgroup: &Path) -> io::Result<HashSet<Pid>> {
+    Ok(std::fs::read_to_string(cgroup.join("cgroup.procs"))?
+        .lines()
+        .filter_map(|x| x.parse().ok())
+        .map(Pid::from_raw)
+        .collect())
+}
+
+/// Map `f` over `items` in up to `threads` threads
+fn par_map<T: Sync, R: Send>(items: &[T], threads: usize, f: impl Fn(&T) -> R + Sync) -> Vec<R> {
+    let chunk = items.len().div_ceil(threads.max(1)).max(1);
+    std::thread::scope(|s| {
+        let f = &f;
+        let handles: Vec<_> = items
+            .chunks(chunk)
+            .map(|chunk| s.spawn(move || chunk.iter().map(f).collect::<Vec<_>>()))
+            .collect();
+        handles
+            .into_iter()
+            .flat_map(|x| x.join().unwrap())
+            .collect()
+    })
+}
+
+/// Find the threads of the target and of the descendants of the `traced` threads that
+/// are not traced yet. The processes that are gone meanwhile are skipped.
+pub fn scan(
+    target: &AttachTarget,
+    traced: &HashSet<Pid>,
+    threads: usize,
+) -> io::Result<Vec<FoundThread>> {
+    let pids = list_pids(Path::new("/proc"))?;
+    let stats: Vec<Stat> = par_map(&pids, threads, |&pid| {
+        let buf = std::fs::read(format!("/proc/{pid}/stat")).ok()?;
+        parse_stat(pid, &buf)
+    })
+    .into_iter()
+    .flatten()
+    .collect();
+    let cgroup_procs = match target {
+        AttachTarget::Cgroup(cgroup) => read_cgroup_procs(cgroup)?,
+        _ => HashSet::new(),
+    };
+    let mut children: HashMap<Pid, Vec<Stat>> = HashMap::new();
+    let mut members = Vec::new();
+    for stat in stats.iter() {
+        let seed = traced.contains(&stat.pid)
+            || match target {
+                AttachTarget::Pid(pid) => stat.pid == *pid,
+                AttachTarget::Pgid(pgid) => stat.pgrp == *pgid,
+                AttachTarget::Cgroup(_) => cgroup_procs.contains(&stat.pid),
+            };
+        if seed {
+            members.push(*stat);
+        } else {
+            children.entry(stat.ppid).or_default().push(*stat);
+        }
+    }
+    // Add the descendants
+    let mut idx = 0;
+    while idx < members.len() {
+        if let Some(x) = children.remove(&members[idx].pid) {
+            members.extend(x);
+        }
+        idx += 1;
+    }
+    let found = par_map(&members, threads, |stat| {
+        let tids = list_pids(Path::new(&format!("/proc/{}/task", stat.pid))).unwrap_or_default();
+        tids.into_iter()
+            .filter(|tid| !traced.contains(tid))
+            .map(|tid| FoundThread {
+                tid,
+                tgid: stat.pid,
+                ppid: stat.ppid,
+            })
+            .collect::<Vec<_>>()
+    });
+    Ok(found.into_iter().flatten().collect())
+}
+
+/// The tgid of the tracer of a thread, if any
+pub fn read_tracer(tid: Pid) -> Option<Pid> {
+    let status = std::fs::read_to_string(format!("/proc/{tid}/status")).ok()?;
+    let line = status.lines().find_map(|x| x.strip_prefix("TracerPid:"))?;
+    match line.trim().parse().ok()? {
+        0 => None,
+        pid => Some(Pid::from_raw(pid)),
+    }
+}
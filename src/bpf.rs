@@ -0,0 +1,447 @@
+//! eBPF backend.
+//!
+//! Exec events are collected by tracepoints(see `bpf/tracexec_system.bpf.c`)
+//! and delivered through a BPF ring buffer. The tracees never stop.
+
+use std::{
+    cell::RefCell,
+    collections::HashMap,
+    ffi::OsString,
+    io::Write,
+    os::unix::{fs::MetadataExt, prelude::OsStringExt},
+    path::PathBuf,
+    process::exit,
+    sync::Arc,
+    time::Duration,
+};
+
+use color_eyre::eyre::bail;
+use libbpf_rs::{
+    skel::{OpenSkel, Skel, SkelBuilder},
+    MapFlags, RingBufferBuilder,
+};
+use nix::{
+    errno::Errno,
+    libc::{self, tcsetpgrp, STDIN_FILENO},
+    sys::wait::{waitpid, WaitPidFlag, WaitStatus},
+    unistd::{getpid, Pid},
+};
+
+use crate::{
+    cli::TracingArgs,
+    intern::{intern_bytes, intern_path, intern_str},
+    pipeline::{ExecEvent, Pipeline, TracerEvent},
+    printer::PrinterArgs,
+    proc::{
+        comm_from_filename, read_cwd, read_interpreter_recursive, resolve_execveat_filename,
+        TASK_COMM_LEN,
+    },
+    spawn::{spawn_gated, Gate},
+    state::{ExecData, ProcessState, ProcessStateStore},
+};
+
+mod skel {
+    include!(concat!(env!("OUT_DIR"), "/tracexec_system.skel.rs"));
+}
+
+use skel::*;
+
+// Keep in sync with bpf/interface.h
+const EVENT_EXEC_BEGIN: u32 = 1;
+const EVENT_STRING: u32 = 2;
+const EVENT_EXEC_ARGS_END: u32 = 3;
+const EVENT_EXEC_RESULT: u32 = 4;
+const EVENT_EXEC_DONE: u32 = 5;
+const EVENT_FORK: u32 = 6;
+const EVENT_EXIT: u32 = 7;
+
+const STRING_FILENAME: u32 = 1;
+const STRING_ARGV: u32 = 2;
+const STRING_ENVP: u32 = 3;
+
+const FLAG_READ_FAILURE: u32 = 1;
+const FLAG_TRUNCATED: u32 = 2;
+
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct EventHeader {
+    r#type: u32,
+    pid: u32,
+    tgid: u32,
+    flags: u32,
+}
+
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct ExecBeginEvent {
+    hdr: EventHeader,
+    syscall_nr: i64,
+    dirfd: i32,
+    at_flags: i32,
+    comm: [u8; TASK_COMM_LEN],
+}
+
+/// The fixed part of `struct string_event`, followed by `len` bytes of data
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct StringEventHeader {
+    hdr: EventHeader,
+    kind: u32,
+    index: u32,
+    len: u32,
+    _pad: u32,
+}
+
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct ExecArgsEndEvent {
+    hdr: EventHeader,
+    argc: u32,
+    envc: u32,
+}
+
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct ExecResultEvent {
+    hdr: EventHeader,
+    ret: i64,
+}
+
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct ExecDoneEvent {
+    hdr: EventHeader,
+    old_pid: u32,
+    _pad: u32,
+}
+
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct ForkEvent {
+    hdr: EventHeader,
+    child_pid: u32,
+    _pad: u32,
+}
+
+fn read_event<T: Copy>(data: &[u8]) -> color_eyre::Result<T> {
+    if data.len() < std::mem::size_of::<T>() {
+        bail!("Truncated event from ring buffer: {} bytes", data.len());
+    }
+    // SAFETY: all event types are plain old data and the length is checked
+    Ok(unsafe { std::ptr::read_unaligned(data.as_ptr() as *const T) })
+}
+
+fn comm_to_string(comm: &[u8]) -> Arc<str> {
+    let end = comm.iter().position(|&x| x == 0).unwrap_or(comm.len());
+    intern_bytes(&comm[..end])
+}
+
+/// An exec whose strings are still arriving from the ring buffer
+struct PendingExec {
+    syscall: i64,
+    dirfd: i32,
+    at_flags: i32,
+    comm: Arc<str>,
+    filename: Vec<u8>,
+    argv: Vec<Arc<str>>,
+    envp: Vec<Arc<str>>,
+    flags: u32,
+    /// Some records of this exec were lost
+    incomplete: bool,
+}
+
+pub struct EbpfTracer {
+    store: ProcessStateStore,
+    args: PrinterArgs,
+    print_children: bool,
+    cgroup: Option<PathBuf>,
+    pipeline: Pipeline,
+    /// tid -> exec in progress
+    pending: HashMap<Pid, PendingExec>,
+}
+
+impl EbpfTracer {
+    pub fn new(
+        tracing_args: TracingArgs,
+        output: Box<dyn Write + Send>,
+    ) -> color_eyre::Result<Self> {
+        Ok(Self {
+            store: ProcessStateStore::from_cli(&tracing_args)?,
+            pipeline: Pipeline::new(&tracing_args, output)?,
+            print_children: tracing_args.show_children,
+            args: PrinterArgs::from_cli(&tracing_args),
+            cgroup: tracing_args.cgroup,
+            pending: HashMap::new(),
+        })
+    }
+
+    /// Run `args` and trace its subtree, or trace the cgroup if `args` is empty.
+    pub fn run(mut self, args: Vec<String>) -> color_eyre::Result<()> {
+        let mut open_skel = TracexecSystemSkelBuilder::default().open()?;
+        if let Some(cgroup) = self.cgroup.as_ref() {
+            // The id of a cgroup v2 is the inode number of its directory
+            open_skel.rodata_mut().target_cgroup_id = std::fs::metadata(cgroup)?.ino();
+        }
+        open_skel.rodata_mut().read_argv = self.args.needs_argv();
+        open_skel.rodata_mut().read_envp = self.args.needs_envp();
+        let mut skel = open_skel.load()?;
+        skel.attach()?;
+        let (root_child, gate) = if args.is_empty() {
+            (None, None)
+        } else {
+            let (child, gate) = spawn_gated(args, || Ok(()))?;
+            skel.maps_mut().traced().update(
+                &(child.as_raw() as u32).to_ne_bytes(),
+                &[1u8],
+                MapFlags::ANY,
+            )?;
+            // Set foreground process group of the terminal
+            if -1 == unsafe { tcsetpgrp(STDIN_FILENO, child.as_raw()) } {
+                return Err(Errno::last().into());
+            }
+            let mut root_child_state = ProcessState::new(child, 0)?;
+            root_child_state.ppid = Some(getpid());
+            self.store.insert(root_child_state);
+            (Some(child), Some(gate))
+        };
+        self.event_loop(&skel, root_child, gate)
+    }
+
+    fn event_loop(
+        self,
+        skel: &TracexecSystemSkel,
+        root_child: Option<Pid>,
+        gate: Option<Gate>,
+    ) -> color_eyre::Result<()> {
+        let this = RefCell::new(self);
+        let mut builder = RingBufferBuilder::new();
+        builder.add(skel.maps().events(), |data: &[u8]| {
+            match this.borrow_mut().handle_event(data) {
+                Ok(()) => 0,
+                Err(e) => {
+                    log::error!("Failed to handle event: {e:?}");
+                    -1
+                }
+            }
+        })?;
+        let ring_buffer = builder.build()?;
+        // Let the child exec now that everything is set up
+        if let Some(gate) = gate {
+            gate.open()?;
+        }
+        loop {
+            ring_buffer.poll(Duration::from_millis(100))?;
+            let Some(root_child) = root_child else {
+                continue;
+            };
+            let code = match waitpid(root_child, Some(WaitPidFlag::WNOHANG))? {
+                WaitStatus::Exited(_, code) => code,
+                WaitStatus::Signaled(_, sig, _) => 128 + (sig as i32),
+                _ => continue,
+            };
+            // Drain the remaining events
+            ring_buffer.consume()?;
+            let mut this = this.borrow_mut();
+            this.report_dropped(skel)?;
+            this.pipeline.finish()?;
+            exit(code)
+        }
+    }
+
+    fn report_dropped(&mut self, skel: &TracexecSystemSkel) -> color_eyre::Result<()> {
+        let dropped: u64 = skel
+            .maps()
+            .dropped()
+            .lookup_percpu(&0u32.to_ne_bytes(), MapFlags::ANY)?
+            .unwrap_or_default()
+            .iter()
+            .map(|x| u64::from_ne_bytes(x[..8].try_into().unwrap()))
+            .sum();
+        if dropped != 0 {
+            log::warn!("{dropped} events were lost because the ring buffer or the traced map was full. The output is incomplete!");
+        }
+        Ok(())
+    }
+
+    fn handle_event(&mut self, data: &[u8]) -> color_eyre::Result<()> {
+        let hdr: EventHeader = read_event(data)?;
+        let pid = Pid::from_raw(hdr.pid as i32);
+        match hdr.r#type {
+            EVENT_EXEC_BEGIN => {
+                let event: ExecBeginEvent = read_event(data)?;
+                if let Some(old) = self.pending.remove(&pid) {
+                    log::warn!("{pid}: lost the result of exec {:?}", old.filename);
+                }
+                self.pending.insert(
+                    pid,
+                    PendingExec {
+                        syscall: event.syscall_nr,
+                        dirfd: event.dirfd,
+                        at_flags: event.at_flags,
+                        comm: comm_to_string(&event.comm),
+                        filename: Vec::new(),
+                        argv: Vec::new(),
+                        envp: Vec::new(),
+                        flags: 0,
+                        incomplete: false,
+                    },
+                );
+            }
+            EVENT_STRING => {
+                let event: StringEventHeader = read_event(data)?;
+                let Some(exec) = self.pending.get_mut(&pid) else {
+                    return Ok(());
+                };
+                let start = std::mem::size_of::<StringEventHeader>();
+                let Some(bytes) = data.get(start..start + event.len as usize) else {
+                    bail!("Truncated string event from ring buffer");
+                };
+                // Strip the NUL terminator
+                let bytes = bytes.strip_suffix(&[0]).unwrap_or(bytes);
+                exec.flags |= event.hdr.flags;
+                let target = match event.kind {
+                    STRING_FILENAME => {
+                        exec.filename = bytes.to_vec();
+                        return Ok(());
+                    }
+                    STRING_ARGV => &mut exec.argv,
+                    STRING_ENVP => &mut exec.envp,
+                    kind => bail!("Unknown string kind {kind}"),
+                };
+                if target.len() != event.index as usize {
+                    exec.incomplete = true;
+                }
+                target.push(intern_bytes(bytes));
+            }
+            EVENT_EXEC_ARGS_END => {
+                let event: ExecArgsEndEvent = read_event(data)?;
+                if let Some(exec) = self.pending.get_mut(&pid) {
+                    exec.flags |= event.hdr.flags;
+                    if exec.argv.len() != event.argc as usize
+                        || exec.envp.len() != event.envc as usize
+                    {
+                        exec.incomplete = true;
+                    }
+                }
+            }
+            EVENT_EXEC_DONE => {
+                let event: ExecDoneEvent = read_event(data)?;
+                let old_pid = Pid::from_raw(event.old_pid as i32);
+                if old_pid != pid {
+                    // de_thread: the exec happened in a non-leader thread
+                    if let Some(exec) = self.pending.remove(&old_pid) {
+                        self.pending.insert(pid, exec);
+                    }
+                }
+            }
+            EVENT_EXEC_RESULT => {
+                let event: ExecResultEvent = read_event(data)?;
+                let Some(exec) = self.pending.remove(&pid) else {
+                    log::warn!("{pid}: lost exec event with result {}", event.ret);
+                    return Ok(());
+                };
+                self.on_exec_result(Pid::from_raw(hdr.tgid as i32), exec, event.ret)?;
+            }
+            EVENT_FORK => {
+                let event: ForkEvent = read_event(data)?;
+                let parent = Pid::from_raw(hdr.tgid as i32);
+                let child = Pid::from_raw(event.child_pid as i32);
+                let (comm, env) = match self.store.get_current_mut(parent) {
+                    Some(parent_state) => (parent_state.comm.clone(), parent_state.env.clone()),
+                    None => (intern_str(""), None),
+                };
+                if self.print_children {
+                    self.pipeline.submit(TracerEvent::NewChild {
+                        pid: parent,
+                        comm: comm.clone(),
+                        child,
+                    })?;
+                }
+                let mut state = ProcessState::with_comm(child, comm);
+                state.ppid = Some(parent);
+                state.env = env;
+                self.store.insert(state);
+            }
+            EVENT_EXIT => {
+                if self.pending.remove(&pid).is_some() {
+                    log::debug!("{pid}: exited during exec");
+                }
+                // Threads are not in the store. The exit code is not reported.
+                if hdr.pid == hdr.tgid {
+                    self.store.mark_exited(pid, None);
+                }
+            }
+            other => bail!("Unknown event type {other}"),
+        }
+        Ok(())
+    }
+
+    fn on_exec_result(&mut self, pid: Pid, exec: PendingExec, ret: i64) -> color_eyre::Result<()> {
+        if exec.incomplete || exec.flags & FLAG_TRUNCATED != 0 {
+            log::warn!(
+                "{pid}: some arguments or environment variables of the exec are lost or truncated"
+            );
+        }
+        if exec.flags & FLAG_READ_FAILURE != 0 {
+            log::warn!("{pid}: failed to read some strings of the exec from memory");
+        }
+        if self.args.successful_only && ret != 0 {
+            return Ok(());
+        }
+        let pathname = PathBuf::from(OsString::from_vec(exec.filename));
+        let filename = if exec.syscall == libc::SYS_execveat {
+            // The process might be gone. Show what we've got in that case.
+            resolve_execveat_filename(pid, exec.dirfd, pathname.clone(), exec.at_flags)
+                .unwrap_or(pathname)
+        } else {
+            pathname
+        };
+        // Not shown ones still update the process state
+        let shown = self
+            .args
+            .accepts(&filename, &exec.comm, &exec.argv, &exec.envp, ret);
+        let interpreters = if shown && self.args.trace_interpreter && ret == 0 {
+            read_interpreter_recursive(&filename)
+        } else {
+            vec![]
+        };
+        let cwd = if shown && (self.args.trace_cwd || self.args.print_cmdline) {
+            read_cwd(pid).unwrap_or_default()
+        } else {
+            PathBuf::new()
+        };
+        let cwd = intern_path(&cwd);
+        if self.store.get_current_mut(pid).is_none() {
+            self.store
+                .insert(ProcessState::with_comm(pid, exec.comm.clone()));
+        }
+        let state = self.store.get_current_mut(pid).unwrap();
+        state.comm = if ret == 0 {
+            // The kernel sets comm to the basename of the filename
+            comm_from_filename(&filename)
+        } else {
+            exec.comm.clone()
+        };
+        let env = match self.args.track_env() && ret == 0 {
+            true => state.replace_env(&exec.envp),
+            false => state.env.clone(),
+        };
+        if !shown {
+            return Ok(());
+        }
+        self.pipeline.submit(TracerEvent::Exec(ExecEvent {
+            pid,
+            comm: exec.comm,
+            result: ret,
+            env,
+            exec_data: ExecData {
+                filename: intern_path(&filename),
+                argv: exec.argv,
+                envp: exec.envp,
+                cwd,
+                interpreters,
+            },
+        }))?;
+        Ok(())
+    }
+}
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: GPL-2.0
+// Shared between the eBPF program and userspace(src/bpf.rs).
+// Keep the layouts in sync with the Rust definitions.
+#ifndef TRACEXEC_INTERFACE_H
+#define TRACEXEC_INTERFACE_H
+
+#include <linux/types.h>
+
+#define TASK_COMM_LEN 16
+// Max length of a single string, including the NUL terminator.
+// Must be a power of 2.
+#define STRING_MAX_LEN 4096
+// Max number of argv/envp entries that are copied per exec
+#define ARGS_MAX 1024
+// Max number of traced tasks when scoping by pid subtree
+#define TRACED_MAX 65536
+
+enum event_type {
+    EVENT_EXEC_BEGIN = 1,
+    EVENT_STRING = 2,
+    EVENT_EXEC_ARGS_END = 3,
+    EVENT_EXEC_RESULT = 4,
+    EVENT_EXEC_DONE = 5,
+    EVENT_FORK = 6,
+    EVENT_EXIT = 7,
+};
+
+enum string_kind {
+    STRING_FILENAME = 1,
+    STRING_ARGV = 2,
+    STRING_ENVP = 3,
+};
+
+enum event_flags {
+    // Some strings could not be read from tracee memory
+    FLAG_READ_FAILURE = 1,
+    // The string or the array is truncated
+    FLAG_TRUNCATED = 2,
+};
+
+struct event_header {
+    __u32 type;
+    // Thread id of the task that generated the event
+    __u32 pid;
+    __u32 tgid;
+    __u32 flags;
+};
+
+struct exec_begin_event {
+    struct event_header hdr;
+    __s64 syscall_nr;
+    __s32 dirfd;
+    __s32 at_flags;
+    char comm[TASK_COMM_LEN];
+};
+
+struct string_event {
+    struct event_header hdr;
+    __u32 kind;
+    __u32 index;
+    __u32 len;
+    __u32 _pad;
+    char data[STRING_MAX_LEN];
+};
+
+struct exec_args_end_event {
+    struct event_header hdr;
+    __u32 argc;
+    __u32 envc;
+};
+
+struct exec_result_event {
+    struct event_header hdr;
+    __s64 ret;
+};
+
+// sched_process_exec: the exec succeeded and the task might have changed its pid(de_thread)
+struct exec_done_event {
+    struct event_header hdr;
+    __u32 old_pid;
+    __u32 _pad;
+};
+
+struct fork_event {
+    struct event_header hdr;
+    __u32 child_pid;
+    __u32 _pad;
+};
+
+// Sent for every traced thread. The exit code is not available without BTF.
+struct exit_event {
+    struct event_header hdr;
+};
+
+#endif
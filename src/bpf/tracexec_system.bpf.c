@@ -0,0 +1,314 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copies exec events of the traced processes into a ring buffer.
+//
+// The tracepoint context layouts are taken from
+// /sys/kernel/tracing/events/{syscalls,sched,task}/*/format,
+// so that this program does not depend on BTF/CO-RE.
+#include <stdbool.h>
+#include <linux/bpf.h>
+#include <linux/sched.h>
+#include <bpf/bpf_helpers.h>
+#include "interface.h"
+
+char LICENSE[] SEC("license") = "GPL";
+
+// Only trace tasks in this cgroup(v2) if non-zero.
+// Otherwise, trace the pid subtrees in the `traced` map.
+const volatile __u64 target_cgroup_id = 0;
+// Cleared when the output does not need them
+const volatile bool read_argv = true;
+const volatile bool read_envp = true;
+
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, 64 * 1024 * 1024);
+} events SEC(".maps");
+
+// tid -> 1
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, TRACED_MAX);
+    __type(key, __u32);
+    __type(value, __u8);
+} traced SEC(".maps");
+
+// Scratch buffer for variable sized string events
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct string_event);
+} string_scratch SEC(".maps");
+
+// [0]: number of events dropped because the ring buffer is full
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u64);
+} dropped SEC(".maps");
+
+struct sys_enter_ctx {
+    __u64 __common;
+    __s32 syscall_nr;
+    __u32 __pad;
+    __u64 args[6];
+};
+
+struct sys_exit_ctx {
+    __u64 __common;
+    __s32 syscall_nr;
+    __u32 __pad;
+    __s64 ret;
+};
+
+struct task_newtask_ctx {
+    __u64 __common;
+    __s32 pid;
+    char comm[TASK_COMM_LEN];
+    __u64 clone_flags;
+    __s16 oom_score_adj;
+};
+
+struct sched_process_exec_ctx {
+    __u64 __common;
+    __u32 filename_data_loc;
+    __s32 pid;
+    __s32 old_pid;
+};
+
+struct sched_process_exit_ctx {
+    __u64 __common;
+    char comm[TASK_COMM_LEN];
+    __s32 pid;
+    __s32 prio;
+};
+
+static __always_inline void count_dropped(void)
+{
+    __u32 zero = 0;
+    __u64 *cnt = bpf_map_lookup_elem(&dropped, &zero);
+    if (cnt)
+        *cnt += 1;
+}
+
+static __always_inline int is_traced(__u32 tid)
+{
+    if (target_cgroup_id)
+        return bpf_get_current_cgroup_id() == target_cgroup_id;
+    return bpf_map_lookup_elem(&traced, &tid) != NULL;
+}
+
+static __always_inline void fill_header(struct event_header *hdr, __u32 type)
+{
+    __u64 pid_tgid = bpf_get_current_pid_tgid();
+    hdr->type = type;
+    hdr->pid = (__u32)pid_tgid;
+    hdr->tgid = pid_tgid >> 32;
+    hdr->flags = 0;
+}
+
+static __always_inline int emit_string(__u32 kind, __u32 index, const char *str)
+{
+    __u32 zero = 0;
+    struct string_event *e = bpf_map_lookup_elem(&string_scratch, &zero);
+    if (!e)
+        return -1;
+    fill_header(&e->hdr, EVENT_STRING);
+    e->kind = kind;
+    e->index = index;
+    long len = bpf_probe_read_user_str(e->data, STRING_MAX_LEN, str);
+    if (len < 0) {
+        e->hdr.flags |= FLAG_READ_FAILURE;
+        len = 0;
+    } else if (len >= STRING_MAX_LEN) {
+        // Also makes the bound of len obvious to the verifier
+        len = STRING_MAX_LEN;
+        // The copy is always NUL terminated. It is only truncated if the source
+        // does not end right there.
+        char last = 0;
+        if (bpf_probe_read_user(&last, 1, str + STRING_MAX_LEN - 1) || last)
+            e->hdr.flags |= FLAG_TRUNCATED;
+    }
+    e->len = len;
+    // Only submit the used part of the buffer
+    if (bpf_ringbuf_output(&events, e, sizeof(*e) - STRING_MAX_LEN + len, 0)) {
+        count_dropped();
+        return -1;
+    }
+    return 0;
+}
+
+static __always_inline __u32 emit_string_array(__u32 kind, const char *const *array, __u32 *flags)
+{
+    __u32 i;
+    if (!array)
+        return 0;
+    for (i = 0; i < ARGS_MAX; i++) {
+        const char *ptr = NULL;
+        if (bpf_probe_read_user(&ptr, sizeof(ptr), &array[i])) {
+            *flags |= FLAG_READ_FAILURE;
+            return i;
+        }
+        if (!ptr)
+            return i;
+        if (emit_string(kind, i, ptr))
+            *flags |= FLAG_TRUNCATED;
+    }
+    *flags |= FLAG_TRUNCATED;
+    return i;
+}
+
+static __always_inline int trace_exec(__s64 nr, __s32 dirfd, const char *filename,
+                                      const char *const *argv, const char *const *envp,
+                                      __s32 at_flags)
+{
+    __u32 tid = (__u32)bpf_get_current_pid_tgid();
+    if (!is_traced(tid))
+        return 0;
+    struct exec_begin_event *begin = bpf_ringbuf_reserve(&events, sizeof(*begin), 0);
+    if (!begin) {
+        count_dropped();
+        return 0;
+    }
+    fill_header(&begin->hdr, EVENT_EXEC_BEGIN);
+    begin->syscall_nr = nr;
+    begin->dirfd = dirfd;
+    begin->at_flags = at_flags;
+    bpf_get_current_comm(begin->comm, sizeof(begin->comm));
+    bpf_ringbuf_submit(begin, 0);
+
+    __u32 flags = 0;
+    if (emit_string(STRING_FILENAME, 0, filename))
+        flags |= FLAG_TRUNCATED;
+    __u32 argc = read_argv ? emit_string_array(STRING_ARGV, argv, &flags) : 0;
+    __u32 envc = read_envp ? emit_string_array(STRING_ENVP, envp, &flags) : 0;
+
+    struct exec_args_end_event *end = bpf_ringbuf_reserve(&events, sizeof(*end), 0);
+    if (!end) {
+        count_dropped();
+        return 0;
+    }
+    fill_header(&end->hdr, EVENT_EXEC_ARGS_END);
+    end->hdr.flags = flags;
+    end->argc = argc;
+    end->envc = envc;
+    bpf_ringbuf_submit(end, 0);
+    return 0;
+}
+
+SEC("tracepoint/syscalls/sys_enter_execve")
+int tp_sys_enter_execve(struct sys_enter_ctx *ctx)
+{
+    // int execve(const char *pathname, char *const argv[], char *const envp[]);
+    return trace_exec(ctx->syscall_nr, -100 /* AT_FDCWD */, (const char *)ctx->args[0],
+                      (const char *const *)ctx->args[1], (const char *const *)ctx->args[2], 0);
+}
+
+SEC("tracepoint/syscalls/sys_enter_execveat")
+int tp_sys_enter_execveat(struct sys_enter_ctx *ctx)
+{
+    // int execveat(int dirfd, const char *pathname, char *const argv[], char *const envp[], int flags);
+    return trace_exec(ctx->syscall_nr, (__s32)ctx->args[0], (const char *)ctx->args[1],
+                      (const char *const *)ctx->args[2], (const char *const *)ctx->args[3],
+                      (__s32)ctx->args[4]);
+}
+
+static __always_inline int trace_exec_exit(struct sys_exit_ctx *ctx)
+{
+    __u32 tid = (__u32)bpf_get_current_pid_tgid();
+    if (!is_traced(tid))
+        return 0;
+    struct exec_result_event *e = bpf_ringbuf_reserve(&events, sizeof(*e), 0);
+    if (!e) {
+        count_dropped();
+        return 0;
+    }
+    fill_header(&e->hdr, EVENT_EXEC_RESULT);
+    e->ret = ctx->ret;
+    bpf_ringbuf_submit(e, 0);
+    return 0;
+}
+
+SEC("tracepoint/syscalls/sys_exit_execve")
+int tp_sys_exit_execve(struct sys_exit_ctx *ctx)
+{
+    return trace_exec_exit(ctx);
+}
+
+SEC("tracepoint/syscalls/sys_exit_execveat")
+int tp_sys_exit_execveat(struct sys_exit_ctx *ctx)
+{
+    return trace_exec_exit(ctx);
+}
+
+SEC("tracepoint/sched/sched_process_exec")
+int tp_sched_process_exec(struct sched_process_exec_ctx *ctx)
+{
+    __u32 pid = ctx->pid, old_pid = ctx->old_pid;
+    if (!target_cgroup_id && pid != old_pid) {
+        // A non-leader thread called exec and took over the pid of the leader
+        __u8 one = 1;
+        if (!bpf_map_lookup_elem(&traced, &old_pid))
+            return 0;
+        bpf_map_delete_elem(&traced, &old_pid);
+        bpf_map_update_elem(&traced, &pid, &one, BPF_ANY);
+    } else if (!is_traced(pid)) {
+        return 0;
+    }
+    struct exec_done_event *e = bpf_ringbuf_reserve(&events, sizeof(*e), 0);
+    if (!e) {
+        count_dropped();
+        return 0;
+    }
+    fill_header(&e->hdr, EVENT_EXEC_DONE);
+    e->old_pid = old_pid;
+    bpf_ringbuf_submit(e, 0);
+    return 0;
+}
+
+// Unlike sched_process_fork, this one has the clone flags to tell threads from processes.
+// It fires in the parent after the child can no longer fail to be created.
+SEC("tracepoint/task/task_newtask")
+int tp_task_newtask(struct task_newtask_ctx *ctx)
+{
+    __u32 parent = (__u32)bpf_get_current_pid_tgid(), child = ctx->pid;
+    if (!is_traced(parent))
+        return 0;
+    if (!target_cgroup_id) {
+        // Threads are tracked as well, they can exec
+        __u8 one = 1;
+        if (bpf_map_update_elem(&traced, &child, &one, BPF_ANY))
+            // The map is full. The subtree of the child won't be traced.
+            count_dropped();
+    }
+    if (ctx->clone_flags & CLONE_THREAD)
+        return 0;
+    struct fork_event *e = bpf_ringbuf_reserve(&events, sizeof(*e), 0);
+    if (!e) {
+        count_dropped();
+        return 0;
+    }
+    fill_header(&e->hdr, EVENT_FORK);
+    e->child_pid = child;
+    bpf_ringbuf_submit(e, 0);
+    return 0;
+}
+
+SEC("tracepoint/sched/sched_process_exit")
+int tp_sched_process_exit(struct sched_process_exit_ctx *ctx)
+{
+    __u32 tid = ctx->pid;
+    if (!is_traced(tid))
+        return 0;
+    if (!target_cgroup_id)
+        bpf_map_delete_elem(&traced, &tid);
+    struct exit_event *e = bpf_ringbuf_reserve(&events, sizeof(*e), 0);
+    if (!e) {
+        count_dropped();
+        return 0;
+    }
+    fill_header(&e->hdr, EVENT_EXIT);
+    bpf_ringbuf_submit(e, 0);
+    return 0;
+}
@@ -0,0 +1,232 @@
+//! Reading the details of an exec at its syscall-entry stop.
+//!
+//! Unlike ptrace requests, process_vm_readv and /proc/<pid>/mem work from any thread.
+//! With a [`CapturePool`], a tracer thread hands the exec over to a capture thread
+//! and serves other tracees meanwhile. The tracee stays stopped until the capture
+//! comes back to its tracer thread, which resumes it.
+//!
+//! Only the bytes are copied out while the tracee is stopped. Decoding them into an
+//! [`ExecData`] and looking up the interpreters waits until the tracee is running again.
+//! argv and envp are only read if the output or the filter needs them.
+//! With a filter, the reading stops as soon as the exec is rejected.
+
+use std::{
+    ops::Range,
+    path::PathBuf,
+    sync::{
+        mpsc::{channel, Receiver, Sender},
+        Arc, Mutex,
+    },
+    time::Instant,
+};
+
+use nix::unistd::Pid;
+
+use crate::{
+    filter::{Facts, Stage},
+    inspect::{RemoteMemory, StringArena, TraceeMemory},
+    intern::intern_path,
+    printer::PrinterArgs,
+    proc::{count_avoided_reads, read_interpreter_recursive, ProcDir},
+    shard::{install_wake_signal, Shards},
+    state::{ExecData, ProcessHandle},
+};
+
+/// An exec syscall at its syscall-entry stop
+pub struct ExecRequest {
+    pub handle: ProcessHandle,
+    pub pid: Pid,
+    /// The tracer thread of the tracee
+    pub shard: usize,
+    pub syscall: i64,
+    pub args: [u64; 6],
+    /// Taken from the process state while the request is out
+    pub proc_dir: Option<ProcDir>,
+    /// When the tracer saw the stop
+    pub stopped_at: Instant,
+    /// Receives argv and envp
+    pub arena: StringArena,
+    /// Before the exec
+    pub comm: Arc<str>,
+}
+
+pub struct ExecCapture {
+    pub handle: ProcessHandle,
+    pub proc_dir: Option<ProcDir>,
+    pub stopped_at: Instant,
+    pub result: color_eyre::Result<RawExec>,
+}
+
+/// The undecoded details of an exec, read at its syscall-entry stop
+#[derive(Debug)]
+pub struct RawExec {
+    pub filename: PathBuf,
+    pub cwd: PathBuf,
+    pub strings: StringArena,
+    pub argv: Range<usize>,
+    pub envp: Range<usize>,
+    /// Rejected by the filter before all of it was read
+    pub rejected: bool,
+    /// For the filter
+    pub facts: Facts,
+}
+
+impl RawExec {
+    /// Whether the exec is shown, once its result is known
+    pub fn accepted(&mut self, args: &PrinterArgs, result: i64) -> bool {
+        if self.rejected {
+            return false;
+        }
+        let Some(filter) = args.filter.as_ref() else {
+            return true;
+        };
+        filter.check_result(&mut self.facts, result);
+        filter.accepts_so_far(&self.facts, Stage::Result)
+    }
+
+    /// Decode the exec. Returns the arena for reuse.
+    pub fn decode(self, args: &PrinterArgs) -> (ExecData, StringArena) {
+        let interpreters = if args.trace_interpreter {
+            read_interpreter_recursive(&self.filename)
+        } else {
+            vec![]
+        };
+        let exec_data = ExecData {
+            filename: intern_path(&self.filename),
+            argv: self.strings.intern(self.argv),
+            envp: self.strings.intern(self.envp),
+            cwd: intern_path(&self.cwd),
+            interpreters,
+        };
+        (exec_data, self.strings)
+    }
+}
+
+impl ExecRequest {
+    fn proc_dir(&mut self) -> std::io::Result<&ProcDir> {
+        if self.proc_dir.is_none() {
+            self.proc_dir = Some(ProcDir::open(self.pid)?);
+        }
+        Ok(self.proc_dir.as_ref().unwrap())
+    }
+
+    /// Copy the exec out of the tracee
+    pub fn read(
+        &mut self,
+        args: &PrinterArgs,
+        memory: &mut impl TraceeMemory,
+    ) -> color_eyre::Result<RawExec> {
+        let mut arena = std::mem::take(&mut self.arena);
+        arena.clear();
+        let (filename, argv, envp) = if self.syscall == nix::libc::SYS_execveat {
+            log::trace!("pre execveat {}", self.syscall);
+            // int execveat(int dirfd, const char *pathname,
+            //              char *const _Nullable argv[],
+            //              char *const _Nullable envp[],
+            //              int flags);
+            let dirfd = self.args[0] as i32;
+            let pathname = memory.read_pathbuf(self.args[1] as usize)?;
+            let flags = self.args[4] as i32;
+            let filename = self
+                .proc_dir()?
+                .resolve_execveat_filename(dirfd, pathname, flags)?;
+            (filename, self.args[2], self.args[3])
+        } else {
+            log::trace!("pre execve {}", self.syscall);
+            let filename = memory.read_pathbuf(self.args[0] as usize)?;
+            (filename, self.args[1], self.args[2])
+        };
+        let mut raw_exec = RawExec {
+            filename,
+            cwd: PathBuf::new(),
+            strings: arena,
+            argv: 0..0,
+            envp: 0..0,
+            rejected: false,
+            facts: Facts::default(),
+        };
+        let filter = args.filter.as_deref();
+        if let Some(filter) = filter {
+            filter.check_filename(&mut raw_exec.facts, &raw_exec.filename, &self.comm);
+            raw_exec.rejected = !filter.accepts_so_far(&raw_exec.facts, Stage::Filename);
+        }
+        if !raw_exec.rejected {
+            if args.needs_argv() {
+                raw_exec.argv = memory.read_string_array(argv as usize, &mut raw_exec.strings)?;
+            }
+            if let Some(filter) = filter {
+                let strings = &raw_exec.strings;
+                filter.check_argv(
+                    &mut raw_exec.facts,
+                    raw_exec.argv.clone().map(|x| strings.get(x)),
+                );
+                raw_exec.rejected = !filter.accepts_so_far(&raw_exec.facts, Stage::Argv);
+            }
+        }
+        // The environment is tracked even for the execs that are not shown
+        if args.needs_envp() && (!raw_exec.rejected || args.track_env()) {
+            raw_exec.envp = memory.read_string_array(envp as usize, &mut raw_exec.strings)?;
+        }
+        if !raw_exec.rejected {
+            if let Some(filter) = filter {
+                let strings = &raw_exec.strings;
+                filter.check_envp(
+                    &mut raw_exec.facts,
+                    raw_exec.envp.clone().map(|x| strings.get(x)),
+                );
+                raw_exec.rejected = !filter.accepts_so_far(&raw_exec.facts, Stage::Env);
+            }
+        }
+        // The cwd can't wait, as the new program might change it
+        if !raw_exec.rejected && (args.trace_cwd || args.print_cmdline) {
+            raw_exec.cwd = self.proc_dir()?.read_cwd()?;
+        } else {
+            count_avoided_reads(1);
+        }
+        Ok(raw_exec)
+    }
+}
+
+/// Threads that read execs for the tracer threads
+#[derive(Clone)]
+pub struct CapturePool {
+    tx: Sender<ExecRequest>,
+}
+
+impl CapturePool {
+    pub fn new(threads: usize, args: &PrinterArgs, shards: Arc<Shards>) -> std::io::Result<Self> {
+        install_wake_signal();
+        let (tx, rx) = channel();
+        let rx = Arc::new(Mutex::new(rx));
+        for i in 0..threads {
+            let (rx, args, shards) = (rx.clone(), args.clone(), shards.clone());
+            std::thread::Builder::new()
+                .name(format!("capture-{i}"))
+                .spawn(move || serve(&rx, &args, &shards))?;
+        }
+        Ok(Self { tx })
+    }
+
+    pub fn submit(&self, request: ExecRequest) {
+        // The capture threads never exit
+        self.tx.send(request).unwrap();
+    }
+}
+
+fn serve(rx: &Mutex<Receiver<ExecRequest>>, args: &PrinterArgs, shards: &Shards) {
+    loop {
+        let Ok(mut request) = rx.lock().unwrap().recv() else {
+            return;
+        };
+        let result = request.read(args, &mut RemoteMemory::new(request.pid));
+        shards.complete(
+            request.shard,
+            ExecCapture {
+                handle: request.handle,
+                proc_dir: request.proc_dir,
+                stopped_at: request.stopped_at,
+                result,
+            },
+        );
+    }
+}
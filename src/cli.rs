@@ -1,8 +1,11 @@
 use std::path::PathBuf;
 
 use clap::{ArgAction, Args, Parser, Subcommand, ValueEnum};
+use regex::{bytes, Regex};
 use strum::Display;
 
+use crate::filter::ExecFilter;
+
 #[derive(Parser, Debug)]
 #[clap(author, version, about)]
 pub struct Cli {
@@ -20,7 +23,11 @@ pub struct Cli {
 pub enum CliCommand {
     #[clap(about = "Run tracexec in logging mode")]
     Log {
-        #[arg(last = true, required = true, help = "command to be executed")]
+        #[arg(
+            last = true,
+            required_unless_present_any = ["cgroup", "pid", "pgid"],
+            help = "command to be executed"
+        )]
         cmd: Vec<String>,
         #[clap(flatten)]
         tracing_args: TracingArgs,
@@ -48,8 +55,170 @@ pub enum Color {
     Never,
 }
 
+#[derive(Debug, Clone, Copy, ValueEnum, PartialEq, Display)]
+#[strum(serialize_all = "kebab-case")]
+pub enum Backend {
+    Ptrace,
+    #[cfg(feature = "ebpf")]
+    Ebpf,
+    /// Netlink proc connector. Lossy, but the tracees never stop
+    ProcConnector,
+    /// seccomp user notification (Linux 5.5+). The tracees are not ptraced
+    SeccompUserNotif,
+}
+
+#[derive(Debug, Clone, Copy, ValueEnum, PartialEq, Display)]
+#[strum(serialize_all = "kebab-case")]
+pub enum Backpressure {
+    /// Stop the tracer until the output catches up
+    Block,
+    /// Drop the events and count them
+    Drop,
+    /// Keep the events in the tracer and hand them over in a batch later.
+    /// At most as many as the queue size are kept, the rest are dropped and counted
+    Coalesce,
+}
+
+#[derive(Debug, Clone, Copy, ValueEnum, PartialEq, Display)]
+#[strum(serialize_all = "kebab-case")]
+pub enum FlushPolicy {
+    /// Write out every event at once
+    Event,
+    /// Write out buffered events every --flush-interval milliseconds
+    Interval,
+    /// Write out buffered events when there are no more events to process
+    Idle,
+}
+
+#[derive(Debug, Clone, Copy, ValueEnum, PartialEq, Display)]
+#[strum(serialize_all = "kebab-case")]
+pub enum DiffEnvAgainst {
+    /// The environment of tracexec
+    Tracer,
+    /// The environment of the last exec of the process or its ancestors
+    LastExec,
+}
+
+#[derive(Debug, Clone, Copy, ValueEnum, PartialEq, Display)]
+#[strum(serialize_all = "kebab-case")]
+pub enum SeccompBpf {
+    Auto,
+    On,
+    Off,
+}
+
 #[derive(Args, Debug)]
 pub struct TracingArgs {
+    #[clap(long, help = "Tracing backend", default_value_t = Backend::Ptrace)]
+    pub backend: Backend,
+    #[clap(
+        long,
+        help = "Trace the processes in this cgroup(v2) instead of the subtree of the command. Supported by the ebpf backend, and by the ptrace backend, which attaches to the processes in it and follows their descendants",
+        conflicts_with_all = ["pid", "pgid"]
+    )]
+    pub cgroup: Option<PathBuf>,
+    #[clap(
+        long,
+        help = "Attach to this running process and its descendants instead of running a command. Only supported by the ptrace backend",
+        conflicts_with = "pgid"
+    )]
+    pub pid: Option<i32>,
+    #[clap(
+        long,
+        help = "Attach to the running processes in this process group and their descendants instead of running a command. Only supported by the ptrace backend"
+    )]
+    pub pgid: Option<i32>,
+    #[clap(
+        long,
+        help = "Only stop the tracees at exec syscalls with a seccomp-bpf filter, which greatly improves performance. Without CAP_SYS_ADMIN, loading the filter sets PR_SET_NO_NEW_PRIVS on the command, so setuid/setgid programs and file capabilities can't raise the privileges of the tracees. Being traced already prevents that unless tracexec has CAP_SYS_PTRACE. Auto enables it if the kernel supports it and it doesn't take privileges away from the tracees",
+        default_value_t = SeccompBpf::Auto
+    )]
+    pub seccomp_bpf: SeccompBpf,
+    #[clap(
+        long,
+        help = "Number of ptrace tracer threads. The tracees stay on the thread that attached them, so more threads only help with --hand-over-children",
+        default_value_t = 1
+    )]
+    pub tracer_threads: usize,
+    #[clap(
+        long,
+        help = "Hand over a new child to the least busy tracer thread when the thread of its parent is busier. The child runs untraced for a moment during the handover, so an exec right after its fork can be missed, and a child it forks right away is not traced. Not done with seccomp-bpf. Only new children are moved: running processes and their subtrees stay on their thread"
+    )]
+    pub hand_over_children: bool,
+    #[clap(
+        long,
+        help = "Number of threads that read the arguments of execs from the tracees for the ptrace backend, so that the tracer threads keep serving other tracees meanwhile. 0 reads them in the tracer threads",
+        default_value_t = 0
+    )]
+    pub capture_threads: usize,
+    #[clap(
+        long,
+        help = "Stop tracing after this many execs and exit, leaving the tracees running. Sending SIGUSR1 to tracexec does the same at any time. With seccomp-bpf, the tracees can't run without a tracer, so tracexec only stops showing their execs and exits with the command. Only supported by the ptrace backend"
+    )]
+    pub max_events: Option<u64>,
+    #[clap(
+        long,
+        help = "Stop tracing after this many seconds, like --max-events. Only supported by the ptrace backend"
+    )]
+    pub max_duration: Option<u64>,
+    #[clap(
+        long,
+        help = "Stop tracing the processes deeper than this below the root processes, which are at depth 0. Pruned processes are detached, or with seccomp-bpf only no longer shown. Only supported by the ptrace backend"
+    )]
+    pub prune_depth: Option<u32>,
+    #[clap(
+        long,
+        value_parser = Regex::new,
+        help = "Stop tracing a process and its future children after it executes a program whose comm matches this regex, like --prune-depth. The exec itself is still shown"
+    )]
+    pub prune_comm: Option<Regex>,
+    #[clap(
+        long,
+        value_parser = bytes::Regex::new,
+        help = "Stop tracing a process and its future children after it executes a file whose path matches this regex, like --prune-depth. The exec itself is still shown"
+    )]
+    pub prune_filename: Option<bytes::Regex>,
+    #[clap(
+        long,
+        value_parser = ExecFilter::parse,
+        help = "Only show the execs matching this expression, like 'filename glob \"*/gcc*\" && argv contains \"-c\"'. Predicates: filename ~ REGEX, filename glob GLOB, comm ~ REGEX, comm == NAME, argv contains TEXT, argv ~ REGEX, env KEY, result == N, result != N, combined with !, &&, || and parentheses. The ptrace backend stops reading an exec as soon as it is rejected"
+    )]
+    pub filter: Option<ExecFilter>,
+    #[clap(
+        long,
+        help = "What to do when the output cannot keep up with the tracees",
+        default_value_t = Backpressure::Block
+    )]
+    pub backpressure: Backpressure,
+    #[clap(
+        long,
+        help = "Max number of events queued for the output",
+        default_value_t = 4096
+    )]
+    pub event_queue_size: usize,
+    #[clap(
+        long,
+        help = "When to write out the buffered output",
+        default_value_t = FlushPolicy::Idle
+    )]
+    pub flush: FlushPolicy,
+    #[clap(
+        long,
+        help = "Flush interval in milliseconds for --flush=interval",
+        default_value_t = 100
+    )]
+    pub flush_interval: u64,
+    #[clap(
+        long,
+        help = "Max number of exited processes kept in memory for their live descendants. The oldest ones are evicted beyond that"
+    )]
+    pub state_budget: Option<usize>,
+    #[clap(
+        long,
+        requires = "state_budget",
+        help = "Append the processes evicted by --state-budget to this file, one per line"
+    )]
+    pub state_spill_file: Option<PathBuf>,
     #[clap(long, help = "Only show successful calls", default_value_t = false)]
     pub successful_only: bool,
     #[clap(
@@ -80,6 +249,12 @@ pub struct TracingArgs {
         conflicts_with = "diff_env"
     )]
     pub no_diff_env: bool,
+    #[clap(
+        long,
+        help = "What to diff environment variables against",
+        default_value_t = DiffEnvAgainst::Tracer
+    )]
+    pub diff_env_against: DiffEnvAgainst,
     #[clap(
         long,
         help = "Show environment variables",
@@ -0,0 +1,82 @@
+//! Stopping the ptrace backend at runtime, while the tracees keep running.
+//!
+//! SIGUSR1 is blocked in all threads of tracexec and only received by the control thread,
+//! so that it never interrupts the tracer threads in the middle of something.
+
+use std::{
+    sync::Arc,
+    time::{Duration, Instant},
+};
+
+use nix::{errno::Errno, libc};
+
+use crate::shard::Shards;
+
+fn detach_sigset() -> libc::sigset_t {
+    unsafe {
+        let mut set: libc::sigset_t = std::mem::zeroed();
+        libc::sigemptyset(&mut set);
+        libc::sigaddset(&mut set, libc::SIGUSR1);
+        set
+    }
+}
+
+/// Block SIGUSR1 in the calling thread. Threads spawned afterwards inherit it.
+pub fn block_detach_signal() {
+    let set = detach_sigset();
+    unsafe { libc::pthread_sigmask(libc::SIG_BLOCK, &set, std::ptr::null_mut()) };
+}
+
+/// Undo [`block_detach_signal`] in a child before it runs the command
+pub fn unblock_detach_signal() {
+    let set = detach_sigset();
+    unsafe { libc::pthread_sigmask(libc::SIG_UNBLOCK, &set, std::ptr::null_mut()) };
+}
+
+/// Request the tracer threads to stop tracing on SIGUSR1, or once `max_duration` has passed.
+/// Detach requests from elsewhere raise SIGUSR1 as well, so that the control thread
+/// wakes up the tracer threads until they have all seen it.
+pub fn spawn_control_thread(
+    shards: Arc<Shards>,
+    max_duration: Option<Duration>,
+) -> std::io::Result<()> {
+    std::thread::Builder::new()
+        .name("control".to_string())
+        .spawn(move || {
+            let deadline = max_duration.map(|x| Instant::now() + x);
+            let set = detach_sigset();
+            loop {
+                let result = match deadline {
+                    Some(deadline) => {
+                        let left = deadline.saturating_duration_since(Instant::now());
+                        let timeout = libc::timespec {
+                            tv_sec: left.as_secs() as libc::time_t,
+                            tv_nsec: left.subsec_nanos() as libc::c_long,
+                        };
+                        unsafe { libc::sigtimedwait(&set, std::ptr::null_mut(), &timeout) }
+                    }
+                    None => unsafe { libc::sigwaitinfo(&set, std::ptr::null_mut()) },
+                };
+                if result != -1 {
+                    if !shards.detach_requested() {
+                        log::info!("Received SIGUSR1, stopping tracing");
+                    }
+                    break;
+                }
+                match Errno::last() {
+                    Errno::EAGAIN => {
+                        log::info!("Reached --max-duration, stopping tracing");
+                        break;
+                    }
+                    Errno::EINTR => continue,
+                    e => {
+                        log::error!("Failed to wait for SIGUSR1: {e}");
+                        return;
+                    }
+                }
+            }
+            shards.request_detach();
+            shards.wake_until_detached();
+        })?;
+    Ok(())
+}
@@ -0,0 +1,362 @@
+//! Diffing the environment of tracees against a baseline environment.
+//!
+//! The baseline is indexed once. Diffing an envp then only needs hash lookups
+//! and a reusable bitset to find out the removed entries, without heap allocations.
+
+use std::{
+    collections::HashMap,
+    sync::{Arc, OnceLock},
+};
+
+pub fn parse_env_entry(item: &str) -> (&str, &str) {
+    let mut sep_loc = item
+        .as_bytes()
+        .iter()
+        .position(|&x| x == b'=')
+        .unwrap_or_else(|| {
+            log::warn!(
+                "Invalid envp entry: {:?}, assuming value to empty string!",
+                item
+            );
+            item.len()
+        });
+    if sep_loc == 0 {
+        // Find the next equal sign
+        sep_loc = item
+            .as_bytes()
+            .iter()
+            .skip(1)
+            .position(|&x| x == b'=')
+            .unwrap_or_else(|| {
+                log::warn!(
+                    "Invalid envp entry staring with '=': {:?}, assuming value to empty string!",
+                    item
+                );
+                item.len()
+            });
+    }
+    let (head, tail) = item.split_at(sep_loc);
+    (head, tail.get(1..).unwrap_or_default())
+}
+
+/// An immutable, indexed environment
+#[derive(Debug, Default)]
+pub struct BaselineEnv {
+    /// Sorted by key, so that removed entries are reported in a stable order
+    entries: Vec<(String, String)>,
+    /// key -> index into entries
+    index: HashMap<String, usize>,
+}
+
+impl BaselineEnv {
+    pub fn new(vars: impl IntoIterator<Item = (String, String)>) -> Self {
+        // The first entry wins, like getenv
+        let mut first = HashMap::new();
+        for (k, v) in vars {
+            first.entry(k).or_insert(v);
+        }
+        let mut entries: Vec<(String, String)> = first.into_iter().collect();
+        entries.sort_unstable();
+        let index = entries
+            .iter()
+            .enumerate()
+            .map(|(idx, (k, _))| (k.clone(), idx))
+            .collect();
+        Self { entries, index }
+    }
+
+    pub fn len(&self) -> usize {
+        self.entries.len()
+    }
+}
+
+/// The environment of an exec, shared by the process and its descendants.
+///
+/// The index is only built when it is used as a baseline.
+#[derive(Debug)]
+pub struct EnvSnapshot {
+    envp: Vec<Arc<str>>,
+    baseline: OnceLock<BaselineEnv>,
+}
+
+impl EnvSnapshot {
+    /// Reuse `current` if the environment is unchanged, which is the common case.
+    pub fn share(current: Option<&Arc<Self>>, envp: &[Arc<str>]) -> Arc<Self> {
+        // Interned strings are usually the same allocation
+        let same = |a: &Arc<str>, b: &Arc<str>| Arc::ptr_eq(a, b) || a == b;
+        match current {
+            Some(current)
+                if current.envp.len() == envp.len()
+                    && current.envp.iter().zip(envp).all(|(a, b)| same(a, b)) =>
+            {
+                current.clone()
+            }
+            _ => Arc::new(Self {
+                envp: envp.to_vec(),
+                baseline: OnceLock::new(),
+            }),
+        }
+    }
+
+    pub fn baseline(&self) -> &BaselineEnv {
+        self.baseline.get_or_init(|| {
+            BaselineEnv::new(self.envp.iter().map(|item| {
+                let (k, v) = parse_env_entry(item);
+                (k.to_owned(), v.to_owned())
+            }))
+        })
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum EnvChange<'a> {
+    Added { key: &'a str, value: &'a str },
+    Modified { key: &'a str, value: &'a str },
+    Removed { key: &'a str, value: &'a str },
+}
+
+/// Reusable scratch space for diffing
+#[derive(Debug, Default)]
+pub struct EnvDiffer {
+    /// Bitset of the baseline entries that are present in the envp
+    seen: Vec<u64>,
+}
+
+impl EnvDiffer {
+    /// Iterate over the changes from `baseline` to `envp`.
+    ///
+    /// Added and modified entries come first in the order of `envp`,
+    /// followed by removed entries in the order of the baseline.
+    pub fn diff<'a>(&'a mut self, baseline: &'a BaselineEnv, envp: &'a [Arc<str>]) -> EnvDiff<'a> {
+        let words = (baseline.len() + 63) / 64;
+        self.seen.clear();
+        self.seen.resize(words, 0);
+        EnvDiff {
+            baseline,
+            envp: envp.iter(),
+            seen: &mut self.seen,
+            removed_cursor: 0,
+        }
+    }
+}
+
+pub struct EnvDiff<'a> {
+    baseline: &'a BaselineEnv,
+    envp: std::slice::Iter<'a, Arc<str>>,
+    seen: &'a mut [u64],
+    removed_cursor: usize,
+}
+
+impl<'a> Iterator for EnvDiff<'a> {
+    type Item = EnvChange<'a>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        for item in self.envp.by_ref() {
+            let (key, value) = parse_env_entry(item);
+            match self.baseline.index.get(key) {
+                Some(&idx) => {
+                    self.seen[idx / 64] |= 1 << (idx % 64);
+                    if self.baseline.entries[idx].1 != value {
+                        return Some(EnvChange::Modified { key, value });
+                    }
+                }
+                None => return Some(EnvChange::Added { key, value }),
+            }
+        }
+        while self.removed_cursor < self.baseline.len() {
+            let idx = self.removed_cursor;
+            self.removed_cursor += 1;
+            if self.seen[idx / 64] & (1 << (idx % 64)) == 0 {
+                let (key, value) = &self.baseline.entries[idx];
+                return Some(EnvChange::Removed { key, value });
+            }
+        }
+        None
+    }
+}
+
+/// Max number of memoized strings before the cache is reset
+const ESCAPE_CACHE_CAPACITY: usize = 8192;
+
+/// Memoized shell escaping. The environment of most tracees is largely the same.
+#[derive(Debug, Default)]
+pub struct EscapeCache {
+    cache: HashMap<Box<str>, Box<str>>,
+}
+
+impl EscapeCache {
+    pub fn escape(&mut self, s: &str) -> &str {
+        if !self.cache.contains_key(s) {
+            if self.cache.len() >= ESCAPE_CACHE_CAPACITY {
+                self.cache.clear();
+            }
+            let escaped = String::from_utf8_lossy(&shell_quote::bash::escape(s)).into();
+            self.cache.insert(s.into(), escaped);
+        }
+        &self.cache[s]
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn baseline(vars: &[(&str, &str)]) -> BaselineEnv {
+        BaselineEnv::new(vars.iter().map(|&(k, v)| (k.to_owned(), v.to_owned())))
+    }
+
+    fn envp(entries: &[&str]) -> Vec<Arc<str>> {
+        entries.iter().map(|&x| x.into()).collect()
+    }
+
+    #[test]
+    fn parse_entry() {
+        assert_eq!(parse_env_entry("A=B=C"), ("A", "B=C"));
+        assert_eq!(parse_env_entry("A="), ("A", ""));
+        assert_eq!(parse_env_entry("A"), ("A", ""));
+    }
+
+    #[test]
+    fn first_entry_wins() {
+        let env = baseline(&[("A", "1"), ("B", "2"), ("A", "3")]);
+        assert_eq!(env.len(), 2);
+        let envp = envp(&["A=1", "B=2"]);
+        assert_eq!(EnvDiffer::default().diff(&env, &envp).count(), 0);
+    }
+
+    #[test]
+    fn diff() {
+        let env = baseline(&[
+            ("HOME", "/root"),
+            ("PATH", "/bin"),
+            ("TERM", "xterm"),
+            ("LANG", "C"),
+        ]);
+        let envp = envp(&["TERM=xterm", "PATH=/usr/bin", "EDITOR=vi"]);
+        let mut differ = EnvDiffer::default();
+        let changes: Vec<_> = differ.diff(&env, &envp).collect();
+        assert_eq!(
+            changes,
+            [
+                EnvChange::Modified {
+                    key: "PATH",
+                    value: "/usr/bin"
+                },
+                EnvChange::Added {
+                    key: "EDITOR",
+                    value: "vi"
+                },
+                // In the order of the baseline, which is sorted
+                EnvChange::Removed {
+                    key: "HOME",
+                    value: "/root"
+                },
+                EnvChange::Removed {
+                    key: "LANG",
+                    value: "C"
+                },
+            ]
+        );
+    }
+
+    #[test]
+    fn reused_differ_across_bitset_words() {
+        let vars: Vec<_> = (0..200)
+            .map(|i| (format!("K{i:03}"), i.to_string()))
+            .collect();
+        let env = BaselineEnv::new(vars.iter().cloned());
+        let mut differ = EnvDiffer::default();
+        // Keep the odd entries, so that the set bits span several words
+        let odd: Vec<Arc<str>> = vars
+            .iter()
+            .filter(|(_, v)| v.parse::<u32>().unwrap() % 2 == 1)
+            .map(|(k, v)| format!("{k}={v}").into())
+            .collect();
+        let removed: Vec<_> = differ
+            .diff(&env, &odd)
+            .map(|change| match change {
+                EnvChange::Removed { key, .. } => key.to_owned(),
+                other => panic!("unexpected {other:?}"),
+            })
+            .collect();
+        let expected: Vec<_> = (0..200).step_by(2).map(|i| format!("K{i:03}")).collect();
+        assert_eq!(removed, expected);
+        // The bits of the last diff must not leak into the next one
+        assert_eq!(differ.diff(&env, &[]).count(), 200);
+        let all: Vec<Arc<str>> = vars
+            .iter()
+            .map(|(k, v)| format!("{k}={v}").into())
+            .collect();
+        assert_eq!(differ.diff(&env, &all).count(), 0);
+    }
+
+    /// The diff before the baseline was indexed: clone the map, remove what envp has
+    fn hashmap_diff(env: &HashMap<String, String>, envp: &[Arc<str>]) -> usize {
+        let mut env = env.clone();
+        let mut changes = 0;
+        for item in envp {
+            let (k, v) = parse_env_entry(item);
+            match env.remove(k) {
+                Some(orig_v) if orig_v == v => {}
+                _ => changes += 1,
+            }
+        }
+        changes + env.len()
+    }
+
+    /// cargo test --release -- --ignored --nocapture bench_diff
+    #[test]
+    #[ignore]
+    fn bench_diff() {
+        use std::{hint::black_box, time::Instant};
+        const ITERATIONS: u32 = 100_000;
+        let vars: Vec<_> = (0..100)
+            .map(|i| {
+                (
+                    format!("VARIABLE_{i:03}"),
+                    format!("/usr/local/lib/value/{i}"),
+                )
+            })
+            .collect();
+        // A typical exec: a few entries added, modified and removed
+        let mut envp: Vec<Arc<str>> = vars[2..]
+            .iter()
+            .enumerate()
+            .map(|(i, (k, v))| match i % 30 {
+                0 => format!("{k}=modified").into(),
+                _ => format!("{k}={v}").into(),
+            })
+            .collect();
+        envp.push("ADDED_1=1".into());
+        envp.push("ADDED_2=2".into());
+        let map: HashMap<String, String> = vars.iter().cloned().collect();
+        let env = BaselineEnv::new(vars.iter().cloned());
+        let mut differ = EnvDiffer::default();
+        assert_eq!(hashmap_diff(&map, &envp), differ.diff(&env, &envp).count());
+
+        let start = Instant::now();
+        for _ in 0..ITERATIONS {
+            black_box(hashmap_diff(black_box(&map), black_box(&envp)));
+        }
+        let hashmap = start.elapsed() / ITERATIONS;
+        let start = Instant::now();
+        for _ in 0..ITERATIONS {
+            black_box(differ.diff(black_box(&env), black_box(&envp)).count());
+        }
+        let bitset = start.elapsed() / ITERATIONS;
+        println!(
+            "env diff of {} entries: HashMap clone {hashmap:?}, bitset {bitset:?}",
+            envp.len()
+        );
+    }
+
+    #[test]
+    fn snapshot_is_shared_when_unchanged() {
+        let a = EnvSnapshot::share(None, &envp(&["A=1", "B=2"]));
+        let b = EnvSnapshot::share(Some(&a), &envp(&["A=1", "B=2"]));
+        assert!(Arc::ptr_eq(&a, &b));
+        let c = EnvSnapshot::share(Some(&a), &envp(&["A=1"]));
+        assert!(!Arc::ptr_eq(&a, &c));
+        assert_eq!(c.baseline().len(), 1);
+    }
+}
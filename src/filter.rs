@@ -0,0 +1,795 @@
+//! Expressions that select the execs to show.
+//!
+//! ```text
+//! filename ~ "regex"    filename glob "*/gcc*"
+//! comm ~ "regex"        comm == "make"
+//! argv contains "text"  argv ~ "regex"       (any argument)
+//! env "KEY"             (the key is in envp)
+//! result == 0           result != 0
+//! ```
+//!
+//! Predicates are combined with `!`, `&&`, `||` and parentheses. `&&` binds tighter than `||`.
+//!
+//! The patterns are compiled once, into one RegexSet or Aho-Corasick automaton per field,
+//! so that a field is scanned once however many predicates refer to it.
+//! The fields are checked in the order they are read from the tracee: filename and comm,
+//! then argv, then envp, then the result. The expression is evaluated after each stage with
+//! the fields not read yet left unknown, so that the rest of a rejected exec is never read.
+
+use std::{
+    os::unix::ffi::OsStrExt,
+    path::Path,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc,
+    },
+};
+
+use aho_corasick::{AhoCorasick, Anchored, Input, StartKind};
+use globset::GlobBuilder;
+use regex::{bytes, RegexSet};
+
+use crate::printer::UNKNOWN_EXEC_RESULT;
+
+/// Patterns per field are tracked in a bitmask
+const MAX_PATTERNS: usize = 64;
+
+#[derive(Debug, Clone)]
+enum Expr {
+    Not(Box<Expr>),
+    And(Box<Expr>, Box<Expr>),
+    Or(Box<Expr>, Box<Expr>),
+    /// Bit of a pattern of the field
+    Filename(u32),
+    Comm(u32),
+    Argv(u32),
+    Env(u32),
+    Result(i64),
+}
+
+#[derive(Debug, Clone)]
+pub struct ExecFilter {
+    expr: Expr,
+    filename: bytes::RegexSet,
+    comm: RegexSet,
+    argv_contains: AhoCorasick,
+    /// Bit of each pattern of `argv_contains`
+    argv_contains_bits: Vec<u32>,
+    argv_regex: bytes::RegexSet,
+    argv_regex_bits: Vec<u32>,
+    /// `KEY=`, matched at the start of each entry
+    env: AhoCorasick,
+}
+
+/// What is known about an exec so far.
+/// A checked field holds the bits of the patterns that matched it.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct Facts {
+    filename: Option<u64>,
+    comm: Option<u64>,
+    argv: Option<u64>,
+    env: Option<u64>,
+    result: Option<i64>,
+}
+
+/// The fields checked before an evaluation of the expression
+#[derive(Debug, Clone, Copy)]
+pub enum Stage {
+    /// The filename and the comm
+    Filename = 0,
+    Argv = 1,
+    Env = 2,
+    Result = 3,
+}
+
+/// Execs rejected at each [`Stage`]
+static REJECTED: [AtomicU64; 4] = [
+    AtomicU64::new(0),
+    AtomicU64::new(0),
+    AtomicU64::new(0),
+    AtomicU64::new(0),
+];
+
+pub fn log_stats() {
+    let [filename, argv, env, result] = [0, 1, 2, 3].map(|x| REJECTED[x].load(Ordering::Relaxed));
+    let total = filename + argv + env + result;
+    if total != 0 {
+        log::info!(
+            "filter: rejected {total} execs, {filename} by filename and comm, {argv} by argv, {env} by env, {result} by result",
+        );
+    }
+}
+
+impl ExecFilter {
+    pub fn parse(s: &str) -> Result<Self, String> {
+        let mut parser = Parser {
+            tokens: tokenize(s)?,
+            pos: 0,
+            patterns: Patterns::default(),
+        };
+        let expr = parser.parse_or()?;
+        if let Some(token) = parser.tokens.get(parser.pos) {
+            return Err(format!("unexpected `{token}`"));
+        }
+        parser.patterns.compile(expr)
+    }
+
+    /// Check the filename and the comm before exec
+    pub fn check_filename(&self, facts: &mut Facts, filename: &Path, comm: &str) {
+        facts.filename = Some(to_bits(
+            self.filename
+                .matches(filename.as_os_str().as_bytes())
+                .iter(),
+        ));
+        facts.comm = Some(to_bits(self.comm.matches(comm).iter()));
+    }
+
+    /// Whether some predicate needs argv
+    pub fn uses_argv(&self) -> bool {
+        !self.argv_contains_bits.is_empty() || !self.argv_regex_bits.is_empty()
+    }
+
+    /// Whether some predicate needs envp
+    pub fn uses_env(&self) -> bool {
+        self.env.patterns_len() != 0
+    }
+
+    pub fn check_argv<'a>(&self, facts: &mut Facts, argv: impl IntoIterator<Item = &'a [u8]>) {
+        let mut bits = 0;
+        if self.uses_argv() {
+            for arg in argv {
+                for m in self.argv_contains.find_overlapping_iter(arg) {
+                    bits |= 1 << self.argv_contains_bits[m.pattern().as_usize()];
+                }
+                for idx in self.argv_regex.matches(arg).iter() {
+                    bits |= 1 << self.argv_regex_bits[idx];
+                }
+            }
+        }
+        facts.argv = Some(bits);
+    }
+
+    pub fn check_envp<'a>(&self, facts: &mut Facts, envp: impl IntoIterator<Item = &'a [u8]>) {
+        let mut bits = 0;
+        if self.uses_env() {
+            for entry in envp {
+                // The keys are unique and can't contain `=`, so at most one pattern matches
+                if let Some(m) = self.env.find(Input::new(entry).anchored(Anchored::Yes)) {
+                    bits |= 1 << m.pattern().as_usize();
+                }
+            }
+        }
+        facts.env = Some(bits);
+    }
+
+    /// An unknown result stays unknown, so that no result predicate holds for it
+    pub fn check_result(&self, facts: &mut Facts, result: i64) {
+        facts.result = (result != UNKNOWN_EXEC_RESULT).then_some(result);
+    }
+
+    /// None while it depends on the fields not checked yet
+    pub fn eval(&self, facts: &Facts) -> Option<bool> {
+        eval(&self.expr, facts)
+    }
+
+    /// Evaluate after a stage. Returns false if the exec is rejected.
+    ///
+    /// Stages might be skipped when their fields are not read, so the caller tells
+    /// which one has just been checked.
+    pub fn accepts_so_far(&self, facts: &Facts, stage: Stage) -> bool {
+        if self.eval(facts) != Some(false) {
+            return true;
+        }
+        REJECTED[stage as usize].fetch_add(1, Ordering::Relaxed);
+        false
+    }
+
+    /// Check an exec whose fields are all known, for the backends that get them at once
+    pub fn matches(
+        &self,
+        filename: &Path,
+        comm: &str,
+        argv: &[Arc<str>],
+        envp: &[Arc<str>],
+        result: i64,
+    ) -> bool {
+        let mut facts = Facts::default();
+        self.check_filename(&mut facts, filename, comm);
+        self.check_argv(&mut facts, argv.iter().map(|x| x.as_bytes()));
+        self.check_envp(&mut facts, envp.iter().map(|x| x.as_bytes()));
+        self.check_result(&mut facts, result);
+        self.eval(&facts) == Some(true)
+    }
+}
+
+fn to_bits(indices: impl Iterator<Item = usize>) -> u64 {
+    indices.fold(0, |bits, idx| bits | 1 << idx)
+}
+
+fn has(bits: Option<u64>, bit: u32) -> Option<bool> {
+    bits.map(|x| x & 1 << bit != 0)
+}
+
+/// Three-valued: None is unknown
+fn eval(expr: &Expr, facts: &Facts) -> Option<bool> {
+    match expr {
+        Expr::Not(x) => eval(x, facts).map(|x| !x),
+        Expr::And(a, b) => match (eval(a, facts), eval(b, facts)) {
+            (Some(false), _) | (_, Some(false)) => Some(false),
+            (Some(true), Some(true)) => Some(true),
+            _ => None,
+        },
+        Expr::Or(a, b) => match (eval(a, facts), eval(b, facts)) {
+            (Some(true), _) | (_, Some(true)) => Some(true),
+            (Some(false), Some(false)) => Some(false),
+            _ => None,
+        },
+        Expr::Filename(bit) => has(facts.filename, *bit),
+        Expr::Comm(bit) => has(facts.comm, *bit),
+        Expr::Argv(bit) => has(facts.argv, *bit),
+        Expr::Env(bit) => has(facts.env, *bit),
+        Expr::Result(result) => facts.result.map(|x| x == *result),
+    }
+}
+
+#[derive(Debug, Clone, PartialEq)]
+enum Token {
+    Ident(String),
+    Str(String),
+    Int(i64),
+    Tilde,
+    Eq,
+    Ne,
+    Not,
+    And,
+    Or,
+    LParen,
+    RParen,
+}
+
+impl std::fmt::Display for Token {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            Self::Ident(x) => write!(f, "{x}"),
+            Self::Str(x) => write!(f, "{x:?}"),
+            Self::Int(x) => write!(f, "{x}"),
+            Self::Tilde => write!(f, "~"),
+            Self::Eq => write!(f, "=="),
+            Self::Ne => write!(f, "!="),
+            Self::Not => write!(f, "!"),
+            Self::And => write!(f, "&&"),
+            Self::Or => write!(f, "||"),
+            Self::LParen => write!(f, "("),
+            Self::RParen => write!(f, ")"),
+        }
+    }
+}
+
+fn describe(token: Option<&Token>) -> String {
+    match token {
+        Some(token) => format!("`{token}`"),
+        None => "the end".to_string(),
+    }
+}
+
+fn tokenize(s: &str) -> Result<Vec<Token>, String> {
+    let mut tokens = Vec::new();
+    let mut chars = s.chars().peekable();
+    while let Some(c) = chars.next() {
+        let token = match c {
+            c if c.is_whitespace() => continue,
+            '~' => Token::Tilde,
+            '(' => Token::LParen,
+            ')' => Token::RParen,
+            '=' if chars.next_if_eq(&'=').is_some() => Token::Eq,
+            '!' if chars.next_if_eq(&'=').is_some() => Token::Ne,
+            '!' => Token::Not,
+            '&' if chars.next_if_eq(&'&').is_some() => Token::And,
+            '|' if chars.next_if_eq(&'|').is_some() => Token::Or,
+            '"' | '\'' => {
+                let mut string = String::new();
+                loop {
+                    match chars.next() {
+                        None => return Err("unterminated string".to_string()),
+                        Some(x) if x == c => break,
+                        // Other escapes are kept for the regexes
+                        Some('\\') => match chars.next_if(|&x| x == c || x == '\\') {
+                            Some(x) => string.push(x),
+                            None => string.push('\\'),
+                        },
+                        Some(x) => string.push(x),
+                    }
+                }
+                Token::Str(string)
+            }
+            c if c.is_ascii_digit() || c == '-' => {
+                let mut number = c.to_string();
+                while let Some(x) = chars.next_if(char::is_ascii_digit) {
+                    number.push(x);
+                }
+                Token::Int(
+                    number
+                        .parse()
+                        .map_err(|_| format!("invalid number {number:?}"))?,
+                )
+            }
+            c if c.is_ascii_alphabetic() => {
+                let mut ident = c.to_string();
+                while let Some(x) = chars.next_if(|x| x.is_ascii_alphanumeric() || *x == '_') {
+                    ident.push(x);
+                }
+                Token::Ident(ident)
+            }
+            c => return Err(format!("unexpected {c:?}")),
+        };
+        tokens.push(token);
+    }
+    Ok(tokens)
+}
+
+#[derive(Default)]
+struct Patterns {
+    filename: Vec<String>,
+    comm: Vec<String>,
+    /// (is regex, pattern)
+    argv: Vec<(bool, String)>,
+    env: Vec<String>,
+}
+
+impl Patterns {
+    /// Returns the bit of the pattern.
+    /// Predicates with the same pattern share a bit, since an automaton
+    /// might report only one of several identical patterns.
+    fn add<T: PartialEq>(list: &mut Vec<T>, pattern: T) -> Result<u32, String> {
+        if let Some(idx) = list.iter().position(|x| *x == pattern) {
+            return Ok(idx as u32);
+        }
+        if list.len() == MAX_PATTERNS {
+            return Err(format!(
+                "too many patterns, at most {MAX_PATTERNS} per field"
+            ));
+        }
+        list.push(pattern);
+        Ok(list.len() as u32 - 1)
+    }
+
+    fn compile(self, expr: Expr) -> Result<ExecFilter, String> {
+        let (regex, contains): (Vec<_>, Vec<_>) = (0..self.argv.len() as u32)
+            .zip(self.argv)
+            .partition(|(_, (is_regex, _))| *is_regex);
+        Ok(ExecFilter {
+            expr,
+            filename: bytes::RegexSet::new(&self.filename).map_err(|e| e.to_string())?,
+            comm: RegexSet::new(&self.comm).map_err(|e| e.to_string())?,
+            argv_contains: AhoCorasick::new(contains.iter().map(|(_, (_, x))| x))
+                .map_err(|e| e.to_string())?,
+            argv_contains_bits: contains.iter().map(|(bit, _)| *bit).collect(),
+            argv_regex: bytes::RegexSet::new(regex.iter().map(|(_, (_, x))| x))
+                .map_err(|e| e.to_string())?,
+            argv_regex_bits: regex.iter().map(|(bit, _)| *bit).collect(),
+            env: AhoCorasick::builder()
+                .start_kind(StartKind::Anchored)
+                .build(self.env.iter().map(|x| format!("{x}=")))
+                .map_err(|e| e.to_string())?,
+        })
+    }
+}
+
+struct Parser {
+    tokens: Vec<Token>,
+    pos: usize,
+    patterns: Patterns,
+}
+
+impl Parser {
+    fn next(&mut self) -> Option<Token> {
+        let token = self.tokens.get(self.pos).cloned();
+        self.pos += 1;
+        token
+    }
+
+    fn eat(&mut self, token: &Token) -> bool {
+        if self.tokens.get(self.pos) == Some(token) {
+            self.pos += 1;
+            return true;
+        }
+        false
+    }
+
+    fn string(&mut self) -> Result<String, String> {
+        match self.next() {
+            Some(Token::Str(s)) => Ok(s),
+            other => Err(format!(
+                "expected a quoted string, found {}",
+                describe(other.as_ref())
+            )),
+        }
+    }
+
+    fn parse_or(&mut self) -> Result<Expr, String> {
+        let mut expr = self.parse_and()?;
+        while self.eat(&Token::Or) {
+            expr = Expr::Or(Box::new(expr), Box::new(self.parse_and()?));
+        }
+        Ok(expr)
+    }
+
+    fn parse_and(&mut self) -> Result<Expr, String> {
+        let mut expr = self.parse_unary()?;
+        while self.eat(&Token::And) {
+            expr = Expr::And(Box::new(expr), Box::new(self.parse_unary()?));
+        }
+        Ok(expr)
+    }
+
+    fn parse_unary(&mut self) -> Result<Expr, String> {
+        if self.eat(&Token::Not) {
+            return Ok(Expr::Not(Box::new(self.parse_unary()?)));
+        }
+        if self.eat(&Token::LParen) {
+            let expr = self.parse_or()?;
+            if !self.eat(&Token::RParen) {
+                return Err("expected `)`".to_string());
+            }
+            return Ok(expr);
+        }
+        self.parse_predicate()
+    }
+
+    fn parse_predicate(&mut self) -> Result<Expr, String> {
+        let field = match self.next() {
+            Some(Token::Ident(field)) => field,
+            other => {
+                return Err(format!(
+                    "expected a field, found {}",
+                    describe(other.as_ref())
+                ))
+            }
+        };
+        let op = self.tokens.get(self.pos).cloned();
+        let expr = match (field.as_str(), op) {
+            ("filename", Some(Token::Tilde)) => {
+                self.pos += 1;
+                let regex = self.string()?;
+                Expr::Filename(Patterns::add(&mut self.patterns.filename, regex)?)
+            }
+            ("filename", Some(Token::Ident(op))) if op == "glob" => {
+                self.pos += 1;
+                let glob = GlobBuilder::new(&self.string()?)
+                    .build()
+                    .map_err(|e| e.to_string())?;
+                Expr::Filename(Patterns::add(
+                    &mut self.patterns.filename,
+                    glob.regex().to_string(),
+                )?)
+            }
+            ("comm", Some(Token::Tilde)) => {
+                self.pos += 1;
+                let regex = self.string()?;
+                Expr::Comm(Patterns::add(&mut self.patterns.comm, regex)?)
+            }
+            ("comm", Some(Token::Eq)) => {
+                self.pos += 1;
+                let regex = format!("^{}$", regex::escape(&self.string()?));
+                Expr::Comm(Patterns::add(&mut self.patterns.comm, regex)?)
+            }
+            ("argv", Some(Token::Tilde)) => {
+                self.pos += 1;
+                let regex = self.string()?;
+                Expr::Argv(Patterns::add(&mut self.patterns.argv, (true, regex))?)
+            }
+            ("argv", Some(Token::Ident(op))) if op == "contains" => {
+                self.pos += 1;
+                let text = self.string()?;
+                Expr::Argv(Patterns::add(&mut self.patterns.argv, (false, text))?)
+            }
+            ("env", Some(Token::Str(_))) => {
+                let key = self.string()?;
+                if key.contains('=') {
+                    return Err(format!("invalid environment variable name {key:?}"));
+                }
+                Expr::Env(Patterns::add(&mut self.patterns.env, key)?)
+            }
+            ("result", Some(op @ (Token::Eq | Token::Ne))) => {
+                self.pos += 1;
+                let result = match self.next() {
+                    Some(Token::Int(x)) => Expr::Result(x),
+                    other => {
+                        return Err(format!(
+                            "expected a number, found {}",
+                            describe(other.as_ref())
+                        ))
+                    }
+                };
+                match op {
+                    Token::Ne => Expr::Not(Box::new(result)),
+                    _ => result,
+                }
+            }
+            (field, op) => {
+                return Err(format!(
+                    "unexpected {} after `{field}`",
+                    describe(op.as_ref())
+                ))
+            }
+        };
+        Ok(expr)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn filter(s: &str) -> ExecFilter {
+        ExecFilter::parse(s).unwrap()
+    }
+
+    fn matches(
+        s: &str,
+        filename: &str,
+        comm: &str,
+        argv: &[&str],
+        envp: &[&str],
+        result: i64,
+    ) -> bool {
+        let argv: Vec<Arc<str>> = argv.iter().map(|&x| x.into()).collect();
+        let envp: Vec<Arc<str>> = envp.iter().map(|&x| x.into()).collect();
+        filter(s).matches(Path::new(filename), comm, &argv, &envp, result)
+    }
+
+    #[test]
+    fn and_binds_tighter_than_or() {
+        // true || (false && false)
+        let s = r#"comm == "make" || comm == "cc" && result == 1"#;
+        assert!(matches(s, "/bin/make", "make", &[], &[], 0));
+        // (true || false) && false would reject it
+        let s = r#"(comm == "make" || comm == "cc") && result == 1"#;
+        assert!(!matches(s, "/bin/make", "make", &[], &[], 0));
+    }
+
+    #[test]
+    fn not() {
+        assert!(matches(r#"!comm == "make""#, "/bin/cc", "cc", &[], &[], 0));
+        assert!(!matches(
+            r#"!comm == "make""#,
+            "/bin/make",
+            "make",
+            &[],
+            &[],
+            0
+        ));
+        assert!(matches(
+            r#"!!comm == "make""#,
+            "/bin/make",
+            "make",
+            &[],
+            &[],
+            0
+        ));
+        // `!` binds tighter than `&&`
+        let s = r#"!comm == "make" && result == 0"#;
+        assert!(matches(s, "/bin/cc", "cc", &[], &[], 0));
+        assert!(!matches(s, "/bin/make", "make", &[], &[], 0));
+        assert!(matches(
+            r#"!(comm == "make" && result == 0)"#,
+            "/bin/make",
+            "make",
+            &[],
+            &[],
+            1
+        ));
+    }
+
+    #[test]
+    fn fields() {
+        assert!(matches(
+            r#"filename glob "/usr/*/gcc*""#,
+            "/usr/bin/gcc-13",
+            "sh",
+            &[],
+            &[],
+            0
+        ));
+        assert!(matches(
+            r#"filename ~ "gcc$""#,
+            "/usr/bin/gcc",
+            "sh",
+            &[],
+            &[],
+            0
+        ));
+        assert!(matches(r#"comm ~ "^ma""#, "/bin/make", "make", &[], &[], 0));
+        assert!(!matches(
+            r#"comm == "mak""#,
+            "/bin/make",
+            "make",
+            &[],
+            &[],
+            0
+        ));
+        assert!(matches(
+            r#"argv contains "-O2""#,
+            "/bin/cc",
+            "cc",
+            &["cc", "-O2"],
+            &[],
+            0
+        ));
+        assert!(matches(
+            r#"argv ~ "^-O[0-9]$""#,
+            "/bin/cc",
+            "cc",
+            &["cc", "-O2"],
+            &[],
+            0
+        ));
+        assert!(!matches(
+            r#"argv ~ "^-O[0-9]$""#,
+            "/bin/cc",
+            "cc",
+            &["cc", "-O"],
+            &[],
+            0
+        ));
+        assert!(matches(
+            r#"env "CC""#,
+            "/bin/cc",
+            "cc",
+            &[],
+            &["CFLAGS=x", "CC=gcc"],
+            0
+        ));
+        assert!(!matches(
+            r#"env "C""#,
+            "/bin/cc",
+            "cc",
+            &[],
+            &["CC=gcc", "CFLAGS=C=x"],
+            0
+        ));
+    }
+
+    #[test]
+    fn result() {
+        assert!(matches("result == 0", "/bin/cc", "cc", &[], &[], 0));
+        assert!(!matches("result == 0", "/bin/cc", "cc", &[], &[], -2));
+        assert!(matches("result == -2", "/bin/cc", "cc", &[], &[], -2));
+        assert!(matches("result != 0", "/bin/cc", "cc", &[], &[], -2));
+        assert!(!matches("result != 0", "/bin/cc", "cc", &[], &[], 0));
+        let unknown = UNKNOWN_EXEC_RESULT;
+        assert!(!matches("result == 0", "/bin/cc", "cc", &[], &[], unknown));
+        assert!(!matches("result != 0", "/bin/cc", "cc", &[], &[], unknown));
+        assert!(matches(
+            "comm == \"cc\" || result == 0",
+            "/bin/cc",
+            "cc",
+            &[],
+            &[],
+            unknown
+        ));
+    }
+
+    #[test]
+    fn same_pattern_twice() {
+        let envp = ["PATH=/bin", "HOME=/root"];
+        assert!(matches(
+            r#"env "PATH" && env "PATH""#,
+            "/bin/cc",
+            "cc",
+            &[],
+            &envp,
+            0
+        ));
+        assert!(matches(
+            r#"env "HOME" && !env "X" && env "HOME""#,
+            "/bin/cc",
+            "cc",
+            &[],
+            &envp,
+            0
+        ));
+        let argv = ["cc", "-c"];
+        assert!(matches(
+            r#"argv contains "-c" && argv contains "-c""#,
+            "/bin/cc",
+            "cc",
+            &argv,
+            &[],
+            0
+        ));
+        assert!(matches(
+            r#"argv contains "c" && argv contains "-c""#,
+            "/bin/cc",
+            "cc",
+            &argv,
+            &[],
+            0
+        ));
+    }
+
+    #[test]
+    fn staged_eval() {
+        let f = filter(r#"comm == "make" && env "CC" && result == 0"#);
+        let mut facts = Facts::default();
+        assert_eq!(f.eval(&facts), None);
+        f.check_filename(&mut facts, Path::new("/bin/make"), "make");
+        assert_eq!(f.eval(&facts), None);
+        f.check_argv(&mut facts, [b"make".as_slice()]);
+        assert_eq!(f.eval(&facts), None);
+        f.check_envp(&mut facts, [b"CC=gcc".as_slice()]);
+        assert_eq!(f.eval(&facts), None);
+        f.check_result(&mut facts, 0);
+        assert_eq!(f.eval(&facts), Some(true));
+
+        // Rejected as soon as a conjunct is false
+        let mut facts = Facts::default();
+        f.check_filename(&mut facts, Path::new("/bin/cc"), "cc");
+        assert_eq!(f.eval(&facts), Some(false));
+
+        // Accepted as soon as a disjunct is true
+        let f = filter(r#"comm == "make" || env "CC""#);
+        let mut facts = Facts::default();
+        f.check_filename(&mut facts, Path::new("/bin/make"), "make");
+        assert_eq!(f.eval(&facts), Some(true));
+        let mut facts = Facts::default();
+        f.check_filename(&mut facts, Path::new("/bin/cc"), "cc");
+        assert_eq!(f.eval(&facts), None);
+        f.check_envp(&mut facts, [b"CC=gcc".as_slice()]);
+        assert_eq!(f.eval(&facts), Some(true));
+
+        // Unknown stays unknown under `!`
+        let f = filter(r#"!env "CC""#);
+        let mut facts = Facts::default();
+        f.check_filename(&mut facts, Path::new("/bin/cc"), "cc");
+        assert_eq!(f.eval(&facts), None);
+    }
+
+    #[test]
+    fn uses() {
+        let f = filter(r#"comm == "make""#);
+        assert!(!f.uses_argv() && !f.uses_env());
+        let f = filter(r#"argv contains "x" || env "CC""#);
+        assert!(f.uses_argv() && f.uses_env());
+    }
+
+    #[test]
+    fn parse_errors() {
+        for s in [
+            "",
+            "comm",
+            r#"comm == "#,
+            r#"comm == make"#,
+            r#"comm != "make""#,
+            r#"filename ~ "(""#,
+            r#"filename glob "[""#,
+            r#"comm == "make" &&"#,
+            r#"comm == "make" ||| result == 0"#,
+            r#"(comm == "make""#,
+            r#"comm == "make")"#,
+            r#"comm == "make" result == 0"#,
+            r#"comm == "unterminated"#,
+            r#"env "A=B""#,
+            r#"result == "0""#,
+            "result ~ 0",
+            "unknown == 0",
+            "result == 0 & result == 1",
+            "result == 99999999999999999999",
+            "$",
+        ] {
+            assert!(ExecFilter::parse(s).is_err(), "{s:?} parsed");
+        }
+    }
+
+    #[test]
+    fn too_many_patterns() {
+        let s = (0..=MAX_PATTERNS)
+            .map(|i| format!(r#"comm == "{i}""#))
+            .collect::<Vec<_>>()
+            .join(" || ");
+        assert!(ExecFilter::parse(&s).is_err());
+        // The same pattern doesn't count twice
+        let s = vec![r#"comm == "x""#; MAX_PATTERNS + 1].join(" || ");
+        assert!(ExecFilter::parse(&s).is_ok());
+    }
+}
@@ -1,34 +1,331 @@
 use std::{
     ffi::{CString, OsString},
-    os::unix::prelude::OsStringExt,
+    fs::File,
+    io,
+    ops::Range,
+    os::unix::prelude::{FileExt, OsStringExt},
     path::PathBuf,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc, OnceLock,
+    },
 };
 
-use nix::{sys::ptrace, sys::ptrace::AddressType, unistd::Pid};
+use nix::{errno::Errno, libc, sys::ptrace, sys::ptrace::AddressType, unistd::Pid};
+
+use crate::intern::intern_bytes;
+
+// We only decode syscalls of the native ABI, so the pointer size of the tracee is the same as ours.
+const WORD_SIZE: usize = std::mem::size_of::<usize>();
+/// Max number of iovecs per process_vm_readv call. (UIO_MAXIOV)
+const IOV_MAX: usize = 1024;
+
+static PROCESS_VM_READV_SUPPORTED: AtomicBool = AtomicBool::new(true);
+
+fn page_size() -> usize {
+    static PAGE_SIZE: OnceLock<usize> = OnceLock::new();
+    *PAGE_SIZE.get_or_init(|| match unsafe { libc::sysconf(libc::_SC_PAGESIZE) } {
+        -1 => 4096,
+        size => size as usize,
+    })
+}
+
+/// Number of bytes from `address` to the end of its page
+fn bytes_to_page_end(address: usize) -> usize {
+    page_size() - (address % page_size())
+}
+
+/// Read remote memory regions into `local` in one go.
+///
+/// At most [`IOV_MAX`] regions. Returns the number of leading regions that are read completely.
+/// Err is only returned when process_vm_readv is not usable for this tracee.
+fn process_vm_readv(pid: Pid, local: &mut [u8], remote: &[(usize, usize)]) -> Result<usize, Errno> {
+    if !PROCESS_VM_READV_SUPPORTED.load(Ordering::Relaxed) {
+        return Err(Errno::ENOSYS);
+    }
+    let local_iov = libc::iovec {
+        iov_base: local.as_mut_ptr() as *mut libc::c_void,
+        iov_len: local.len(),
+    };
+    // On the stack, so that reading an exec doesn't allocate
+    let mut remote_iov = [libc::iovec {
+        iov_base: std::ptr::null_mut(),
+        iov_len: 0,
+    }; IOV_MAX];
+    let remote_iov = &mut remote_iov[..remote.len()];
+    for (iov, &(base, len)) in remote_iov.iter_mut().zip(remote) {
+        iov.iov_base = base as *mut libc::c_void;
+        iov.iov_len = len;
+    }
+    let ret = unsafe {
+        libc::process_vm_readv(
+            pid.as_raw(),
+            &local_iov,
+            1,
+            remote_iov.as_ptr(),
+            remote_iov.len() as libc::c_ulong,
+            0,
+        )
+    };
+    let read = if ret == -1 {
+        match Errno::last() {
+            Errno::ENOSYS => {
+                log::debug!("process_vm_readv is not supported, falling back to PEEKDATA");
+                PROCESS_VM_READV_SUPPORTED.store(false, Ordering::Relaxed);
+                return Err(Errno::ENOSYS);
+            }
+            Errno::EPERM => return Err(Errno::EPERM),
+            e => {
+                // The callers decide how to report unreadable regions
+                log::trace!("process_vm_readv failed for {pid}: {e}");
+                0
+            }
+        }
+    } else {
+        ret as usize
+    };
+    // Partial reads stop at the first remote region that cannot be read.
+    let mut consumed = 0;
+    Ok(remote
+        .iter()
+        .take_while(|&&(_, len)| {
+            consumed += len;
+            consumed <= read
+        })
+        .count())
+}
+
+/// Strings of an exec, stored back to back in one buffer.
+///
+/// The arena is reused for every exec, so that reading argv and envp
+/// doesn't need an allocation per string. The read functions append to it
+/// and return the indices of the strings they read.
+#[derive(Debug, Default)]
+pub struct StringArena {
+    bytes: Vec<u8>,
+    /// Location of each string in `bytes`
+    strings: Vec<Range<usize>>,
+    /// Scratch space for reading tracee memory
+    buf: Vec<u8>,
+    pointers: Vec<usize>,
+    /// (index, next address to read) of the strings not read completely
+    pending: Vec<(usize, usize)>,
+    /// Parts of pages to read, as (address, length), sorted by address
+    regions: Vec<(usize, usize)>,
+    states: Vec<RegionState>,
+}
+
+/// The outcome of reading a region
+#[derive(Debug, Clone, Copy)]
+enum RegionState {
+    /// Read into the buffer at this offset
+    Read(usize),
+    Failed,
+    /// Not read, because an earlier region of its batch failed
+    Retry,
+}
+
+impl StringArena {
+    /// Forget all strings, keeping the allocations
+    pub fn clear(&mut self) {
+        self.bytes.clear();
+        self.strings.clear();
+    }
+
+    pub fn get(&self, idx: usize) -> &[u8] {
+        &self.bytes[self.strings[idx].clone()]
+    }
+
+    /// Intern the strings in `range`
+    pub fn intern(&self, range: Range<usize>) -> Vec<Arc<str>> {
+        range.map(|idx| intern_bytes(self.get(idx))).collect()
+    }
+
+    fn push(&mut self, bytes: &[u8]) {
+        let start = self.bytes.len();
+        self.bytes.extend_from_slice(bytes);
+        self.strings.push(start..self.bytes.len());
+    }
+
+    /// Append `bytes` to the string at `idx`
+    fn extend(&mut self, idx: usize, bytes: &[u8]) {
+        let range = self.strings[idx].clone();
+        if range.end != self.bytes.len() {
+            // Another string follows, so move this one to the end.
+            // The old copy is wasted until the arena is cleared.
+            let start = self.bytes.len();
+            self.bytes.extend_from_within(range);
+            self.strings[idx].start = start;
+        }
+        self.bytes.extend_from_slice(bytes);
+        self.strings[idx].end = self.bytes.len();
+    }
+
+    fn mark(&self) -> (usize, usize) {
+        (self.strings.len(), self.bytes.len())
+    }
+
+    /// Drop the strings added after `mark`
+    fn rollback(&mut self, (strings, bytes): (usize, usize)) {
+        self.strings.truncate(strings);
+        self.bytes.truncate(bytes);
+    }
+}
+
+/// Read a NULL-terminated pointer array in page-sized chunks
+fn read_remote_pointers(
+    pid: Pid,
+    address: AddressType,
+    buf: &mut Vec<u8>,
+    res: &mut Vec<usize>,
+) -> Result<(), Errno> {
+    res.clear();
+    buf.resize(page_size(), 0);
+    let mut address = address as usize;
+    loop {
+        let len = (bytes_to_page_end(address) / WORD_SIZE).max(1) * WORD_SIZE;
+        if process_vm_readv(pid, &mut buf[..len], &[(address, len)])? == 0 {
+            log::warn!("Cannot read tracee {pid} memory {address:#x}");
+            return Ok(());
+        }
+        for word in buf[..len].chunks_exact(WORD_SIZE) {
+            let ptr = usize::from_ne_bytes(word.try_into().unwrap());
+            if ptr == 0 {
+                return Ok(());
+            }
+            res.push(ptr);
+        }
+        address += len;
+    }
+}
+
+/// Read NUL-terminated strings into the arena with batched process_vm_readv calls.
+///
+/// Every round reads each unfinished string up to the end of its current page,
+/// so that an unmapped page only fails the strings that reach into it.
+/// argv and envp are packed, so many strings share a page. Each page is read once per round,
+/// from the first string on it, and the strings are sliced out of the shared buffer.
+fn read_remote_strings(
+    pid: Pid,
+    addresses: &[usize],
+    buf: &mut Vec<u8>,
+    arena: &mut StringArena,
+) -> Result<(), Errno> {
+    let first = arena.strings.len();
+    for _ in addresses {
+        arena.push(&[]);
+    }
+    let mut pending = std::mem::take(&mut arena.pending);
+    let mut regions = std::mem::take(&mut arena.regions);
+    let mut states = std::mem::take(&mut arena.states);
+    pending.clear();
+    pending.extend(addresses.iter().copied().enumerate());
+    let mut result = Ok(());
+    while !pending.is_empty() {
+        regions.clear();
+        regions.extend(pending.iter().map(|&(_, address)| (address, 0)));
+        regions.sort_unstable();
+        // Sorted, so the first address of each page is kept
+        regions.dedup_by(|b, a| b.0 / page_size() == a.0 / page_size());
+        for region in regions.iter_mut() {
+            region.1 = bytes_to_page_end(region.0);
+        }
+        buf.resize(regions.iter().map(|x| x.1).sum(), 0);
+        states.clear();
+        let mut offset = 0;
+        for batch in regions.chunks(IOV_MAX) {
+            let len: usize = batch.iter().map(|x| x.1).sum();
+            let complete = match process_vm_readv(pid, &mut buf[offset..offset + len], batch) {
+                Ok(complete) => complete,
+                Err(e) => {
+                    result = Err(e);
+                    break;
+                }
+            };
+            for (i, &(_, len)) in batch.iter().enumerate() {
+                states.push(match i.cmp(&complete) {
+                    std::cmp::Ordering::Less => RegionState::Read(offset),
+                    std::cmp::Ordering::Equal => RegionState::Failed,
+                    std::cmp::Ordering::Greater => RegionState::Retry,
+                });
+                offset += len;
+            }
+        }
+        if result.is_err() {
+            break;
+        }
+        // In the order of the strings, so that the arena stores them back to back
+        pending.retain_mut(|(idx, address)| {
+            let region = regions.partition_point(|&(start, _)| start <= *address) - 1;
+            let (start, len) = regions[region];
+            match states[region] {
+                RegionState::Read(offset) => {
+                    let chunk = &buf[offset + (*address - start)..offset + len];
+                    match memchr::memchr(0, chunk) {
+                        Some(pos) => {
+                            arena.extend(first + *idx, &chunk[..pos]);
+                            false
+                        }
+                        None => {
+                            arena.extend(first + *idx, chunk);
+                            *address += chunk.len();
+                            true
+                        }
+                    }
+                }
+                RegionState::Failed => {
+                    // Give up the string
+                    log::warn!("Cannot read tracee {pid} memory {address:#x} of string {idx}");
+                    false
+                }
+                RegionState::Retry => true,
+            }
+        });
+    }
+    arena.pending = pending;
+    arena.regions = regions;
+    arena.states = states;
+    result
+}
+
+/// Read a string with process_vm_readv
+fn read_remote_bytes(pid: Pid, address: usize) -> Result<Vec<u8>, Errno> {
+    let mut arena = StringArena::default();
+    read_remote_strings(pid, &[address], &mut Vec::new(), &mut arena)?;
+    // The string is the only one in the arena
+    Ok(arena.bytes)
+}
 
 pub fn read_generic_string<TString>(
     pid: Pid,
     address: AddressType,
     ctor: impl Fn(Vec<u8>) -> TString,
 ) -> color_eyre::Result<TString> {
-    let mut buf = Vec::new();
-    let mut address = address;
-    const WORD_SIZE: usize = 8; // FIXME
+    match read_remote_bytes(pid, address as usize) {
+        Ok(bytes) => return Ok(ctor(bytes)),
+        Err(e) => log::trace!("process_vm_readv failed: {e}, falling back to PEEKDATA"),
+    }
+    let mut res = Vec::new();
+    peek_string(pid, address, &mut res);
+    Ok(ctor(res))
+}
+
+/// Read a string with PEEKDATA and append it to `buf`
+fn peek_string(pid: Pid, mut address: AddressType, buf: &mut Vec<u8>) {
     loop {
         let word = match ptrace::read(pid, address) {
             Err(e) => {
                 log::warn!("Cannot read tracee {pid} memory {address:?}: {e}");
-                return Ok(ctor(buf));
+                return;
             }
             Ok(word) => word,
         };
         let word_bytes = word.to_ne_bytes();
-        for &byte in word_bytes.iter() {
-            if byte == 0 {
-                return Ok(ctor(buf));
-            }
-            buf.push(byte);
+        if let Some(pos) = memchr::memchr(0, &word_bytes) {
+            buf.extend_from_slice(&word_bytes[..pos]);
+            return;
         }
+        buf.extend_from_slice(&word_bytes);
         address = unsafe { address.add(WORD_SIZE) };
     }
 }
@@ -42,18 +339,12 @@ pub fn read_pathbuf(pid: Pid, address: AddressType) -> color_eyre::Result<PathBu
     read_generic_string(pid, address, |x| PathBuf::from(OsString::from_vec(x)))
 }
 
-pub fn read_string(pid: Pid, address: AddressType) -> color_eyre::Result<String> {
-    // Waiting on https://github.com/rust-lang/libs-team/issues/116
-    read_generic_string(pid, address, |x| String::from_utf8_lossy(&x).to_string())
-}
-
 pub fn read_null_ended_array<TItem>(
     pid: Pid,
     mut address: AddressType,
-    reader: impl Fn(Pid, AddressType) -> color_eyre::Result<TItem>,
+    mut reader: impl FnMut(Pid, AddressType) -> color_eyre::Result<TItem>,
 ) -> color_eyre::Result<Vec<TItem>> {
     let mut res = Vec::new();
-    const WORD_SIZE: usize = 8; // FIXME
     loop {
         let ptr = match ptrace::read(pid, address) {
             Err(e) => {
@@ -71,11 +362,311 @@ pub fn read_null_ended_array<TItem>(
     }
 }
 
+/// Read a NULL-terminated array of strings into the arena with batched process_vm_readv calls.
+/// Nothing is added to the arena on errors.
+fn read_remote_string_array(
+    pid: Pid,
+    address: usize,
+    arena: &mut StringArena,
+) -> Result<Range<usize>, Errno> {
+    let start = arena.strings.len();
+    if address == 0 {
+        // Linux treats NULL argv/envp as empty arrays
+        return Ok(start..start);
+    }
+    let mark = arena.mark();
+    let mut buf = std::mem::take(&mut arena.buf);
+    let mut pointers = std::mem::take(&mut arena.pointers);
+    let result = read_remote_pointers(pid, address as AddressType, &mut buf, &mut pointers)
+        .and_then(|()| read_remote_strings(pid, &pointers, &mut buf, arena));
+    arena.buf = buf;
+    arena.pointers = pointers;
+    match result {
+        Ok(()) => Ok(start..arena.strings.len()),
+        Err(e) => {
+            arena.rollback(mark);
+            Err(e)
+        }
+    }
+}
+
+/// Read a NULL-terminated array of strings into the arena.
+///
+/// All strings are fetched with batched process_vm_readv calls.
+/// PEEKDATA is used as the fallback when process_vm_readv is denied.
+pub fn read_string_array(
+    pid: Pid,
+    address: AddressType,
+    arena: &mut StringArena,
+) -> color_eyre::Result<Range<usize>> {
+    let start = arena.strings.len();
+    if let Err(e) = read_remote_string_array(pid, address as usize, arena) {
+        log::trace!("process_vm_readv failed: {e}, falling back to PEEKDATA");
+        read_null_ended_array(pid, address, |pid, address| {
+            arena.push(&[]);
+            let idx = arena.strings.len() - 1;
+            peek_string(pid, address, &mut arena.bytes);
+            arena.strings[idx].end = arena.bytes.len();
+            Ok(())
+        })?;
+    }
+    Ok(start..arena.strings.len())
+}
+
 #[allow(unused)]
 pub fn read_cstring_array(pid: Pid, address: AddressType) -> color_eyre::Result<Vec<CString>> {
-    read_null_ended_array(pid, address, read_cstring)
+    let mut arena = StringArena::default();
+    Ok(read_string_array(pid, address, &mut arena)?
+        .map(|idx| CString::new(arena.get(idx)).unwrap())
+        .collect())
+}
+
+/// Tracee memory accessed through /proc/<pid>/mem.
+///
+/// Unlike PEEKDATA, this doesn't require the tracee to be ptrace-stopped by us.
+/// The permission check is done at open time, so the file can be opened before
+/// checking that the pid still refers to the same process.
+pub struct ProcMem {
+    pid: Pid,
+    file: File,
+}
+
+impl ProcMem {
+    pub fn open(pid: Pid) -> io::Result<Self> {
+        Ok(Self {
+            pid,
+            file: File::open(format!("/proc/{pid}/mem"))?,
+        })
+    }
+
+    /// Read from `address` to the end of its page, or less if `buf` is smaller.
+    fn read_chunk<'a>(&self, buf: &'a mut [u8], address: usize) -> io::Result<&'a [u8]> {
+        let len = bytes_to_page_end(address).min(buf.len());
+        let read = self.file.read_at(&mut buf[..len], address as u64)?;
+        if read == 0 {
+            log::warn!("Cannot read tracee {} memory {address:#x}", self.pid);
+            return Err(io::Error::from_raw_os_error(libc::EIO));
+        }
+        Ok(&buf[..read])
+    }
+
+    /// Read a string and append it to `res`
+    fn read_bytes_into(
+        &self,
+        mut address: usize,
+        buf: &mut Vec<u8>,
+        res: &mut Vec<u8>,
+    ) -> io::Result<()> {
+        buf.resize(page_size(), 0);
+        loop {
+            let chunk = self.read_chunk(buf, address)?;
+            if let Some(pos) = memchr::memchr(0, chunk) {
+                res.extend_from_slice(&chunk[..pos]);
+                return Ok(());
+            }
+            res.extend_from_slice(chunk);
+            address += chunk.len();
+        }
+    }
+
+    pub fn read_bytes(&self, address: usize) -> io::Result<Vec<u8>> {
+        let mut res = Vec::new();
+        self.read_bytes_into(address, &mut Vec::new(), &mut res)?;
+        Ok(res)
+    }
+
+    pub fn read_pathbuf(&self, address: usize) -> io::Result<PathBuf> {
+        Ok(PathBuf::from(OsString::from_vec(self.read_bytes(address)?)))
+    }
+
+    fn read_pointers(
+        &self,
+        mut address: usize,
+        buf: &mut Vec<u8>,
+        res: &mut Vec<usize>,
+    ) -> io::Result<()> {
+        res.clear();
+        buf.resize(page_size(), 0);
+        loop {
+            let len = (bytes_to_page_end(address) / WORD_SIZE).max(1) * WORD_SIZE;
+            let read = self.file.read_at(&mut buf[..len], address as u64)?;
+            if read < WORD_SIZE {
+                log::warn!("Cannot read tracee {} memory {address:#x}", self.pid);
+                return Err(io::Error::from_raw_os_error(libc::EIO));
+            }
+            let words = buf[..read].chunks_exact(WORD_SIZE);
+            address += words.len() * WORD_SIZE;
+            for word in words {
+                let ptr = usize::from_ne_bytes(word.try_into().unwrap());
+                if ptr == 0 {
+                    return Ok(());
+                }
+                res.push(ptr);
+            }
+        }
+    }
+
+    /// Read a NULL-terminated array of strings into the arena
+    pub fn read_string_array(
+        &self,
+        address: usize,
+        arena: &mut StringArena,
+    ) -> io::Result<Range<usize>> {
+        let start = arena.strings.len();
+        if address == 0 {
+            // Linux treats NULL argv/envp as empty arrays
+            return Ok(start..start);
+        }
+        let mut buf = std::mem::take(&mut arena.buf);
+        let mut pointers = std::mem::take(&mut arena.pointers);
+        let result = self
+            .read_pointers(address, &mut buf, &mut pointers)
+            .and_then(|()| {
+                for &ptr in pointers.iter() {
+                    arena.push(&[]);
+                    let idx = arena.strings.len() - 1;
+                    self.read_bytes_into(ptr, &mut buf, &mut arena.bytes)?;
+                    arena.strings[idx].end = arena.bytes.len();
+                }
+                Ok(())
+            });
+        arena.buf = buf;
+        arena.pointers = pointers;
+        result.map(|()| start..arena.strings.len())
+    }
+}
+
+/// Access to the memory of a stopped tracee
+pub trait TraceeMemory {
+    fn read_pathbuf(&mut self, address: usize) -> color_eyre::Result<PathBuf>;
+
+    fn read_string_array(
+        &mut self,
+        address: usize,
+        arena: &mut StringArena,
+    ) -> color_eyre::Result<Range<usize>>;
+}
+
+/// Memory of a tracee of the calling thread, with PEEKDATA as the fallback
+pub struct PtraceMemory(pub Pid);
+
+impl TraceeMemory for PtraceMemory {
+    fn read_pathbuf(&mut self, address: usize) -> color_eyre::Result<PathBuf> {
+        read_pathbuf(self.0, address as AddressType)
+    }
+
+    fn read_string_array(
+        &mut self,
+        address: usize,
+        arena: &mut StringArena,
+    ) -> color_eyre::Result<Range<usize>> {
+        read_string_array(self.0, address as AddressType, arena)
+    }
+}
+
+/// Memory of a tracee that can be read from any thread.
+///
+/// PEEKDATA only works in the tracer thread, so /proc/<pid>/mem is the fallback.
+pub struct RemoteMemory {
+    pid: Pid,
+    mem: Option<ProcMem>,
+}
+
+impl RemoteMemory {
+    pub fn new(pid: Pid) -> Self {
+        Self { pid, mem: None }
+    }
+
+    fn mem(&mut self) -> io::Result<&ProcMem> {
+        if self.mem.is_none() {
+            self.mem = Some(ProcMem::open(self.pid)?);
+        }
+        Ok(self.mem.as_ref().unwrap())
+    }
+}
+
+impl TraceeMemory for RemoteMemory {
+    fn read_pathbuf(&mut self, address: usize) -> color_eyre::Result<PathBuf> {
+        match read_remote_bytes(self.pid, address) {
+            Ok(bytes) => Ok(PathBuf::from(OsString::from_vec(bytes))),
+            Err(e) => {
+                log::trace!("process_vm_readv failed: {e}, falling back to /proc/<pid>/mem");
+                Ok(self.mem()?.read_pathbuf(address)?)
+            }
+        }
+    }
+
+    fn read_string_array(
+        &mut self,
+        address: usize,
+        arena: &mut StringArena,
+    ) -> color_eyre::Result<Range<usize>> {
+        match read_remote_string_array(self.pid, address, arena) {
+            Ok(range) => Ok(range),
+            Err(e) => {
+                log::trace!("process_vm_readv failed: {e}, falling back to /proc/<pid>/mem");
+                Ok(self.mem()?.read_string_array(address, arena)?)
+            }
+        }
+    }
 }
 
-pub fn read_string_array(pid: Pid, address: AddressType) -> color_eyre::Result<Vec<String>> {
-    read_null_ended_array(pid, address, read_string)
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Strings packed back to back like argv and envp, and a NULL-terminated array of pointers to them
+    fn packed(strings: &[Vec<u8>]) -> (Vec<u8>, Vec<usize>) {
+        let mut blob = Vec::new();
+        let mut offsets = Vec::new();
+        for s in strings {
+            offsets.push(blob.len());
+            blob.extend_from_slice(s);
+            blob.push(0);
+        }
+        let base = blob.as_ptr() as usize;
+        let mut pointers: Vec<usize> = offsets.into_iter().map(|x| base + x).collect();
+        pointers.push(0);
+        (blob, pointers)
+    }
+
+    fn env(len: usize) -> Vec<Vec<u8>> {
+        (0..len)
+            .map(|i| format!("KEY{i}=value{i}").into_bytes())
+            .collect()
+    }
+
+    #[test]
+    fn read_packed_strings() {
+        let mut strings = env(1000);
+        // Spans several pages
+        strings.insert(500, vec![b'x'; 3 * page_size() + 5]);
+        strings.push(vec![]);
+        let (_blob, pointers) = packed(&strings);
+        let mut arena = StringArena::default();
+        let range =
+            read_remote_string_array(Pid::this(), pointers.as_ptr() as usize, &mut arena).unwrap();
+        assert_eq!(range, 0..strings.len());
+        for (idx, s) in range.zip(&strings) {
+            assert_eq!(arena.get(idx), s.as_slice());
+        }
+        // Each page is read once per round
+        let pages = strings.iter().map(|x| x.len() + 1).sum::<usize>() / page_size() + 2;
+        assert!(arena.buf.len() <= pages * page_size());
+    }
+
+    #[test]
+    fn unreadable_string() {
+        let strings = env(10);
+        let (_blob, mut pointers) = packed(&strings);
+        // The NULL page is never mapped
+        pointers.insert(5, 8);
+        let mut arena = StringArena::default();
+        let range =
+            read_remote_string_array(Pid::this(), pointers.as_ptr() as usize, &mut arena).unwrap();
+        assert_eq!(range.len(), 11);
+        assert_eq!(arena.get(5), b"");
+        assert_eq!(arena.get(4), strings[4].as_slice());
+        assert_eq!(arena.get(6), strings[5].as_slice());
+    }
 }
@@ -0,0 +1,128 @@
+//! Interning of the strings captured from tracees.
+//!
+//! The same filenames, arguments, comms and environment variables show up in
+//! almost every exec of a build. Interned strings are shared through `Arc`,
+//! so each distinct string is only allocated once, and cloning them is cheap.
+
+use std::{
+    collections::HashSet,
+    hash::Hash,
+    path::Path,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc, Mutex, OnceLock,
+    },
+};
+
+/// Don't bother sweeping unused entries while the interner is smaller than this
+const MIN_SWEEP_THRESHOLD: usize = 4096;
+
+struct Interner<T: ?Sized> {
+    inner: Mutex<InternerInner<T>>,
+}
+
+struct InternerInner<T: ?Sized> {
+    set: HashSet<Arc<T>>,
+    /// Sweep the entries that are only referenced by the interner when the set grows
+    /// beyond this, so that one-off strings don't accumulate.
+    sweep_threshold: usize,
+}
+
+impl<T: ?Sized + Hash + Eq + ByteLen> Interner<T>
+where
+    for<'a> Arc<T>: From<&'a T>,
+{
+    fn new() -> Self {
+        Self {
+            inner: Mutex::new(InternerInner {
+                set: HashSet::new(),
+                sweep_threshold: MIN_SWEEP_THRESHOLD,
+            }),
+        }
+    }
+
+    fn intern(&self, value: &T) -> Arc<T> {
+        let mut inner = self.inner.lock().unwrap();
+        if let Some(interned) = inner.set.get(value) {
+            STATS.hits.fetch_add(1, Ordering::Relaxed);
+            STATS
+                .saved_bytes
+                .fetch_add(value.byte_len() as u64, Ordering::Relaxed);
+            return interned.clone();
+        }
+        if inner.set.len() >= inner.sweep_threshold {
+            inner.set.retain(|x| Arc::strong_count(x) > 1);
+            inner.sweep_threshold = (inner.set.len() * 2).max(MIN_SWEEP_THRESHOLD);
+        }
+        STATS.misses.fetch_add(1, Ordering::Relaxed);
+        let interned = Arc::<T>::from(value);
+        inner.set.insert(interned.clone());
+        interned
+    }
+}
+
+trait ByteLen {
+    fn byte_len(&self) -> usize;
+}
+
+impl ByteLen for str {
+    fn byte_len(&self) -> usize {
+        self.len()
+    }
+}
+
+impl ByteLen for Path {
+    fn byte_len(&self) -> usize {
+        self.as_os_str().len()
+    }
+}
+
+struct Stats {
+    hits: AtomicU64,
+    misses: AtomicU64,
+    /// Bytes of the strings that were not allocated again thanks to interning
+    saved_bytes: AtomicU64,
+}
+
+static STATS: Stats = Stats {
+    hits: AtomicU64::new(0),
+    misses: AtomicU64::new(0),
+    saved_bytes: AtomicU64::new(0),
+};
+
+fn strings() -> &'static Interner<str> {
+    static STRINGS: OnceLock<Interner<str>> = OnceLock::new();
+    STRINGS.get_or_init(Interner::new)
+}
+
+fn paths() -> &'static Interner<Path> {
+    static PATHS: OnceLock<Interner<Path>> = OnceLock::new();
+    PATHS.get_or_init(Interner::new)
+}
+
+pub fn intern_str(s: &str) -> Arc<str> {
+    strings().intern(s)
+}
+
+/// Intern a string read from a tracee, replacing invalid UTF-8 sequences
+pub fn intern_bytes(bytes: &[u8]) -> Arc<str> {
+    match std::str::from_utf8(bytes) {
+        Ok(s) => intern_str(s),
+        Err(_) => intern_str(&String::from_utf8_lossy(bytes)),
+    }
+}
+
+pub fn intern_path(path: &Path) -> Arc<Path> {
+    paths().intern(path)
+}
+
+pub fn log_stats() {
+    let hits = STATS.hits.load(Ordering::Relaxed);
+    let misses = STATS.misses.load(Ordering::Relaxed);
+    log::info!(
+        "interner: {} lookups, {} hits, saved {} KiB of string allocations",
+        hits + misses,
+        hits,
+        STATS.saved_bytes.load(Ordering::Relaxed) / 1024
+    );
+}
@@ -1,17 +1,37 @@
 mod arch;
+mod attach;
+#[cfg(feature = "ebpf")]
+mod bpf;
+mod capture;
 mod cli;
+mod control;
+mod envdiff;
+mod filter;
 mod inspect;
+mod intern;
+mod pipeline;
 mod printer;
 mod proc;
+mod proc_connector;
+mod prune;
+mod seccomp;
+mod shard;
+mod spawn;
 mod state;
+mod syscall;
 mod tracer;
+mod user_notif;
 
-use std::io::{stderr, stdout, BufWriter, Write};
+use std::io::{stderr, stdout, Write};
 
 use clap::Parser;
 use cli::Cli;
+use color_eyre::eyre::bail;
 
-use crate::cli::{CliCommand, Color};
+use crate::{
+    attach::AttachTarget,
+    cli::{Backend, CliCommand, Color},
+};
 
 fn main() -> color_eyre::Result<()> {
     let mut cli = Cli::parse();
@@ -44,7 +64,7 @@ fn main() -> color_eyre::Result<()> {
             tracing_args,
             output,
         } => {
-            let output: Box<dyn Write> = match output {
+            let output: Box<dyn Write + Send> = match output {
                 None => Box::new(stderr()),
                 Some(ref x) if x.as_os_str() == "-" => Box::new(stdout()),
                 Some(path) => {
@@ -57,10 +77,56 @@ fn main() -> color_eyre::Result<()> {
                         // Disable color by default when output is file
                         owo_colors::control::set_should_colorize(false);
                     }
-                    Box::new(BufWriter::new(file))
+                    // The output is buffered by the writer thread
+                    Box::new(file)
                 }
             };
-            tracer::Tracer::new(tracing_args, output)?.start_root_process(cmd)?;
+            if tracing_args.backend != Backend::Ptrace
+                && (tracing_args.pid.is_some() || tracing_args.pgid.is_some())
+            {
+                bail!("--pid and --pgid are only supported by the ptrace backend");
+            }
+            if tracing_args.backend != Backend::Ptrace
+                && (tracing_args.max_events.is_some() || tracing_args.max_duration.is_some())
+            {
+                bail!("--max-events and --max-duration are only supported by the ptrace backend");
+            }
+            if tracing_args.backend != Backend::Ptrace
+                && (tracing_args.prune_depth.is_some()
+                    || tracing_args.prune_comm.is_some()
+                    || tracing_args.prune_filename.is_some())
+            {
+                bail!("--prune-depth, --prune-comm and --prune-filename are only supported by the ptrace backend");
+            }
+            match tracing_args.backend {
+                Backend::Ptrace => match AttachTarget::from_cli(&tracing_args) {
+                    Some(target) => {
+                        if !cmd.is_empty() {
+                            bail!("Cannot run a command while attaching to running processes");
+                        }
+                        tracer::Tracer::new(tracing_args, output)?.attach(target)?;
+                    }
+                    None => tracer::Tracer::new(tracing_args, output)?.start_root_process(cmd)?,
+                },
+                #[cfg(feature = "ebpf")]
+                Backend::Ebpf => {
+                    bpf::EbpfTracer::new(tracing_args, output)?.run(cmd)?;
+                }
+                Backend::ProcConnector => {
+                    if tracing_args.cgroup.is_some() {
+                        bail!("--cgroup is only supported by the ebpf backend");
+                    }
+                    proc_connector::ProcConnectorTracer::new(tracing_args, output)?
+                        .start_root_process(cmd)?;
+                }
+                Backend::SeccompUserNotif => {
+                    if tracing_args.cgroup.is_some() {
+                        bail!("--cgroup is only supported by the ebpf backend");
+                    }
+                    user_notif::UserNotifTracer::new(tracing_args, output)?
+                        .start_root_process(cmd)?;
+                }
+            }
         }
         CliCommand::Tree {
             cmd: _,
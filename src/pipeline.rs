@@ -0,0 +1,452 @@
+//! Event pipeline between the tracer and the output.
+//!
+//! Formatting an exec (env diff, shell escaping, colors) and writing it out can be slow,
+//! especially with a slow terminal. The tracer only captures an owned record of each event
+//! and sends it through a bounded queue to a writer thread, so that it can resume the tracee
+//! at once. What happens when the queue is full is controlled by [`Backpressure`].
+//!
+//! The writer renders events into a buffer and writes it out with a single write,
+//! when [`FlushPolicy`] says so.
+//!
+//! Several tracer threads might submit events through their own [`Pipeline::sender`].
+//! Events are numbered when they are submitted and the writer puts them back in that order.
+
+use std::{
+    cmp::{Ordering, Reverse},
+    collections::BinaryHeap,
+    io::Write,
+    path::PathBuf,
+    sync::{
+        atomic::{self, AtomicU64},
+        mpsc::{sync_channel, Receiver, RecvTimeoutError, SyncSender, TryRecvError, TrySendError},
+        Arc, Mutex,
+    },
+    thread::JoinHandle,
+    time::{Duration, Instant},
+};
+
+use color_eyre::eyre::eyre;
+use nix::unistd::Pid;
+
+use crate::{
+    cli::{Backpressure, FlushPolicy, TracingArgs},
+    envdiff::{BaselineEnv, EnvSnapshot},
+    printer::{print_exec_trace, print_lost_exec, print_new_child, PrinterArgs, PrinterScratch},
+    state::ExecData,
+};
+
+/// An exec, captured at syscall exit
+#[derive(Debug)]
+pub struct ExecEvent {
+    pub pid: Pid,
+    /// comm before the exec
+    pub comm: Arc<str>,
+    pub result: i64,
+    pub exec_data: ExecData,
+    /// Environment of the process before the exec, to diff against.
+    /// None means the environment of tracexec.
+    pub env: Option<Arc<EnvSnapshot>>,
+}
+
+#[derive(Debug)]
+pub enum TracerEvent {
+    NewChild {
+        pid: Pid,
+        comm: Arc<str>,
+        child: Pid,
+    },
+    Exec(ExecEvent),
+    /// An exec happened but its details are lost
+    LostExec {
+        pid: Pid,
+        comm: Arc<str>,
+        reason: String,
+    },
+}
+
+/// An event and its position in the output
+struct Sequenced {
+    seq: u64,
+    event: TracerEvent,
+}
+
+impl PartialEq for Sequenced {
+    fn eq(&self, other: &Self) -> bool {
+        self.seq == other.seq
+    }
+}
+
+impl Eq for Sequenced {}
+
+impl PartialOrd for Sequenced {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl Ord for Sequenced {
+    fn cmp(&self, other: &Self) -> Ordering {
+        self.seq.cmp(&other.seq)
+    }
+}
+
+enum Message {
+    Event(Sequenced),
+    /// Events coalesced while the queue was full
+    Batch(Vec<Sequenced>),
+    /// Sent by the owner of the writer when it is done.
+    /// Other senders might still be alive.
+    Finish,
+}
+
+pub struct Pipeline {
+    backpressure: Backpressure,
+    tx: Option<SyncSender<Message>>,
+    /// Only the pipeline that created the writer owns it
+    writer: Option<JoinHandle<color_eyre::Result<()>>>,
+    /// Sequence number of the next event, shared by all senders.
+    /// Dropped events must not take a number, or the writer would wait for them forever.
+    next_seq: Arc<Mutex<u64>>,
+    /// Events waiting for room in the queue, in coalesce mode
+    coalesced: Vec<Sequenced>,
+    /// Events beyond this are dropped while the queue is full, in coalesce mode
+    max_coalesced: usize,
+    dropped: Arc<AtomicU64>,
+}
+
+/// Write out the buffer when it grows beyond this size, regardless of the flush policy
+const MAX_BUFFERED_BYTES: usize = 64 * 1024;
+
+struct Writer {
+    output: Box<dyn Write + Send>,
+    /// Rendered events that are not written out yet
+    buf: Vec<u8>,
+    flush: FlushPolicy,
+    flush_interval: Duration,
+    last_flush: Instant,
+    /// Events that arrived before some of their predecessors
+    pending: BinaryHeap<Reverse<Sequenced>>,
+    next_seq: u64,
+    args: PrinterArgs,
+    env: BaselineEnv,
+    cwd: PathBuf,
+    scratch: PrinterScratch,
+}
+
+impl Pipeline {
+    pub fn new(
+        tracing_args: &TracingArgs,
+        output: Box<dyn Write + Send>,
+    ) -> color_eyre::Result<Self> {
+        let writer = Writer {
+            output,
+            buf: Vec::with_capacity(MAX_BUFFERED_BYTES),
+            flush: tracing_args.flush,
+            flush_interval: Duration::from_millis(tracing_args.flush_interval),
+            last_flush: Instant::now(),
+            pending: BinaryHeap::new(),
+            next_seq: 0,
+            args: PrinterArgs::from_cli(tracing_args),
+            env: BaselineEnv::new(std::env::vars()),
+            cwd: std::env::current_dir()?,
+            scratch: PrinterScratch::default(),
+        };
+        let (tx, rx) = sync_channel(tracing_args.event_queue_size.max(1));
+        let writer = std::thread::Builder::new()
+            .name("writer".to_string())
+            .spawn(move || writer.run(rx))?;
+        Ok(Self {
+            backpressure: tracing_args.backpressure,
+            tx: Some(tx),
+            writer: Some(writer),
+            next_seq: Arc::new(Mutex::new(0)),
+            coalesced: Vec::new(),
+            max_coalesced: tracing_args.event_queue_size.max(1),
+            dropped: Arc::new(AtomicU64::new(0)),
+        })
+    }
+
+    /// Another handle to submit events, for another thread.
+    /// It doesn't own the writer, so finishing it only hands over its coalesced events.
+    pub fn sender(&self) -> Self {
+        Self {
+            backpressure: self.backpressure,
+            tx: self.tx.clone(),
+            writer: None,
+            next_seq: self.next_seq.clone(),
+            coalesced: Vec::new(),
+            max_coalesced: self.max_coalesced,
+            dropped: self.dropped.clone(),
+        }
+    }
+
+    pub fn submit(&mut self, event: TracerEvent) -> color_eyre::Result<()> {
+        let tx = self.tx.as_ref().expect("submit after finish");
+        let result = match self.backpressure {
+            Backpressure::Block => {
+                // Don't block with the lock held, or the other senders stall as well.
+                // Nothing is dropped, so the sequence has no gaps.
+                let event = {
+                    let mut next_seq = self.next_seq.lock().unwrap();
+                    let seq = *next_seq;
+                    *next_seq += 1;
+                    Sequenced { seq, event }
+                };
+                tx.send(Message::Event(event)).map_err(|_| ())
+            }
+            Backpressure::Drop => {
+                // try_send doesn't block, so it is done under the lock:
+                // a dropped event must not take a sequence number.
+                let mut next_seq = self.next_seq.lock().unwrap();
+                let event = Sequenced {
+                    seq: *next_seq,
+                    event,
+                };
+                match tx.try_send(Message::Event(event)) {
+                    Err(TrySendError::Full(_)) => {
+                        self.dropped.fetch_add(1, atomic::Ordering::Relaxed);
+                        return Ok(());
+                    }
+                    other => {
+                        *next_seq += 1;
+                        other.map_err(|_| ())
+                    }
+                }
+            }
+            Backpressure::Coalesce => {
+                if self.coalesced.len() >= self.max_coalesced {
+                    self.try_flush()?;
+                    if self.coalesced.len() >= self.max_coalesced {
+                        // Buffered events already have their sequence numbers,
+                        // so drop the new one, before it takes one.
+                        self.dropped.fetch_add(1, atomic::Ordering::Relaxed);
+                        return Ok(());
+                    }
+                }
+                let tx = self.tx.as_ref().expect("submit after finish");
+                let mut next_seq = self.next_seq.lock().unwrap();
+                let event = Sequenced {
+                    seq: *next_seq,
+                    event,
+                };
+                *next_seq += 1;
+                if self.coalesced.is_empty() {
+                    match tx.try_send(Message::Event(event)) {
+                        Err(TrySendError::Full(Message::Event(event))) => {
+                            self.coalesced.push(event);
+                            Ok(())
+                        }
+                        other => other.map_err(|_| ()),
+                    }
+                } else {
+                    self.coalesced.push(event);
+                    drop(next_seq);
+                    return self.try_flush();
+                }
+            }
+        };
+        match result {
+            Ok(()) => Ok(()),
+            Err(()) => Err(self.writer_error()),
+        }
+    }
+
+    /// Try to hand over the coalesced events without blocking.
+    pub fn try_flush(&mut self) -> color_eyre::Result<()> {
+        if self.coalesced.is_empty() {
+            return Ok(());
+        }
+        let tx = self.tx.as_ref().expect("try_flush after finish");
+        let batch = std::mem::take(&mut self.coalesced);
+        match tx.try_send(Message::Batch(batch)) {
+            Ok(()) => Ok(()),
+            Err(TrySendError::Full(Message::Batch(batch))) => {
+                self.coalesced = batch;
+                Ok(())
+            }
+            Err(_) => Err(self.writer_error()),
+        }
+    }
+
+    /// Hand over the coalesced events, waiting for room in the queue.
+    ///
+    /// Call it before waiting for the tracees. Otherwise the coalesced events linger while idle,
+    /// and the writer holds back the events of the other senders that come after them.
+    pub fn flush_coalesced(&mut self) -> color_eyre::Result<()> {
+        if self.coalesced.is_empty() {
+            return Ok(());
+        }
+        let tx = self.tx.as_ref().expect("flush_coalesced after finish");
+        let batch = std::mem::take(&mut self.coalesced);
+        match tx.send(Message::Batch(batch)) {
+            Ok(()) => Ok(()),
+            Err(_) => Err(self.writer_error()),
+        }
+    }
+
+    /// Wait for the writer to write out all events.
+    pub fn finish(&mut self) -> color_eyre::Result<()> {
+        let Some(tx) = self.tx.take() else {
+            return Ok(());
+        };
+        if !self.coalesced.is_empty() {
+            let batch = std::mem::take(&mut self.coalesced);
+            if tx.send(Message::Batch(batch)).is_err() {
+                return Err(self.writer_error());
+            }
+        }
+        if self.writer.is_none() {
+            return Ok(());
+        }
+        if tx.send(Message::Finish).is_err() {
+            return Err(self.writer_error());
+        }
+        drop(tx);
+        let dropped = self.dropped.load(atomic::Ordering::Relaxed);
+        if dropped != 0 {
+            log::warn!(
+                "{} events were dropped because the output could not keep up. The output is incomplete!",
+                dropped
+            );
+        }
+        crate::intern::log_stats();
+        crate::proc::log_stats();
+        crate::filter::log_stats();
+        self.join_writer()
+    }
+
+    fn join_writer(&mut self) -> color_eyre::Result<()> {
+        match self.writer.take() {
+            Some(writer) => writer
+                .join()
+                .unwrap_or_else(|_| Err(eyre!("writer thread panicked"))),
+            None => Ok(()),
+        }
+    }
+
+    /// The writer only hangs up on errors
+    fn writer_error(&mut self) -> color_eyre::Report {
+        self.tx = None;
+        match self.join_writer() {
+            Err(e) => e,
+            Ok(()) => eyre!("writer thread exited unexpectedly"),
+        }
+    }
+}
+
+impl Writer {
+    fn run(mut self, rx: Receiver<Message>) -> color_eyre::Result<()> {
+        while let Some(message) = self.next_message(&rx)? {
+            if !self.accept(message)? {
+                // Take what the other senders have sent so far. They are going away with the process.
+                while let Ok(message) = rx.try_recv() {
+                    self.accept(message)?;
+                }
+                break;
+            }
+            match self.flush {
+                FlushPolicy::Event => self.flush()?,
+                FlushPolicy::Interval if self.last_flush.elapsed() >= self.flush_interval => {
+                    self.flush()?
+                }
+                _ if self.buf.len() >= MAX_BUFFERED_BYTES => self.flush()?,
+                _ => (),
+            }
+        }
+        // The predecessors of these are lost
+        while let Some(Reverse(event)) = self.pending.pop() {
+            self.render(event.event)?;
+        }
+        self.flush()
+    }
+
+    /// Render the events of the message in sequence.
+    /// Returns false on [`Message::Finish`].
+    fn accept(&mut self, message: Message) -> color_eyre::Result<bool> {
+        match message {
+            Message::Event(event) => self.render_in_order(event)?,
+            Message::Batch(events) => {
+                for event in events {
+                    self.render_in_order(event)?;
+                }
+            }
+            Message::Finish => return Ok(false),
+        }
+        Ok(true)
+    }
+
+    fn render_in_order(&mut self, event: Sequenced) -> color_eyre::Result<()> {
+        if event.seq != self.next_seq {
+            self.pending.push(Reverse(event));
+            return Ok(());
+        }
+        self.render(event.event)?;
+        self.next_seq += 1;
+        while let Some(Reverse(event)) = self.pending.peek() {
+            if event.seq != self.next_seq {
+                break;
+            }
+            let Reverse(event) = self.pending.pop().unwrap();
+            self.render(event.event)?;
+            self.next_seq += 1;
+        }
+        Ok(())
+    }
+
+    /// Receive the next message, flushing the buffer before waiting when needed.
+    /// Returns None when all senders are gone.
+    fn next_message(&mut self, rx: &Receiver<Message>) -> color_eyre::Result<Option<Message>> {
+        match self.flush {
+            FlushPolicy::Event => Ok(rx.recv().ok()),
+            FlushPolicy::Idle => match rx.try_recv() {
+                Ok(message) => Ok(Some(message)),
+                Err(TryRecvError::Empty) => {
+                    self.flush()?;
+                    Ok(rx.recv().ok())
+                }
+                Err(TryRecvError::Disconnected) => Ok(None),
+            },
+            FlushPolicy::Interval => loop {
+                if self.buf.is_empty() {
+                    return Ok(rx.recv().ok());
+                }
+                let deadline = self.last_flush + self.flush_interval;
+                match rx.recv_timeout(deadline.saturating_duration_since(Instant::now())) {
+                    Ok(message) => return Ok(Some(message)),
+                    Err(RecvTimeoutError::Timeout) => self.flush()?,
+                    Err(RecvTimeoutError::Disconnected) => return Ok(None),
+                }
+            },
+        }
+    }
+
+    fn flush(&mut self) -> color_eyre::Result<()> {
+        if !self.buf.is_empty() {
+            self.output.write_all(&self.buf)?;
+            self.buf.clear();
+        }
+        self.output.flush()?;
+        self.last_flush = Instant::now();
+        Ok(())
+    }
+
+    fn render(&mut self, event: TracerEvent) -> color_eyre::Result<()> {
+        let out = &mut self.buf;
+        match event {
+            TracerEvent::NewChild { pid, comm, child } => {
+                print_new_child(out, pid, &comm, &self.args, child)
+            }
+            TracerEvent::Exec(exec) => print_exec_trace(
+                out,
+                &exec,
+                &self.args,
+                &self.env,
+                &self.cwd,
+                &mut self.scratch,
+            ),
+            TracerEvent::LostExec { pid, comm, reason } => {
+                print_lost_exec(out, pid, &comm, &self.args, &reason)
+            }
+        }
+    }
+}
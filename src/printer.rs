@@ -1,45 +1,16 @@
-use std::{
-    collections::HashMap,
-    io::{self, Write},
-    path::Path,
-};
+use std::{io::Write, path::Path, sync::Arc};
 
-use crate::{proc::Interpreter, state::ProcessState};
+use crate::{
+    cli::{DiffEnvAgainst, TracingArgs},
+    envdiff::{BaselineEnv, EnvChange, EnvDiffer, EscapeCache},
+    filter::ExecFilter,
+    pipeline::ExecEvent,
+    proc::Interpreter,
+};
 
 use nix::unistd::Pid;
 use owo_colors::OwoColorize;
 
-fn parse_env_entry(item: &str) -> (&str, &str) {
-    let mut sep_loc = item
-        .as_bytes()
-        .iter()
-        .position(|&x| x == b'=')
-        .unwrap_or_else(|| {
-            log::warn!(
-                "Invalid envp entry: {:?}, assuming value to empty string!",
-                item
-            );
-            item.len()
-        });
-    if sep_loc == 0 {
-        // Find the next equal sign
-        sep_loc = item
-            .as_bytes()
-            .iter()
-            .skip(1)
-            .position(|&x| x == b'=')
-            .unwrap_or_else(|| {
-                log::warn!(
-                    "Invalid envp entry staring with '=': {:?}, assuming value to empty string!",
-                    item
-                );
-                item.len()
-            });
-    }
-    let (head, tail) = item.split_at(sep_loc);
-    (head, &tail[1..])
-}
-
 macro_rules! escape_str_for_bash {
     // TODO: This is ... quite ugly. We should find a better way to do this.
     ($x:expr) => {
@@ -67,6 +38,7 @@ pub struct PrinterArgs {
     pub trace_comm: bool,
     pub trace_argv: bool,
     pub trace_env: EnvPrintFormat,
+    pub diff_env_against: DiffEnvAgainst,
     pub trace_cwd: bool,
     pub print_cmdline: bool,
     pub successful_only: bool,
@@ -74,42 +46,149 @@ pub struct PrinterArgs {
     pub trace_filename: bool,
     pub decode_errno: bool,
     pub color: ColorLevel,
+    pub filter: Option<Arc<ExecFilter>>,
+}
+
+impl PrinterArgs {
+    pub fn from_cli(tracing_args: &TracingArgs) -> Self {
+        PrinterArgs {
+            trace_comm: !tracing_args.no_show_comm,
+            trace_argv: !tracing_args.no_show_argv && !tracing_args.show_cmdline,
+            trace_env: match (
+                tracing_args.show_cmdline,
+                tracing_args.diff_env,
+                tracing_args.no_diff_env,
+                tracing_args.show_env,
+                tracing_args.no_show_env,
+            ) {
+                (true, ..) | (false, .., true) => EnvPrintFormat::None,
+                (false, _, _, true, _) | (false, _, true, _, _) => EnvPrintFormat::Raw,
+                _ => EnvPrintFormat::Diff, // diff_env is enabled by default
+            },
+            diff_env_against: tracing_args.diff_env_against,
+            trace_cwd: tracing_args.show_cwd,
+            print_cmdline: tracing_args.show_cmdline,
+            successful_only: tracing_args.successful_only || tracing_args.show_cmdline,
+            trace_interpreter: tracing_args.show_interpreter,
+            trace_filename: match (
+                tracing_args.show_filename,
+                tracing_args.no_show_filename,
+                tracing_args.show_cmdline,
+            ) {
+                (true, _, _) => true,
+                // show filename by default, but not in show-cmdline mode
+                (false, _, true) => false,
+                _ => true,
+            },
+            decode_errno: !tracing_args.no_decode_errno,
+            color: match (tracing_args.more_colors, tracing_args.less_colors) {
+                (false, false) => ColorLevel::Normal,
+                (true, false) => ColorLevel::More,
+                (false, true) => ColorLevel::Less,
+                _ => unreachable!(),
+            },
+            filter: tracing_args.filter.clone().map(Arc::new),
+        }
+    }
+}
+
+impl PrinterArgs {
+    /// Whether the backends need to keep track of the environment of the processes
+    pub fn track_env(&self) -> bool {
+        matches!(self.trace_env, EnvPrintFormat::Diff)
+            && self.diff_env_against == DiffEnvAgainst::LastExec
+    }
+
+    /// Whether argv has to be read from the tracees
+    pub fn needs_argv(&self) -> bool {
+        self.trace_argv || self.print_cmdline || self.filter.as_ref().is_some_and(|x| x.uses_argv())
+    }
+
+    /// Whether envp has to be read from the tracees
+    pub fn needs_envp(&self) -> bool {
+        !matches!(self.trace_env, EnvPrintFormat::None)
+            || self.print_cmdline
+            || self.filter.as_ref().is_some_and(|x| x.uses_env())
+    }
+
+    /// Whether the filter lets an exec through, for the backends that know all of it at once
+    pub fn accepts(
+        &self,
+        filename: &Path,
+        comm: &str,
+        argv: &[Arc<str>],
+        envp: &[Arc<str>],
+        result: i64,
+    ) -> bool {
+        self.filter
+            .as_ref()
+            .map_or(true, |x| x.matches(filename, comm, argv, envp, result))
+    }
 }
 
 pub fn print_new_child(
     out: &mut dyn Write,
-    state: &ProcessState,
+    pid: Pid,
+    comm: &str,
     args: &PrinterArgs,
     child: Pid,
 ) -> color_eyre::Result<()> {
-    write!(out, "{}", state.pid.bright_yellow())?;
+    write!(out, "{}", pid.bright_yellow())?;
     if args.trace_comm {
-        write!(out, "<{}>", state.comm.cyan())?;
+        write!(out, "<{}>", comm.cyan())?;
     }
     writeln!(out, ": {}: {}", "new child".purple(), child.bright_yellow())?;
-    out.flush()?;
     Ok(())
 }
 
+/// Tell the reader that an exec happened but its details are lost
+pub fn print_lost_exec(
+    out: &mut dyn Write,
+    pid: Pid,
+    comm: &str,
+    args: &PrinterArgs,
+    reason: &str,
+) -> color_eyre::Result<()> {
+    write!(out, "{}", pid.bright_red())?;
+    if args.trace_comm {
+        write!(out, "<{}>", comm.cyan())?;
+    }
+    writeln!(out, ": {} ({})", "exec details lost".red().bold(), reason)?;
+    Ok(())
+}
+
+/// Result of an exec that is known to have failed, but with an unknown errno
+pub const UNKNOWN_EXEC_ERROR: i64 = i64::MIN;
+
+/// Result of an exec that the backend can't observe
+pub const UNKNOWN_EXEC_RESULT: i64 = i64::MAX;
+
+/// State that is reused across events to avoid allocations
+#[derive(Debug, Default)]
+pub struct PrinterScratch {
+    differ: EnvDiffer,
+    escapes: EscapeCache,
+}
+
 pub fn print_exec_trace(
     out: &mut dyn Write,
-    state: &ProcessState,
-    result: i64,
+    event: &ExecEvent,
     args: &PrinterArgs,
-    env: &HashMap<String, String>,
+    env: &BaselineEnv,
     cwd: &Path,
+    scratch: &mut PrinterScratch,
 ) -> color_eyre::Result<()> {
-    // Preconditions:
-    // 1. execve syscall exit, which leads to 2
-    // 2. state.exec_data is Some
-    let exec_data = state.exec_data.as_ref().unwrap();
-    if result == 0 {
-        write!(out, "{}", state.pid.bright_yellow())?;
+    let exec_data = &event.exec_data;
+    let result = event.result;
+    // Not known to have failed
+    let may_succeed = result == 0 || result == UNKNOWN_EXEC_RESULT;
+    if may_succeed {
+        write!(out, "{}", event.pid.bright_yellow())?;
     } else {
-        write!(out, "{}", state.pid.bright_red())?;
+        write!(out, "{}", event.pid.bright_red())?;
     }
     if args.trace_comm {
-        write!(out, "<{}>", state.comm.cyan())?;
+        write!(out, "<{}>", event.comm.cyan())?;
     }
     write!(out, ":")?;
     if args.trace_filename {
@@ -121,7 +200,7 @@ pub fn print_exec_trace(
     if args.trace_cwd {
         write!(out, " {} {:?}", "at".purple(), exec_data.cwd)?;
     }
-    if args.trace_interpreter && result == 0 {
+    if args.trace_interpreter && may_succeed {
         write!(out, " {} ", "interpreter".purple(),)?;
         match exec_data.interpreters.len() {
             0 => {
@@ -144,60 +223,38 @@ pub fn print_exec_trace(
     }
     match args.trace_env {
         EnvPrintFormat::Diff => {
-            // TODO: make it faster
-            //       This is mostly a proof of concept
             write!(out, " {} [", "with".purple())?;
-            let mut env = env.clone();
-            let mut first_item_written = false;
-            let mut write_separator = |out: &mut dyn Write| -> io::Result<()> {
-                if first_item_written {
+            let baseline = event.env.as_ref().map_or(env, |x| x.baseline());
+            for (idx, change) in scratch.differ.diff(baseline, &exec_data.envp).enumerate() {
+                if idx != 0 {
                     write!(out, ", ")?;
-                } else {
-                    first_item_written = true;
                 }
-                Ok(())
-            };
-            for item in exec_data.envp.iter() {
-                let (k, v) = parse_env_entry(item);
-                // Too bad that we still don't have if- and while-let-chains
-                // https://github.com/rust-lang/rust/issues/53667
-                if let Some(orig_v) = env.get(k).map(|x| x.as_str()) {
-                    if orig_v != v {
-                        write_separator(out)?;
-                        write!(
-                            out,
-                            "{}{:?}={:?}",
-                            "M".bright_yellow().bold(),
-                            k,
-                            v.bright_blue()
-                        )?;
-                    }
-                    // Remove existing entry
-                    env.remove(k);
-                } else {
-                    write_separator(out)?;
-                    write!(
+                match change {
+                    EnvChange::Modified { key, value } => write!(
+                        out,
+                        "{}{:?}={:?}",
+                        "M".bright_yellow().bold(),
+                        key,
+                        value.bright_blue()
+                    )?,
+                    EnvChange::Added { key, value } => write!(
                         out,
                         "{}{:?}{}{:?}",
                         "+".bright_green().bold(),
-                        k.green(),
+                        key.green(),
                         "=".green(),
-                        v.green()
-                    )?;
+                        value.green()
+                    )?,
+                    EnvChange::Removed { key, value } => write!(
+                        out,
+                        "{}{:?}{}{:?}",
+                        "-".bright_red().bold(),
+                        key.bright_red().strikethrough(),
+                        "=".bright_red().strikethrough(),
+                        value.bright_red().strikethrough()
+                    )?,
                 }
             }
-            // Now we have the tracee removed entries in env
-            for (k, v) in env.iter() {
-                write_separator(out)?;
-                write!(
-                    out,
-                    "{}{:?}{}{:?}",
-                    "-".bright_red().bold(),
-                    k.bright_red().strikethrough(),
-                    "=".bright_red().strikethrough(),
-                    v.bright_red().strikethrough()
-                )?;
-            }
             write!(out, "]")?;
             // Avoid trailing color
             // https://unix.stackexchange.com/questions/212933/background-color-whitespace-when-end-of-the-terminal-reached
@@ -216,91 +273,74 @@ pub fn print_exec_trace(
     if args.print_cmdline {
         write!(out, " {}", "cmdline".purple())?;
         write!(out, " env")?;
-        if cwd != exec_data.cwd {
+        if cwd != &*exec_data.cwd {
             if args.color >= ColorLevel::Normal {
                 write!(
                     out,
                     " -C {}",
-                    escape_str_for_bash!(&exec_data.cwd).bright_cyan()
+                    escape_str_for_bash!(&*exec_data.cwd).bright_cyan()
                 )?;
             } else {
-                write!(out, " -C {}", escape_str_for_bash!(&exec_data.cwd))?;
-            }
-        }
-        let mut env = env.clone();
-        let mut updated = Vec::new(); // k,v,is_new
-        for item in exec_data.envp.iter() {
-            let (k, v) = parse_env_entry(item);
-            // Too bad that we still don't have if- and while-let-chains
-            // https://github.com/rust-lang/rust/issues/53667
-            if let Some(orig_v) = env.get(k).map(|x| x.as_str()) {
-                if orig_v != v {
-                    updated.push((k, v, false));
-                }
-                // Remove existing entry
-                env.remove(k);
-            } else {
-                updated.push((k, v, true));
+                write!(out, " -C {}", escape_str_for_bash!(&*exec_data.cwd))?;
             }
         }
-        // Now we have the tracee removed entries in env
-        for (k, _v) in env.iter() {
+        let escapes = &mut scratch.escapes;
+        // Removed entries first, then the updated ones
+        for change in scratch.differ.diff(env, &exec_data.envp) {
+            let EnvChange::Removed { key, .. } = change else {
+                continue;
+            };
             if args.color >= ColorLevel::Normal {
                 write!(
                     out,
                     " {}{}",
                     "-u ".bright_red(),
-                    escape_str_for_bash!(k).bright_red()
+                    escapes.escape(key).bright_red()
                 )?;
             } else {
-                write!(out, " -u={}", escape_str_for_bash!(k))?;
+                write!(out, " -u={}", escapes.escape(key))?;
             }
         }
-        if args.color >= ColorLevel::Normal {
-            for (k, v, is_new) in updated.into_iter() {
-                if is_new {
-                    write!(
-                        out,
-                        " {}{}{}",
-                        escape_str_for_bash!(k).green(),
-                        "=".green().bold(),
-                        escape_str_for_bash!(v).green()
-                    )?;
-                } else {
-                    write!(
-                        out,
-                        " {}{}{}",
-                        escape_str_for_bash!(k),
-                        "=".bold(),
-                        escape_str_for_bash!(v).bright_blue()
-                    )?;
-                }
-            }
-        } else {
-            for (k, v, _) in updated.into_iter() {
-                write!(
-                    out,
-                    " {}={}",
-                    escape_str_for_bash!(k),
-                    escape_str_for_bash!(v)
-                )?;
+        for change in scratch.differ.diff(env, &exec_data.envp) {
+            let (key, value, is_new) = match change {
+                EnvChange::Added { key, value } => (key, value, true),
+                EnvChange::Modified { key, value } => (key, value, false),
+                EnvChange::Removed { .. } => break,
+            };
+            // The escaped strings borrow the cache, so they are written one by one
+            write!(out, " ")?;
+            if args.color >= ColorLevel::Normal && is_new {
+                write!(out, "{}", escapes.escape(key).green())?;
+                write!(out, "{}", "=".green().bold())?;
+                write!(out, "{}", escapes.escape(value).green())?;
+            } else if args.color >= ColorLevel::Normal {
+                write!(out, "{}", escapes.escape(key))?;
+                write!(out, "{}", "=".bold())?;
+                write!(out, "{}", escapes.escape(value).bright_blue())?;
+            } else {
+                write!(out, "{}=", escapes.escape(key))?;
+                write!(out, "{}", escapes.escape(value))?;
             }
         }
         for (idx, arg) in exec_data.argv.iter().enumerate() {
             if idx == 0 {
-                let escaped_filename = shell_quote::bash::escape(&exec_data.filename);
+                let escaped_filename = shell_quote::bash::escape(&*exec_data.filename);
                 let escaped_filename_lossy = String::from_utf8_lossy(&escaped_filename);
-                if !escaped_filename_lossy.ends_with(arg) {
+                if !escaped_filename_lossy.ends_with(&**arg) {
                     deferred_warning.warning = DeferredWarningKind::Argv0AndFileNameDiffers;
                 }
                 write!(out, " {}", escaped_filename_lossy)?;
                 continue;
             }
-            write!(out, " {}", escape_str_for_bash!(arg))?;
+            write!(out, " {}", escape_str_for_bash!(&**arg))?;
         }
     }
     if result == 0 {
         writeln!(out)?;
+    } else if result == UNKNOWN_EXEC_RESULT {
+        writeln!(out, " {} {}", "=".purple(), "unknown".yellow())?;
+    } else if result == UNKNOWN_EXEC_ERROR {
+        writeln!(out, " {} {}", "=".purple(), "failed".bright_red().bold())?;
     } else {
         write!(out, " {} ", "=".purple())?;
         if args.decode_errno {
@@ -314,10 +354,6 @@ pub fn print_exec_trace(
             writeln!(out, "{}", result.bright_red().bold())?;
         }
     }
-    // It is critical to call [flush] before BufWriter<W> is dropped.
-    // Though dropping will attempt to flush the contents of the buffer, any errors that happen in the process of dropping will be ignored.
-    // Calling [flush] ensures that the buffer is empty and thus dropping will not even attempt file operations.
-    out.flush()?;
     Ok(())
 }
 
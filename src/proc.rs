@@ -1,30 +1,88 @@
 use core::fmt;
 use std::{
     borrow::Cow,
-    ffi::CString,
+    ffi::{CString, OsString},
     fmt::{Display, Formatter},
+    fs::File,
     io::{self, BufRead, BufReader, Read},
+    os::{
+        fd::{AsRawFd, FromRawFd, OwnedFd, RawFd},
+        unix::ffi::{OsStrExt, OsStringExt},
+    },
     path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc,
+    },
 };
 
 use color_eyre::owo_colors::OwoColorize;
 
-use nix::{libc::AT_FDCWD, unistd::Pid};
+use nix::{
+    errno::Errno,
+    libc::{self, AT_EMPTY_PATH, AT_FDCWD},
+    unistd::Pid,
+};
+
+use crate::intern::{intern_bytes, intern_str};
 
-pub fn read_argv(pid: Pid) -> color_eyre::Result<Vec<CString>> {
-    let filename = format!("/proc/{pid}/cmdline");
-    let buf = std::fs::read(filename)?;
-    Ok(buf
+fn parse_nul_separated_strings(buf: &[u8]) -> Vec<Arc<str>> {
+    if buf.is_empty() {
+        return Vec::new();
+    }
+    buf.strip_suffix(&[0])
+        .unwrap_or(buf)
         .split(|&c| c == 0)
-        .map(CString::new)
-        .collect::<Result<Vec<_>, _>>()?)
+        .map(intern_bytes)
+        .collect()
 }
 
-pub fn read_comm(pid: Pid) -> color_eyre::Result<String> {
+pub fn read_comm(pid: Pid) -> color_eyre::Result<Arc<str>> {
     let filename = format!("/proc/{pid}/comm");
     let mut buf = std::fs::read(filename)?;
     buf.pop(); // remove trailing newline
-    Ok(String::from_utf8(buf)?)
+    Ok(intern_str(std::str::from_utf8(&buf)?))
+}
+
+/// Get the thread group id of the thread `tid`
+pub fn read_tgid(tid: Pid) -> std::io::Result<Pid> {
+    let file = File::open(format!("/proc/{tid}/status"))?;
+    for line in BufReader::new(file).lines() {
+        if let Some(tgid) = line?.strip_prefix("Tgid:") {
+            return tgid
+                .trim()
+                .parse()
+                .map(Pid::from_raw)
+                .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e));
+        }
+    }
+    Err(io::Error::new(
+        io::ErrorKind::InvalidData,
+        "no Tgid in status",
+    ))
+}
+
+/// Max length of comm, including the trailing NUL
+pub const TASK_COMM_LEN: usize = 16;
+
+/// The comm that the kernel sets on a successful exec of `filename`
+pub fn comm_from_filename(filename: &Path) -> Arc<str> {
+    let name = filename.file_name().map_or(&[][..], |x| x.as_bytes());
+    intern_bytes(&name[..name.len().min(TASK_COMM_LEN - 1)])
+}
+
+static AVOIDED_READS: AtomicU64 = AtomicU64::new(0);
+
+/// Count the reads from /proc that are skipped because nothing needs them
+pub fn count_avoided_reads(count: u64) {
+    AVOIDED_READS.fetch_add(count, Ordering::Relaxed);
+}
+
+pub fn log_stats() {
+    log::info!(
+        "avoided {} reads from /proc",
+        AVOIDED_READS.load(Ordering::Relaxed)
+    );
 }
 
 pub fn read_cwd(pid: Pid) -> std::io::Result<PathBuf> {
@@ -41,6 +99,195 @@ pub fn read_fd(pid: Pid, fd: i32) -> std::io::Result<PathBuf> {
     std::fs::read_link(filename)
 }
 
+/// Get the file executed by `execveat(dirfd, pathname, argv, envp, flags)`
+pub fn resolve_execveat_filename(
+    pid: Pid,
+    dirfd: i32,
+    pathname: PathBuf,
+    flags: i32,
+) -> std::io::Result<PathBuf> {
+    resolve_execveat_filename_with(dirfd, pathname, flags, |fd| read_fd(pid, fd))
+}
+
+fn resolve_execveat_filename_with(
+    dirfd: i32,
+    pathname: PathBuf,
+    flags: i32,
+    read_fd: impl FnOnce(i32) -> std::io::Result<PathBuf>,
+) -> std::io::Result<PathBuf> {
+    if pathname.is_absolute() {
+        // If pathname is absolute, then dirfd is ignored.
+        Ok(pathname)
+    } else if pathname.as_os_str().is_empty() && (flags & AT_EMPTY_PATH) != 0 {
+        // If  pathname  is an empty string and the AT_EMPTY_PATH flag is specified, then the file descriptor dirfd
+        // specifies the file to be executed
+        read_fd(dirfd)
+    } else {
+        // pathname is relative to dirfd
+        let dir = read_fd(dirfd)?;
+        Ok(dir.join(pathname))
+    }
+}
+
+/// An opened /proc/<pid> directory.
+///
+/// Reads are done relative to it, which saves the path lookups from the root.
+/// Once the process is gone, they fail instead of reading a process that reused the pid.
+#[derive(Debug)]
+pub struct ProcDir {
+    dir: OwnedFd,
+    /// None if pidfd is not supported, e.g. for threads or on old kernels
+    pidfd: Option<OwnedFd>,
+}
+
+impl ProcDir {
+    pub fn open(pid: Pid) -> io::Result<Self> {
+        let pidfd = match unsafe { libc::syscall(libc::SYS_pidfd_open, pid.as_raw(), 0) } {
+            -1 => match io::Error::last_os_error() {
+                e if matches!(e.raw_os_error(), Some(libc::ENOSYS | libc::EINVAL)) => None,
+                e => return Err(e),
+            },
+            fd => Some(unsafe { OwnedFd::from_raw_fd(fd as RawFd) }),
+        };
+        let path = CString::new(format!("/proc/{pid}")).unwrap();
+        let dir = match unsafe {
+            libc::open(
+                path.as_ptr(),
+                libc::O_PATH | libc::O_DIRECTORY | libc::O_CLOEXEC,
+            )
+        } {
+            -1 => return Err(io::Error::last_os_error()),
+            fd => unsafe { OwnedFd::from_raw_fd(fd) },
+        };
+        let proc_dir = Self { dir, pidfd };
+        // If the process is still alive after opening the directory,
+        // the directory belongs to it rather than to a process that reused the pid.
+        if !proc_dir.is_alive() {
+            return Err(io::Error::from_raw_os_error(libc::ESRCH));
+        }
+        Ok(proc_dir)
+    }
+
+    /// Always true without a pidfd
+    pub fn is_alive(&self) -> bool {
+        let Some(pidfd) = self.pidfd.as_ref() else {
+            return true;
+        };
+        let ret = unsafe {
+            libc::syscall(
+                libc::SYS_pidfd_send_signal,
+                pidfd.as_raw_fd(),
+                0,
+                std::ptr::null::<libc::siginfo_t>(),
+                0,
+            )
+        };
+        ret == 0
+    }
+
+    /// `name` must be NUL-terminated
+    fn read_file(&self, name: &[u8]) -> io::Result<Vec<u8>> {
+        debug_assert_eq!(name.last(), Some(&0));
+        let fd = unsafe {
+            libc::openat(
+                self.dir.as_raw_fd(),
+                name.as_ptr() as *const libc::c_char,
+                libc::O_RDONLY | libc::O_CLOEXEC,
+            )
+        };
+        if fd == -1 {
+            return Err(io::Error::last_os_error());
+        }
+        let mut buf = Vec::new();
+        unsafe { File::from_raw_fd(fd) }.read_to_end(&mut buf)?;
+        Ok(buf)
+    }
+
+    /// `name` must be NUL-terminated
+    fn read_link(&self, name: &[u8]) -> io::Result<PathBuf> {
+        debug_assert_eq!(name.last(), Some(&0));
+        let mut buf = Vec::<u8>::with_capacity(256);
+        loop {
+            let len = unsafe {
+                libc::readlinkat(
+                    self.dir.as_raw_fd(),
+                    name.as_ptr() as *const libc::c_char,
+                    buf.as_mut_ptr() as *mut libc::c_char,
+                    buf.capacity(),
+                )
+            };
+            if len == -1 {
+                return Err(io::Error::last_os_error());
+            }
+            let len = len as usize;
+            if len < buf.capacity() {
+                // SAFETY: readlinkat initialized len bytes
+                unsafe { buf.set_len(len) };
+                return Ok(PathBuf::from(OsString::from_vec(buf)));
+            }
+            // The link might be truncated
+            buf.reserve(buf.capacity() * 2);
+        }
+    }
+
+    pub fn read_comm(&self) -> io::Result<Arc<str>> {
+        let mut buf = self.read_file(b"comm\0")?;
+        buf.pop(); // remove trailing newline
+        Ok(intern_bytes(&buf))
+    }
+
+    /// Read argv. Note that the process can modify it.
+    pub fn read_cmdline(&self) -> io::Result<Vec<Arc<str>>> {
+        Ok(parse_nul_separated_strings(&self.read_file(b"cmdline\0")?))
+    }
+
+    /// Read the initial environment of the process.
+    pub fn read_environ(&self) -> io::Result<Vec<Arc<str>>> {
+        Ok(parse_nul_separated_strings(&self.read_file(b"environ\0")?))
+    }
+
+    pub fn read_exe(&self) -> io::Result<PathBuf> {
+        self.read_link(b"exe\0")
+    }
+
+    pub fn read_cwd(&self) -> io::Result<PathBuf> {
+        self.read_link(b"cwd\0")
+    }
+
+    pub fn read_fd(&self, fd: i32) -> io::Result<PathBuf> {
+        if fd == AT_FDCWD {
+            return self.read_cwd();
+        }
+        self.read_link(format!("fd/{fd}\0").as_bytes())
+    }
+
+    pub fn resolve_execveat_filename(
+        &self,
+        dirfd: i32,
+        pathname: PathBuf,
+        flags: i32,
+    ) -> io::Result<PathBuf> {
+        resolve_execveat_filename_with(dirfd, pathname, flags, |fd| self.read_fd(fd))
+    }
+}
+
+/// Each ProcDir holds file descriptors, so allow as many as the hard limit permits
+pub fn raise_fd_limit() {
+    let mut limit = libc::rlimit {
+        rlim_cur: 0,
+        rlim_max: 0,
+    };
+    if unsafe { libc::getrlimit(libc::RLIMIT_NOFILE, &mut limit) } == -1 {
+        return;
+    }
+    if limit.rlim_cur < limit.rlim_max {
+        limit.rlim_cur = limit.rlim_max;
+        if unsafe { libc::setrlimit(libc::RLIMIT_NOFILE, &limit) } == -1 {
+            log::debug!("Failed to raise the fd limit: {}", Errno::last());
+        }
+    }
+}
+
 #[derive(Debug)]
 pub enum Interpreter {
     None,
@@ -0,0 +1,454 @@
+//! Netlink proc connector(cn_proc) backend.
+//!
+//! The kernel multicasts fork/exec/exit events of all processes to the socket.
+//! Tracees never stop, and the details of each exec are read from /proc afterwards,
+//! which means that the output is lossy by nature:
+//!
+//! - the process might have exited or exec'd again before we read /proc
+//! - argv in /proc/<pid>/cmdline can be modified by the process itself
+//! - only successful execs are reported
+//! - events are lost when the socket buffer overflows
+//!
+//! All these cases are reported in the output.
+
+use std::{collections::HashMap, io::Write, path::Path, process::exit};
+
+use nix::{
+    errno::Errno,
+    libc::{self, tcsetpgrp, STDIN_FILENO},
+    sys::wait::{waitpid, WaitPidFlag, WaitStatus},
+    unistd::{getpid, Pid},
+};
+
+use crate::{
+    cli::TracingArgs,
+    intern::intern_path,
+    pipeline::{ExecEvent, Pipeline, TracerEvent},
+    printer::PrinterArgs,
+    proc::{count_avoided_reads, raise_fd_limit, read_interpreter_recursive, ProcDir},
+    spawn::spawn_gated,
+    state::{ExecData, ProcessState, ProcessStateStore, ProcessStatus},
+};
+
+// From linux/connector.h and linux/cn_proc.h
+const NETLINK_CONNECTOR: libc::c_int = 11;
+const CN_IDX_PROC: u32 = 1;
+const CN_VAL_PROC: u32 = 1;
+const PROC_CN_MCAST_LISTEN: u32 = 1;
+
+const PROC_EVENT_FORK: u32 = 0x00000001;
+const PROC_EVENT_EXEC: u32 = 0x00000002;
+const PROC_EVENT_EXIT: u32 = 0x80000000;
+
+const NLMSG_HDRLEN: usize = 16;
+const CN_MSG_LEN: usize = 20;
+/// Offset of struct proc_event in a netlink message
+const PROC_EVENT_OFFSET: usize = NLMSG_HDRLEN + CN_MSG_LEN;
+/// Offset of the event_data union in struct proc_event
+const EVENT_DATA_OFFSET: usize = 16;
+
+const RECV_BUFFER_SIZE: usize = 8192;
+/// Requested size of the socket receive buffer, to survive event bursts
+const SOCKET_RCVBUF_SIZE: libc::c_int = 16 * 1024 * 1024;
+
+fn u32_at(buf: &[u8], offset: usize) -> u32 {
+    u32::from_ne_bytes(buf[offset..offset + 4].try_into().unwrap())
+}
+
+fn pid_at(buf: &[u8], offset: usize) -> Pid {
+    Pid::from_raw(u32_at(buf, offset) as i32)
+}
+
+/// Process level events. Events of non-leader threads are filtered out.
+#[derive(Debug, Clone, Copy)]
+pub enum ProcEvent {
+    Fork {
+        parent: Pid,
+        child: Pid,
+    },
+    Exec {
+        pid: Pid,
+    },
+    Exit {
+        pid: Pid,
+        exit_code: i32,
+    },
+    /// Some events are lost. The count is unknown if the socket buffer overflowed.
+    Lost(Option<u64>),
+}
+
+pub struct ProcConnectorSocket {
+    fd: libc::c_int,
+    buf: Vec<u8>,
+    /// cpu -> sequence number of the last event
+    last_seq: HashMap<u32, u32>,
+}
+
+impl Drop for ProcConnectorSocket {
+    fn drop(&mut self) {
+        unsafe { libc::close(self.fd) };
+    }
+}
+
+impl ProcConnectorSocket {
+    pub fn subscribe() -> color_eyre::Result<Self> {
+        let fd = unsafe {
+            libc::socket(
+                libc::AF_NETLINK,
+                libc::SOCK_DGRAM | libc::SOCK_CLOEXEC,
+                NETLINK_CONNECTOR,
+            )
+        };
+        if fd == -1 {
+            return Err(Errno::last().into());
+        }
+        let socket = Self {
+            fd,
+            buf: vec![0u8; RECV_BUFFER_SIZE],
+            last_seq: HashMap::new(),
+        };
+        // Best effort. SO_RCVBUFFORCE needs CAP_NET_ADMIN, which we need anyway.
+        for opt in [libc::SO_RCVBUFFORCE, libc::SO_RCVBUF] {
+            if 0 == unsafe {
+                libc::setsockopt(
+                    fd,
+                    libc::SOL_SOCKET,
+                    opt,
+                    &SOCKET_RCVBUF_SIZE as *const libc::c_int as *const libc::c_void,
+                    std::mem::size_of::<libc::c_int>() as libc::socklen_t,
+                )
+            } {
+                break;
+            }
+        }
+        let mut addr: libc::sockaddr_nl = unsafe { std::mem::zeroed() };
+        addr.nl_family = libc::AF_NETLINK as libc::sa_family_t;
+        addr.nl_groups = CN_IDX_PROC;
+        if -1
+            == unsafe {
+                libc::bind(
+                    fd,
+                    &addr as *const libc::sockaddr_nl as *const libc::sockaddr,
+                    std::mem::size_of::<libc::sockaddr_nl>() as libc::socklen_t,
+                )
+            }
+        {
+            return Err(Errno::last().into());
+        }
+        // nlmsghdr + cn_msg + enum proc_cn_mcast_op
+        let mut msg = Vec::with_capacity(PROC_EVENT_OFFSET + 4);
+        msg.extend_from_slice(&((PROC_EVENT_OFFSET + 4) as u32).to_ne_bytes()); // nlmsg_len
+        msg.extend_from_slice(&(libc::NLMSG_DONE as u16).to_ne_bytes()); // nlmsg_type
+        msg.extend_from_slice(&0u16.to_ne_bytes()); // nlmsg_flags
+        msg.extend_from_slice(&0u32.to_ne_bytes()); // nlmsg_seq
+        msg.extend_from_slice(&(getpid().as_raw() as u32).to_ne_bytes()); // nlmsg_pid
+        msg.extend_from_slice(&CN_IDX_PROC.to_ne_bytes()); // id.idx
+        msg.extend_from_slice(&CN_VAL_PROC.to_ne_bytes()); // id.val
+        msg.extend_from_slice(&0u32.to_ne_bytes()); // seq
+        msg.extend_from_slice(&0u32.to_ne_bytes()); // ack
+        msg.extend_from_slice(&4u16.to_ne_bytes()); // len
+        msg.extend_from_slice(&0u16.to_ne_bytes()); // flags
+        msg.extend_from_slice(&PROC_CN_MCAST_LISTEN.to_ne_bytes());
+        if -1 == unsafe { libc::send(fd, msg.as_ptr() as *const libc::c_void, msg.len(), 0) } {
+            return Err(Errno::last().into());
+        }
+        Ok(socket)
+    }
+
+    /// Wait for at most `timeout_ms` for the socket to become readable
+    pub fn poll(&self, timeout_ms: libc::c_int) -> Result<bool, Errno> {
+        let mut pollfd = libc::pollfd {
+            fd: self.fd,
+            events: libc::POLLIN,
+            revents: 0,
+        };
+        match unsafe { libc::poll(&mut pollfd, 1, timeout_ms) } {
+            -1 if Errno::last() == Errno::EINTR => Ok(false),
+            -1 => Err(Errno::last()),
+            n => Ok(n > 0),
+        }
+    }
+
+    /// Receive all pending events without blocking
+    pub fn recv_events(
+        &mut self,
+        mut handler: impl FnMut(ProcEvent) -> color_eyre::Result<()>,
+    ) -> color_eyre::Result<()> {
+        let mut buf = std::mem::take(&mut self.buf);
+        let result = loop {
+            let len = match unsafe {
+                libc::recv(
+                    self.fd,
+                    buf.as_mut_ptr() as *mut libc::c_void,
+                    buf.len(),
+                    libc::MSG_DONTWAIT,
+                )
+            } {
+                -1 => match Errno::last() {
+                    Errno::EAGAIN => break Ok(()),
+                    Errno::EINTR => continue,
+                    Errno::ENOBUFS => {
+                        // The socket buffer overflowed. We don't know how many events are lost.
+                        if let Err(e) = handler(ProcEvent::Lost(None)) {
+                            break Err(e);
+                        }
+                        continue;
+                    }
+                    e => break Err(e.into()),
+                },
+                n => n as usize,
+            };
+            if let Err(e) = self.parse_datagram(&buf[..len], &mut handler) {
+                break Err(e);
+            }
+        };
+        self.buf = buf;
+        result
+    }
+
+    fn parse_datagram(
+        &mut self,
+        mut buf: &[u8],
+        handler: &mut impl FnMut(ProcEvent) -> color_eyre::Result<()>,
+    ) -> color_eyre::Result<()> {
+        while buf.len() >= NLMSG_HDRLEN {
+            let len = u32_at(buf, 0) as usize;
+            if len < NLMSG_HDRLEN || len > buf.len() {
+                log::warn!("Malformed netlink message from proc connector");
+                return Ok(());
+            }
+            if len >= PROC_EVENT_OFFSET + EVENT_DATA_OFFSET + 16 {
+                if let Some(lost) = self.check_seq(&buf[..len]) {
+                    handler(ProcEvent::Lost(Some(lost)))?;
+                }
+                if let Some(event) = parse_event(&buf[PROC_EVENT_OFFSET..len]) {
+                    handler(event)?;
+                }
+            }
+            // NLMSG_ALIGN
+            let aligned = (len + 3) & !3;
+            buf = &buf[aligned.min(buf.len())..];
+        }
+        Ok(())
+    }
+
+    /// The kernel numbers the events per cpu. A gap means lost events.
+    fn check_seq(&mut self, msg: &[u8]) -> Option<u64> {
+        let seq = u32_at(msg, NLMSG_HDRLEN + 8);
+        let cpu = u32_at(msg, PROC_EVENT_OFFSET + 4);
+        let last = self.last_seq.insert(cpu, seq)?;
+        let lost = seq.wrapping_sub(last).wrapping_sub(1);
+        if lost != 0 && lost < u32::MAX / 2 {
+            log::warn!("{lost} proc connector events are lost on cpu {cpu}");
+            Some(lost as u64)
+        } else {
+            None
+        }
+    }
+}
+
+fn parse_event(event: &[u8]) -> Option<ProcEvent> {
+    let data = EVENT_DATA_OFFSET;
+    match u32_at(event, 0) {
+        PROC_EVENT_FORK => {
+            let child_pid = pid_at(event, data + 8);
+            let child_tgid = pid_at(event, data + 12);
+            // Skip new threads
+            (child_pid == child_tgid).then(|| ProcEvent::Fork {
+                parent: pid_at(event, data + 4), // parent_tgid
+                child: child_tgid,
+            })
+        }
+        PROC_EVENT_EXEC => Some(ProcEvent::Exec {
+            pid: pid_at(event, data + 4), // process_tgid
+        }),
+        PROC_EVENT_EXIT => {
+            let pid = pid_at(event, data);
+            (pid == pid_at(event, data + 4)).then(|| ProcEvent::Exit {
+                pid,
+                exit_code: u32_at(event, data + 8) as i32,
+            })
+        }
+        _ => None,
+    }
+}
+
+pub struct ProcConnectorTracer {
+    store: ProcessStateStore,
+    args: PrinterArgs,
+    print_children: bool,
+    pipeline: Pipeline,
+    lost_events: u64,
+    lost_execs: u64,
+}
+
+impl ProcConnectorTracer {
+    pub fn new(
+        tracing_args: TracingArgs,
+        output: Box<dyn Write + Send>,
+    ) -> color_eyre::Result<Self> {
+        Ok(Self {
+            store: ProcessStateStore::from_cli(&tracing_args)?,
+            pipeline: Pipeline::new(&tracing_args, output)?,
+            print_children: tracing_args.show_children,
+            args: PrinterArgs::from_cli(&tracing_args),
+            lost_events: 0,
+            lost_execs: 0,
+        })
+    }
+
+    pub fn start_root_process(&mut self, args: Vec<String>) -> color_eyre::Result<()> {
+        let mut socket = ProcConnectorSocket::subscribe()?;
+        raise_fd_limit();
+        let (root_child, gate) = spawn_gated(args, || Ok(()))?;
+        // Set foreground process group of the terminal
+        if -1 == unsafe { tcsetpgrp(STDIN_FILENO, root_child.as_raw()) } {
+            return Err(Errno::last().into());
+        }
+        let mut root_child_state = ProcessState::new(root_child, 0)?;
+        root_child_state.ppid = Some(getpid());
+        self.store.insert(root_child_state);
+        gate.open()?;
+        loop {
+            if socket.poll(100)? {
+                socket.recv_events(|event| self.handle_event(event))?;
+            }
+            let code = match waitpid(root_child, Some(WaitPidFlag::WNOHANG))? {
+                WaitStatus::Exited(_, code) => code,
+                WaitStatus::Signaled(_, sig, _) => 128 + (sig as i32),
+                _ => continue,
+            };
+            // The events before the exit of the root are already queued
+            socket.recv_events(|event| self.handle_event(event))?;
+            if self.lost_events != 0 || self.lost_execs != 0 {
+                log::warn!(
+                    "The output is incomplete: {} events are lost, the details of {} execs are lost",
+                    self.lost_events,
+                    self.lost_execs
+                );
+            }
+            self.pipeline.finish()?;
+            exit(code)
+        }
+    }
+
+    fn handle_event(&mut self, event: ProcEvent) -> color_eyre::Result<()> {
+        match event {
+            ProcEvent::Fork { parent, child } => {
+                let Some(parent_state) = self.store.get_current_mut(parent) else {
+                    return Ok(());
+                };
+                if matches!(parent_state.status, ProcessStatus::Exited(_)) {
+                    return Ok(());
+                }
+                let comm = parent_state.comm.clone();
+                if self.print_children {
+                    self.pipeline.submit(TracerEvent::NewChild {
+                        pid: parent,
+                        comm: comm.clone(),
+                        child,
+                    })?;
+                }
+                let mut state = ProcessState::with_comm(child, comm);
+                state.ppid = Some(parent);
+                state.env = parent_state.env.clone();
+                // Open the /proc directory early, the child might exec at once
+                if let Err(e) = state.proc_dir() {
+                    log::debug!("{child}: failed to open /proc directory: {e}");
+                }
+                self.store.insert(state);
+            }
+            ProcEvent::Exec { pid } => {
+                let Some(state) = self.store.get_current_mut(pid) else {
+                    return Ok(());
+                };
+                if matches!(state.status, ProcessStatus::Exited(_)) {
+                    return Ok(());
+                }
+                self.on_exec(pid)?;
+            }
+            ProcEvent::Exit { pid, exit_code } => {
+                self.store.mark_exited(pid, Some(exit_code));
+            }
+            ProcEvent::Lost(Some(count)) => self.lost_events += count,
+            ProcEvent::Lost(None) => {
+                log::warn!("proc connector socket buffer overflowed, events are lost!");
+                self.lost_events += 1;
+            }
+        }
+        Ok(())
+    }
+
+    fn on_exec(&mut self, pid: Pid) -> color_eyre::Result<()> {
+        let need_cwd = self.args.trace_cwd || self.args.print_cmdline;
+        let (need_argv, need_envp) = (self.args.needs_argv(), self.args.needs_envp());
+        count_avoided_reads(!need_argv as u64 + !need_envp as u64);
+        let read_exec_data = |dir: &ProcDir| -> std::io::Result<ExecData> {
+            Ok(ExecData {
+                filename: intern_path(&dir.read_exe()?),
+                argv: match need_argv {
+                    true => dir.read_cmdline()?,
+                    false => Vec::new(),
+                },
+                envp: match need_envp {
+                    true => dir.read_environ()?,
+                    false => Vec::new(),
+                },
+                cwd: if need_cwd {
+                    intern_path(&dir.read_cwd()?)
+                } else {
+                    intern_path(Path::new(""))
+                },
+                interpreters: Vec::new(),
+            })
+        };
+        let state = self.store.get_current_mut(pid).unwrap();
+        let mut exec_data = match state.proc_dir().and_then(read_exec_data) {
+            Ok(exec_data) => exec_data,
+            Err(e) => {
+                self.lost_execs += 1;
+                let reason = if e.kind() == std::io::ErrorKind::NotFound {
+                    "exited before /proc could be read".to_string()
+                } else {
+                    format!("failed to read /proc: {e}")
+                };
+                log::debug!("{pid}: exec details lost: {reason}");
+                let comm = state.comm.clone();
+                self.pipeline
+                    .submit(TracerEvent::LostExec { pid, comm, reason })?;
+                return Ok(());
+            }
+        };
+        // Not shown ones still update the process state
+        let shown = self.args.accepts(
+            &exec_data.filename,
+            &state.comm,
+            &exec_data.argv,
+            &exec_data.envp,
+            0,
+        );
+        if shown && self.args.trace_interpreter {
+            exec_data.interpreters = read_interpreter_recursive(&exec_data.filename);
+        }
+        // Like the other backends, the comm before exec is printed
+        let comm = match state.proc_dir().and_then(|dir| dir.read_comm()) {
+            Ok(comm) => std::mem::replace(&mut state.comm, comm),
+            Err(_) => state.comm.clone(),
+        };
+        let env = match self.args.track_env() {
+            true => state.replace_env(&exec_data.envp),
+            false => None,
+        };
+        if !shown {
+            return Ok(());
+        }
+        // Only successful execs are reported by the kernel
+        self.pipeline.submit(TracerEvent::Exec(ExecEvent {
+            pid,
+            comm,
+            result: 0,
+            env,
+            exec_data,
+        }))
+    }
+}
@@ -0,0 +1,44 @@
+//! Subtrees that the ptrace backend stops tracing.
+//!
+//! A pruned process is detached together with its future children, so that it runs
+//! at native speed. With seccomp-bpf, detaching would make its exec syscalls fail,
+//! so it stays attached instead, but the execs of its subtree are neither read nor shown.
+
+use std::{os::unix::ffi::OsStrExt, path::Path};
+
+use regex::{bytes, Regex};
+
+use crate::{cli::TracingArgs, proc::comm_from_filename};
+
+#[derive(Debug, Clone, Default)]
+pub struct PruneRules {
+    depth: Option<u32>,
+    comm: Option<Regex>,
+    filename: Option<bytes::Regex>,
+}
+
+impl PruneRules {
+    pub fn from_cli(tracing_args: &TracingArgs) -> Self {
+        Self {
+            depth: tracing_args.prune_depth,
+            comm: tracing_args.prune_comm.clone(),
+            filename: tracing_args.prune_filename.clone(),
+        }
+    }
+
+    /// Whether a new child at this depth below the root processes is pruned
+    pub fn prunes_depth(&self, depth: u32) -> bool {
+        self.depth.is_some_and(|max| depth > max)
+    }
+
+    /// Whether a process is pruned after it successfully executed the file
+    pub fn prunes_exec(&self, filename: &Path) -> bool {
+        self.filename
+            .as_ref()
+            .is_some_and(|x| x.is_match(filename.as_os_str().as_bytes()))
+            || self
+                .comm
+                .as_ref()
+                .is_some_and(|x| x.is_match(&comm_from_filename(filename)))
+    }
+}
@@ -0,0 +1,243 @@
+//! seccomp-bpf filter that only stops the tracee at exec syscalls.
+//!
+//! With the filter loaded, the tracer can resume tracees with `PTRACE_CONT`
+//! and use the `PTRACE_EVENT_SECCOMP` stop as the syscall-entry stop of
+//! execve/execveat. All other syscalls run at native speed.
+//!
+//! The same filter can also notify a supervisor through a listener fd(`SECCOMP_RET_USER_NOTIF`)
+//! instead of stopping the tracee for ptrace.
+
+use std::os::fd::RawFd;
+
+use nix::{
+    errno::Errno,
+    libc::{self, sock_filter, sock_fprog, SYS_execve, SYS_execveat, PR_SET_NO_NEW_PRIVS},
+};
+
+use crate::arch::AUDIT_ARCH;
+
+// From linux/filter.h and linux/seccomp.h.
+// Defined here because older libc versions don't export all of them.
+const BPF_LD: u16 = 0x00;
+const BPF_JMP: u16 = 0x05;
+const BPF_RET: u16 = 0x06;
+const BPF_W: u16 = 0x00;
+const BPF_ABS: u16 = 0x20;
+const BPF_JEQ: u16 = 0x10;
+const BPF_K: u16 = 0x00;
+
+const SECCOMP_SET_MODE_FILTER: libc::c_uint = 1;
+const SECCOMP_FILTER_FLAG_NEW_LISTENER: libc::c_uint = 1 << 3;
+const SECCOMP_RET_ALLOW: u32 = 0x7fff0000;
+const SECCOMP_RET_TRACE: u32 = 0x7ff00000;
+const SECCOMP_RET_USER_NOTIF: u32 = 0x7fc00000;
+const SECCOMP_USER_NOTIF_FLAG_CONTINUE: u32 = 1;
+
+// _IOWR('!', 0, struct seccomp_notif), _IOWR('!', 1, struct seccomp_notif_resp), _IOW('!', 2, __u64)
+const SECCOMP_IOCTL_NOTIF_RECV: libc::c_ulong = 0xc0502100;
+const SECCOMP_IOCTL_NOTIF_SEND: libc::c_ulong = 0xc0182101;
+const SECCOMP_IOCTL_NOTIF_ID_VALID: libc::c_ulong = 0x40082102;
+
+// From linux/capability.h
+const LINUX_CAPABILITY_VERSION_3: u32 = 0x20080522;
+const CAP_SYS_PTRACE: u32 = 19;
+const CAP_SYS_ADMIN: u32 = 21;
+
+// Offsets into struct seccomp_data
+const SECCOMP_DATA_NR_OFFSET: u32 = 0;
+const SECCOMP_DATA_ARCH_OFFSET: u32 = 4;
+
+const fn bpf_stmt(code: u16, k: u32) -> sock_filter {
+    sock_filter {
+        code,
+        jt: 0,
+        jf: 0,
+        k,
+    }
+}
+
+const fn bpf_jump(code: u16, k: u32, jt: u8, jf: u8) -> sock_filter {
+    sock_filter { code, jt, jf, k }
+}
+
+/// struct seccomp_notif from linux/seccomp.h, with struct seccomp_data inlined
+#[repr(C)]
+#[derive(Debug, Default)]
+pub struct SeccompNotif {
+    pub id: u64,
+    /// Thread id of the tracee in our pid namespace
+    pub pid: u32,
+    pub flags: u32,
+    pub nr: i32,
+    pub arch: u32,
+    pub instruction_pointer: u64,
+    pub args: [u64; 6],
+}
+
+/// struct seccomp_notif_resp from linux/seccomp.h
+#[repr(C)]
+struct SeccompNotifResp {
+    id: u64,
+    val: i64,
+    error: i32,
+    flags: u32,
+}
+
+/// struct __user_cap_header_struct from linux/capability.h
+#[repr(C)]
+struct CapHeader {
+    version: u32,
+    pid: libc::c_int,
+}
+
+/// struct __user_cap_data_struct from linux/capability.h
+#[repr(C)]
+#[derive(Default, Clone, Copy)]
+struct CapData {
+    effective: u32,
+    permitted: u32,
+    inheritable: u32,
+}
+
+fn has_capability(cap: u32) -> bool {
+    let mut header = CapHeader {
+        version: LINUX_CAPABILITY_VERSION_3,
+        pid: 0,
+    };
+    let mut data = [CapData::default(); 2];
+    if -1 == unsafe { libc::syscall(libc::SYS_capget, &mut header, data.as_mut_ptr()) } {
+        return false;
+    }
+    data[cap as usize / 32].effective & (1 << (cap % 32)) != 0
+}
+
+/// Whether loading a filter requires `PR_SET_NO_NEW_PRIVS`, which is the case without
+/// CAP_SYS_ADMIN. The tracees inherit it, and it can't be undone.
+pub fn needs_no_new_privs() -> bool {
+    !has_capability(CAP_SYS_ADMIN)
+}
+
+/// Whether `PR_SET_NO_NEW_PRIVS` takes anything away from the tracees.
+///
+/// It keeps setuid/setgid and file capabilities from taking effect at exec. ptrace already
+/// does that while the tracer lacks CAP_SYS_PTRACE, so only a tracer with CAP_SYS_PTRACE
+/// and without CAP_SYS_ADMIN makes a difference.
+pub fn no_new_privs_restricts_tracees() -> bool {
+    needs_no_new_privs() && has_capability(CAP_SYS_PTRACE)
+}
+
+fn is_action_available(action: &str) -> bool {
+    // actions_avail is available since Linux 4.14,
+    // which also has the 4.8+ ordering of seccomp stops and syscall-entry stops that we rely on.
+    match std::fs::read_to_string("/proc/sys/kernel/seccomp/actions_avail") {
+        Ok(actions) => actions.split_ascii_whitespace().any(|x| x == action),
+        Err(e) => {
+            log::debug!("Cannot read seccomp actions_avail: {e}");
+            false
+        }
+    }
+}
+
+/// Returns true if the running kernel supports `SECCOMP_RET_TRACE`.
+pub fn is_seccomp_trace_supported() -> bool {
+    is_action_available("trace")
+}
+
+/// Returns true if the running kernel supports `SECCOMP_RET_USER_NOTIF`.
+pub fn is_seccomp_user_notif_supported() -> bool {
+    is_action_available("user_notif")
+}
+
+fn exec_filter(action: u32) -> [sock_filter; 8] {
+    [
+        // Syscalls from foreign ABIs are not decoded by the tracer, let them pass.
+        bpf_stmt(BPF_LD | BPF_W | BPF_ABS, SECCOMP_DATA_ARCH_OFFSET),
+        bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH, 1, 0),
+        bpf_stmt(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+        bpf_stmt(BPF_LD | BPF_W | BPF_ABS, SECCOMP_DATA_NR_OFFSET),
+        bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, SYS_execve as u32, 2, 0),
+        bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, SYS_execveat as u32, 1, 0),
+        bpf_stmt(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+        bpf_stmt(BPF_RET | BPF_K, action),
+    ]
+}
+
+fn install_filter(
+    filter: &[sock_filter],
+    flags: libc::c_uint,
+    no_new_privs: bool,
+) -> Result<libc::c_long, Errno> {
+    let prog = sock_fprog {
+        len: filter.len() as u16,
+        filter: filter.as_ptr() as *mut sock_filter,
+    };
+    // Required to load a seccomp filter without CAP_SYS_ADMIN
+    if no_new_privs && -1 == unsafe { libc::prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) } {
+        return Err(Errno::last());
+    }
+    match unsafe {
+        libc::syscall(
+            libc::SYS_seccomp,
+            SECCOMP_SET_MODE_FILTER,
+            flags,
+            &prog as *const sock_fprog,
+        )
+    } {
+        -1 => Err(Errno::last()),
+        ret => Ok(ret),
+    }
+}
+
+/// Load a filter that returns `SECCOMP_RET_TRACE` for execve and execveat of the native ABI.
+///
+/// This should be called in the tracee after the tracer has set `PTRACE_O_TRACESECCOMP`,
+/// otherwise the traced syscalls will fail with ENOSYS.
+/// `no_new_privs` should come from [`needs_no_new_privs`], checked before the fork.
+pub fn load_seccomp_filters(no_new_privs: bool) -> Result<(), Errno> {
+    install_filter(&exec_filter(SECCOMP_RET_TRACE), 0, no_new_privs)?;
+    Ok(())
+}
+
+/// Load a filter that returns `SECCOMP_RET_USER_NOTIF` for execve and execveat of the native ABI.
+///
+/// Returns the listener fd, which should be handed to the supervisor.
+/// Once all copies of the listener are closed, the filtered syscalls fail with ENOSYS.
+pub fn load_user_notif_filters(no_new_privs: bool) -> Result<RawFd, Errno> {
+    Ok(install_filter(
+        &exec_filter(SECCOMP_RET_USER_NOTIF),
+        SECCOMP_FILTER_FLAG_NEW_LISTENER,
+        no_new_privs,
+    )? as RawFd)
+}
+
+/// Wait for the next notification.
+///
+/// ENOENT means that the tracee died before we got the notification.
+pub fn notif_recv(listener: RawFd) -> Result<SeccompNotif, Errno> {
+    // The kernel requires the buffer to be zeroed
+    let mut notif = SeccompNotif::default();
+    if -1 == unsafe { libc::ioctl(listener, SECCOMP_IOCTL_NOTIF_RECV as _, &mut notif) } {
+        return Err(Errno::last());
+    }
+    Ok(notif)
+}
+
+/// Check that the tracee of the notification is still waiting for the response,
+/// so that its pid has not been reused.
+pub fn notif_id_valid(listener: RawFd, id: u64) -> bool {
+    0 == unsafe { libc::ioctl(listener, SECCOMP_IOCTL_NOTIF_ID_VALID as _, &id) }
+}
+
+/// Let the kernel continue the syscall as if nothing happened (Linux 5.5+)
+pub fn notif_continue(listener: RawFd, id: u64) -> Result<(), Errno> {
+    let resp = SeccompNotifResp {
+        id,
+        val: 0,
+        error: 0,
+        flags: SECCOMP_USER_NOTIF_FLAG_CONTINUE,
+    };
+    if -1 == unsafe { libc::ioctl(listener, SECCOMP_IOCTL_NOTIF_SEND as _, &resp) } {
+        return Err(Errno::last());
+    }
+    Ok(())
+}
@@ -0,0 +1,356 @@
+//! Tracer threads of the ptrace backend.
+//!
+//! A tracee can only be controlled by the thread that attached it, and its children
+//! are attached to the same thread. To spread a big process tree over several threads,
+//! a new child can be handed over to the least busy thread when the thread of its parent
+//! is busier: the old thread detaches it in its initial stop, and the new one seizes it
+//! and stops it with PTRACE_INTERRUPT.
+//!
+//! The child runs untraced between the detach and the seize. An exec right after its fork
+//! can be missed, and a child it forks right away is not traced at all. That's why handovers
+//! are only done with --hand-over-children, and never with seccomp-bpf, where the execs of
+//! an untraced tracee fail with ENOSYS.
+//!
+//! Only new children are handed over. Running processes and their subtrees are not moved
+//! to a less busy thread.
+//!
+//! Each thread also receives the execs read by the capture threads here.
+//!
+//! When tracing should stop, every thread is woken up to detach from its tracees.
+
+use std::{
+    sync::{
+        atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering},
+        Condvar, Mutex, Once, OnceLock,
+    },
+    time::Duration,
+};
+
+use nix::libc::{self, c_int, pthread_t};
+
+use crate::{capture::ExecCapture, state::ProcessState, tracer::LoopStats};
+
+/// Hand over a new child when the thread of its parent has more live tracees than this
+/// plus the live tracees of the least busy thread.
+const MAX_IMBALANCE: usize = 1;
+
+pub struct Shards {
+    shards: Box<[Shard]>,
+    /// Set when the tracees should be left alone
+    detach: AtomicBool,
+    execs: AtomicU64,
+    max_execs: Option<u64>,
+    /// Whether new children are handed over to other threads
+    hand_over_children: bool,
+}
+
+#[derive(Default)]
+struct Shard {
+    /// Live tracees of the thread
+    load: AtomicUsize,
+    thread: OnceLock<pthread_t>,
+    inbox: Mutex<Inbox>,
+    /// Signaled when something is put into the inbox, and when the thread took it
+    cond: Condvar,
+    stats: Mutex<LoopStats>,
+}
+
+impl Shard {
+    fn wake(&self) {
+        if let Some(&thread) = self.thread.get() {
+            unsafe { libc::pthread_kill(thread, wake_signal()) };
+        }
+    }
+}
+
+#[derive(Default)]
+struct Inbox {
+    states: Vec<ProcessState>,
+    /// Number of processes handed over to the thread so far
+    handed: u64,
+    /// Number of processes the thread has seized (or found gone) so far
+    accepted: u64,
+    captures: Vec<ExecCapture>,
+    /// Number of captures completed for the thread so far
+    completed: u64,
+    /// Number of captures the thread has taken so far
+    taken: u64,
+    /// The thread has no tracees, and waits for handoffs
+    idle: bool,
+    /// The thread has stopped tracing, and handed over its output
+    stopped: bool,
+    /// The thread has seen the detach request
+    detach_seen: bool,
+}
+
+/// Interrupts the waitpid of a tracer thread, so that it checks its inbox
+fn wake_signal() -> c_int {
+    libc::SIGRTMIN()
+}
+
+extern "C" fn on_wake_signal(_: c_int) {}
+
+/// Needed before anything is put into the inbox of a thread other than the current one
+pub fn install_wake_signal() {
+    static INSTALL: Once = Once::new();
+    INSTALL.call_once(|| unsafe {
+        // No SA_RESTART, so that waitpid fails with EINTR
+        let mut action: libc::sigaction = std::mem::zeroed();
+        action.sa_sigaction = on_wake_signal as extern "C" fn(c_int) as usize;
+        libc::sigemptyset(&mut action.sa_mask);
+        if libc::sigaction(wake_signal(), &action, std::ptr::null_mut()) == -1 {
+            log::error!(
+                "Failed to install the wake signal handler: {}",
+                std::io::Error::last_os_error()
+            );
+        }
+    });
+}
+
+impl Shards {
+    pub fn new(threads: usize, max_execs: Option<u64>, hand_over_children: bool) -> Self {
+        let threads = threads.max(1);
+        if threads > 1 {
+            install_wake_signal();
+        }
+        Self {
+            shards: (0..threads).map(|_| Shard::default()).collect(),
+            detach: AtomicBool::new(false),
+            execs: AtomicU64::new(0),
+            max_execs,
+            hand_over_children,
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.shards.len()
+    }
+
+    /// Called by each tracer thread before it starts tracing
+    pub fn register(&self, shard: usize, thread: pthread_t) {
+        let _ = self.shards[shard].thread.set(thread);
+    }
+
+    pub fn set_load(&self, shard: usize, load: usize) {
+        self.shards[shard].load.store(load, Ordering::Relaxed);
+    }
+
+    /// The thread a new child of this thread should be handed over to, if any
+    pub fn pick_target(&self, shard: usize) -> Option<usize> {
+        if self.shards.len() == 1 || !self.hand_over_children {
+            return None;
+        }
+        let (target, min) = self
+            .shards
+            .iter()
+            .enumerate()
+            .map(|(i, x)| (i, x.load.load(Ordering::Relaxed)))
+            .min_by_key(|&(_, load)| load)?;
+        let load = self.shards[shard].load.load(Ordering::Relaxed);
+        (target != shard && load > min + MAX_IMBALANCE).then_some(target)
+    }
+
+    /// Hand over a detached process. Returns the ticket to wait for with [`Shards::wait_accepted`].
+    pub fn hand_over(&self, target: usize, state: ProcessState) -> u64 {
+        let shard = &self.shards[target];
+        let mut inbox = shard.inbox.lock().unwrap();
+        inbox.states.push(state);
+        inbox.handed += 1;
+        shard.cond.notify_all();
+        shard.wake();
+        inbox.handed
+    }
+
+    /// Wait a bit for the target thread to seize the process of the ticket.
+    ///
+    /// The caller should seize the processes handed over to itself between the waits,
+    /// as the target might be waiting for it at the same time.
+    pub fn wait_accepted(&self, target: usize, ticket: u64) -> bool {
+        let shard = &self.shards[target];
+        let inbox = shard.inbox.lock().unwrap();
+        if inbox.accepted >= ticket {
+            return true;
+        }
+        // The signal is lost if it arrives right before the target blocks in waitpid,
+        // so keep sending it.
+        shard.wake();
+        let (inbox, _) = shard
+            .cond
+            .wait_timeout(inbox, Duration::from_millis(1))
+            .unwrap();
+        inbox.accepted >= ticket
+    }
+
+    /// Take the processes handed over to this thread. Call [`Shards::accepted`] after seizing them.
+    pub fn take_handoffs(&self, shard: usize) -> Vec<ProcessState> {
+        std::mem::take(&mut self.shards[shard].inbox.lock().unwrap().states)
+    }
+
+    pub fn accepted(&self, shard: usize, count: usize) {
+        let shard = &self.shards[shard];
+        shard.inbox.lock().unwrap().accepted += count as u64;
+        shard.cond.notify_all();
+    }
+
+    /// Deliver a capture to its tracer thread, and wait until the thread has taken it
+    pub fn complete(&self, shard: usize, capture: ExecCapture) {
+        let shard = &self.shards[shard];
+        let mut inbox = shard.inbox.lock().unwrap();
+        inbox.captures.push(capture);
+        inbox.completed += 1;
+        let ticket = inbox.completed;
+        while inbox.taken < ticket {
+            // See wait_accepted
+            shard.wake();
+            inbox = shard
+                .cond
+                .wait_timeout(inbox, Duration::from_millis(1))
+                .unwrap()
+                .0;
+        }
+    }
+
+    pub fn take_captures(&self, shard: usize) -> Vec<ExecCapture> {
+        let shard = &self.shards[shard];
+        let mut inbox = shard.inbox.lock().unwrap();
+        let captures = std::mem::take(&mut inbox.captures);
+        inbox.taken += captures.len() as u64;
+        if !captures.is_empty() {
+            shard.cond.notify_all();
+        }
+        captures
+    }
+
+    /// Block until some process is handed over to this thread, or until the timeout.
+    /// Only call it when the thread has no tracees.
+    pub fn wait_for_handoff(&self, shard: usize, timeout: Option<Duration>) {
+        let shard = &self.shards[shard];
+        let mut inbox = shard.inbox.lock().unwrap();
+        inbox.idle = true;
+        while inbox.states.is_empty() && (inbox.stopped || !self.detach_requested()) {
+            match timeout {
+                Some(timeout) => {
+                    let (guard, result) = shard.cond.wait_timeout(inbox, timeout).unwrap();
+                    inbox = guard;
+                    if result.timed_out() {
+                        break;
+                    }
+                }
+                None => inbox = shard.cond.wait(inbox).unwrap(),
+            }
+        }
+        inbox.idle = false;
+    }
+
+    /// Whether all other threads have no tracees and nothing handed over to them
+    pub fn others_idle(&self, shard: usize) -> bool {
+        self.shards.iter().enumerate().all(|(i, x)| {
+            let inbox = x.inbox.lock().unwrap();
+            i == shard || (inbox.idle && inbox.states.is_empty())
+        })
+    }
+
+    /// Ask all threads to stop tracing.
+    ///
+    /// The wake signal is lost if it arrives right before a thread blocks in waitpid,
+    /// so the control thread keeps sending it with [`Shards::wake_until_detached`].
+    pub fn request_detach(&self) {
+        if self.detach.swap(true, Ordering::SeqCst) {
+            return;
+        }
+        install_wake_signal();
+        for shard in self.shards.iter() {
+            // Locked, so that a thread can't miss it between checking the flag and waiting
+            let _inbox = shard.inbox.lock().unwrap();
+            shard.cond.notify_all();
+            shard.wake();
+        }
+    }
+
+    pub fn detach_requested(&self) -> bool {
+        self.detach.load(Ordering::SeqCst)
+    }
+
+    /// Called by a thread once it has seen the detach request
+    pub fn acknowledge_detach(&self, shard: usize) {
+        let shard = &self.shards[shard];
+        shard.inbox.lock().unwrap().detach_seen = true;
+        shard.cond.notify_all();
+    }
+
+    /// Keep waking up the threads until all of them have seen the detach request
+    pub fn wake_until_detached(&self) {
+        for shard in self.shards.iter() {
+            let mut inbox = shard.inbox.lock().unwrap();
+            while !inbox.detach_seen && !inbox.stopped {
+                // See wait_accepted
+                shard.wake();
+                inbox = shard
+                    .cond
+                    .wait_timeout(inbox, Duration::from_millis(1))
+                    .unwrap()
+                    .0;
+            }
+        }
+    }
+
+    /// Count an exec event. Returns false if it should not be shown,
+    /// as it is beyond the limit or tracing is stopping.
+    pub fn count_exec(&self) -> bool {
+        if self.detach_requested() {
+            return false;
+        }
+        let Some(max) = self.max_execs else {
+            return true;
+        };
+        let count = self.execs.fetch_add(1, Ordering::Relaxed) + 1;
+        if count == max {
+            log::info!("Reached --max-events, stopping tracing");
+            self.request_detach();
+            // A tracer thread can't wait for the others to see it, as they might be
+            // waiting for it. Let the control thread keep waking them up.
+            unsafe { libc::kill(libc::getpid(), libc::SIGUSR1) };
+        }
+        count <= max
+    }
+
+    /// Called by a thread once it has stopped tracing and handed over its output
+    pub fn mark_stopped(&self, shard: usize) {
+        let shard = &self.shards[shard];
+        shard.inbox.lock().unwrap().stopped = true;
+        shard.cond.notify_all();
+    }
+
+    /// Whether all other threads have stopped tracing
+    pub fn others_stopped(&self, shard: usize) -> bool {
+        self.shards
+            .iter()
+            .enumerate()
+            .all(|(i, x)| i == shard || x.inbox.lock().unwrap().stopped)
+    }
+
+    pub fn record(&self, shard: usize, len: usize, latency: Duration) {
+        self.shards[shard]
+            .stats
+            .lock()
+            .unwrap()
+            .record(len, latency);
+    }
+
+    pub fn record_exec_stop(&self, shard: usize, stopped: Duration) {
+        self.shards[shard]
+            .stats
+            .lock()
+            .unwrap()
+            .record_exec_stop(stopped);
+    }
+
+    /// Log the event loop stats of all threads together
+    pub fn log_stats(&self) {
+        let mut total = LoopStats::default();
+        for shard in self.shards.iter() {
+            total.merge(&shard.stats.lock().unwrap());
+        }
+        total.log(self.shards.len());
+    }
+}
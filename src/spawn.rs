@@ -0,0 +1,93 @@
+use std::ffi::CString;
+
+use nix::{
+    errno::Errno,
+    libc,
+    unistd::{execvp, getpid, setpgid, ForkResult, Pid},
+};
+
+/// The write end of a pipe that the spawned child waits on.
+/// Opening it lets the child exec. Dropping it without opening makes the child exit,
+/// so that it never runs untraced when setting up tracing fails.
+pub struct Gate(libc::c_int);
+
+impl Gate {
+    /// Let the child exec
+    pub fn open(self) -> Result<(), Errno> {
+        if 1 != unsafe { libc::write(self.0, [0u8].as_ptr().cast(), 1) } {
+            return Err(Errno::last());
+        }
+        Ok(())
+    }
+}
+
+impl Drop for Gate {
+    fn drop(&mut self) {
+        unsafe { libc::close(self.0) };
+    }
+}
+
+/// Fork a child in a new process group that execs `args` once the returned gate is opened.
+///
+/// This gives the backends a chance to set up tracing before the child execs.
+/// `before_exec` runs in the child after the gate is opened. It must be async-signal-safe,
+/// as tracexec might be multi-threaded.
+pub fn spawn_gated(
+    args: Vec<String>,
+    before_exec: impl FnOnce() -> Result<(), Errno>,
+) -> color_eyre::Result<(Pid, Gate)> {
+    let args = args
+        .into_iter()
+        .map(CString::new)
+        .collect::<Result<Vec<CString>, _>>()?;
+    let mut fds = [0; 2];
+    if -1 == unsafe { libc::pipe2(fds.as_mut_ptr(), libc::O_CLOEXEC) } {
+        return Err(Errno::last().into());
+    }
+    let [read_end, write_end] = fds;
+    match unsafe { nix::unistd::fork()? } {
+        ForkResult::Parent { child } => {
+            unsafe { libc::close(read_end) };
+            // Also done by the child. Whoever comes first wins the race with tcsetpgrp.
+            setpgid(child, child)?;
+            Ok((child, Gate(write_end)))
+        }
+        ForkResult::Child => {
+            unsafe { libc::close(write_end) };
+            let me = getpid();
+            if setpgid(me, me).is_err() {
+                child_fail(b"tracexec: failed to create the process group\n");
+            }
+            let mut byte = 0u8;
+            let read = loop {
+                match unsafe { libc::read(read_end, (&mut byte as *mut u8).cast(), 1) } {
+                    -1 if Errno::last() == Errno::EINTR => continue,
+                    read => break read,
+                }
+            };
+            if read != 1 {
+                // tracexec is gone, or failed to set up tracing
+                unsafe { libc::_exit(-1) };
+            }
+            unsafe { libc::close(read_end) };
+            if before_exec().is_err() {
+                child_fail(b"tracexec: failed to set up the command\n");
+            }
+            let _ = execvp(&args[0], &args);
+            child_fail(b"tracexec: failed to execute the command\n")
+        }
+    }
+}
+
+/// Report a failure in the forked child and exit.
+/// Only async-signal-safe calls are allowed between fork and exec.
+pub fn child_fail(message: &[u8]) -> ! {
+    unsafe {
+        libc::write(
+            libc::STDERR_FILENO,
+            message.as_ptr() as *const libc::c_void,
+            message.len(),
+        );
+        libc::_exit(1)
+    }
+}
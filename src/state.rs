@@ -1,11 +1,53 @@
-use std::{collections::HashMap, ffi::CString, path::PathBuf};
+use std::{
+    collections::{HashMap, VecDeque},
+    fs::{File, OpenOptions},
+    io::Write,
+    path::Path,
+    sync::Arc,
+};
 
 use nix::unistd::Pid;
 
-use crate::proc::{read_argv, read_comm, Interpreter};
+use crate::{
+    capture::RawExec,
+    cli::TracingArgs,
+    envdiff::EnvSnapshot,
+    proc::{read_comm, Interpreter, ProcDir},
+};
 
+/// Processes known to the tracer.
+///
+/// States live in a slab and are referred to by generational handles, so that
+/// a handle never refers to a new process that reused the slot.
+/// Exited processes are reclaimed once all their children are gone.
 pub struct ProcessStateStore {
-    processes: HashMap<Pid, Vec<ProcessState>>,
+    slots: Vec<Slot>,
+    free: Vec<usize>,
+    /// pid -> current process with that pid
+    index: HashMap<Pid, ProcessHandle>,
+    /// Number of exited processes kept for their live children
+    retained: usize,
+    /// The retained processes, oldest first. Only tracked with a budget.
+    /// Might contain stale handles of the reclaimed ones.
+    retained_queue: VecDeque<ProcessHandle>,
+    /// Max number of retained exited processes
+    budget: Option<usize>,
+    /// Where the processes evicted because of the budget go
+    spill: Option<File>,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ProcessHandle {
+    idx: usize,
+    generation: u32,
+}
+
+#[derive(Default)]
+struct Slot {
+    generation: u32,
+    state: Option<ProcessState>,
+    parent: Option<ProcessHandle>,
+    live_children: usize,
 }
 
 #[derive(Debug)]
@@ -14,49 +56,268 @@ pub struct ProcessState {
     pub ppid: Option<Pid>,
     pub status: ProcessStatus,
     pub start_time: u64,
-    pub argv: Vec<CString>,
-    pub comm: String,
+    pub comm: Arc<str>,
     pub presyscall: bool,
     pub is_exec_successful: bool,
     pub syscall: i64,
-    pub exec_data: Option<ExecData>,
+    /// The exec in progress, decoded at its syscall-exit stop
+    pub raw_exec: Option<RawExec>,
+    /// Environment of the last successful exec, inherited at fork.
+    /// None means the environment of tracexec.
+    /// Only tracked when diffing the environment against the last exec.
+    pub env: Option<Arc<EnvSnapshot>>,
+    /// Closed when the process exits
+    pub proc_dir: Option<ProcDir>,
+    /// Number of processes between it and a root process
+    pub depth: u32,
+    /// Still attached, but its subtree is no longer traced. See [`crate::prune`].
+    pub pruned: bool,
 }
 
 #[derive(Debug, Clone, PartialEq)]
 pub enum ProcessStatus {
-    SigstopReceived,
+    /// A new child reported its initial PTRACE_EVENT_STOP before its parent reported the fork event
+    InitialStopReceived,
     PtraceForkEventReceived,
+    /// Seized by another tracer thread. The stop of its PTRACE_INTERRUPT is pending.
+    HandedOver,
     Running,
-    Exited(i32),
+    /// With the exit code, if the backend knows it
+    Exited(Option<i32>),
 }
 
 #[derive(Debug)]
 pub struct ExecData {
-    pub filename: PathBuf,
-    pub argv: Vec<String>,
-    pub envp: Vec<String>,
-    pub cwd: PathBuf,
+    pub filename: Arc<Path>,
+    pub argv: Vec<Arc<str>>,
+    pub envp: Vec<Arc<str>>,
+    pub cwd: Arc<Path>,
     pub interpreters: Vec<Interpreter>,
 }
 
 impl ProcessStateStore {
     pub fn new() -> Self {
         Self {
-            processes: HashMap::new(),
+            slots: Vec::new(),
+            free: Vec::new(),
+            index: HashMap::new(),
+            retained: 0,
+            retained_queue: VecDeque::new(),
+            budget: None,
+            spill: None,
+        }
+    }
+
+    pub fn from_cli(tracing_args: &TracingArgs) -> color_eyre::Result<Self> {
+        let mut store = Self::new();
+        store.budget = tracing_args.state_budget;
+        if let Some(path) = tracing_args.state_spill_file.as_ref() {
+            store.spill = Some(OpenOptions::new().create(true).append(true).open(path)?);
+        }
+        Ok(store)
+    }
+
+    /// Insert the state as the current process of its pid.
+    /// It becomes a child of the current process of its ppid.
+    pub fn insert(&mut self, state: ProcessState) -> ProcessHandle {
+        let pid = state.pid;
+        let ppid = state.ppid;
+        let idx = self.free.pop().unwrap_or_else(|| {
+            self.slots.push(Slot::default());
+            self.slots.len() - 1
+        });
+        let slot = &mut self.slots[idx];
+        slot.state = Some(state);
+        let handle = ProcessHandle {
+            idx,
+            generation: slot.generation,
+        };
+        // The previous process with this pid is gone. It is either reclaimed
+        // already or kept for its children, which refer to it by handle.
+        self.index.insert(pid, handle);
+        if let Some(ppid) = ppid {
+            self.link_parent(handle, ppid);
         }
+        handle
     }
 
-    pub fn insert(&mut self, state: ProcessState) {
-        self.processes
-            .entry(state.pid)
-            .or_insert_with(Vec::new)
-            .push(state);
+    /// Handle of the current process of the pid
+    pub fn handle(&self, pid: Pid) -> Option<ProcessHandle> {
+        self.index.get(&pid).copied()
     }
 
     pub fn get_current_mut(&mut self, pid: Pid) -> Option<&mut ProcessState> {
-        // The last process in the vector is the current process
-        // println!("Getting {pid}");
-        self.processes.get_mut(&pid)?.last_mut()
+        let handle = *self.index.get(&pid)?;
+        self.get_mut(handle)
+    }
+
+    pub fn get_mut(&mut self, handle: ProcessHandle) -> Option<&mut ProcessState> {
+        let slot = self.slots.get_mut(handle.idx)?;
+        if slot.generation != handle.generation {
+            return None;
+        }
+        slot.state.as_mut()
+    }
+
+    /// Set the parent of a process whose fork event arrived after the process itself
+    pub fn set_parent(&mut self, pid: Pid, ppid: Pid) {
+        let Some(&handle) = self.index.get(&pid) else {
+            return;
+        };
+        let Some(state) = self.get_mut(handle) else {
+            return;
+        };
+        if state.ppid.replace(ppid) != Some(ppid) {
+            self.link_parent(handle, ppid);
+        }
+    }
+
+    fn link_parent(&mut self, child: ProcessHandle, ppid: Pid) {
+        let Some(&parent) = self.index.get(&ppid) else {
+            return;
+        };
+        self.unlink_parent(child);
+        self.slots[parent.idx].live_children += 1;
+        self.slots[child.idx].parent = Some(parent);
+    }
+
+    /// Returns the parent if it should be reclaimed now
+    fn unlink_parent(&mut self, child: ProcessHandle) -> Option<ProcessHandle> {
+        let parent = self.slots[child.idx].parent.take()?;
+        let slot = &mut self.slots[parent.idx];
+        if slot.generation != parent.generation {
+            // The parent was evicted
+            return None;
+        }
+        slot.live_children -= 1;
+        match slot.state {
+            Some(ref state) if slot.live_children == 0 && state.is_exited() => Some(parent),
+            _ => None,
+        }
+    }
+
+    /// Mark the current process of the pid as exited, and reclaim it
+    /// once it has no live children.
+    pub fn mark_exited(&mut self, pid: Pid, code: Option<i32>) {
+        let Some(&handle) = self.index.get(&pid) else {
+            return;
+        };
+        let slot = &mut self.slots[handle.idx];
+        let Some(state) = slot.state.as_mut() else {
+            return;
+        };
+        if state.is_exited() {
+            return;
+        }
+        state.status = ProcessStatus::Exited(code);
+        // The process might be killed in the middle of an exec
+        state.raw_exec = None;
+        state.proc_dir = None;
+        if slot.live_children == 0 {
+            self.reclaim(handle);
+        } else {
+            self.retained += 1;
+            if self.budget.is_some() {
+                self.retained_queue.push_back(handle);
+                self.enforce_budget();
+            }
+        }
+    }
+
+    /// Remove the current process of the pid, which is traced by someone else from now on
+    pub fn remove(&mut self, pid: Pid) -> Option<ProcessState> {
+        let handle = *self.index.get(&pid)?;
+        if let Some(parent) = self.unlink_parent(handle) {
+            self.retained -= 1;
+            self.reclaim(parent);
+        }
+        self.free_slot(handle)
+    }
+
+    /// Approximate number of live processes.
+    /// Retained processes whose pid is reused are counted out twice.
+    pub fn live(&self) -> usize {
+        self.index.len().saturating_sub(self.retained)
+    }
+
+    /// The pids of the live processes
+    pub fn live_pids(&self) -> Vec<Pid> {
+        self.index
+            .iter()
+            .filter(|(_, handle)| {
+                self.slots[handle.idx]
+                    .state
+                    .as_ref()
+                    .is_some_and(|x| !x.is_exited())
+            })
+            .map(|(&pid, _)| pid)
+            .collect()
+    }
+
+    /// Free the process, and its exited ancestors that have no other children
+    fn reclaim(&mut self, handle: ProcessHandle) {
+        let mut next = self.unlink_parent(handle);
+        self.free_slot(handle);
+        while let Some(handle) = next {
+            // The ancestors were retained for their children
+            self.retained -= 1;
+            next = self.unlink_parent(handle);
+            self.free_slot(handle);
+        }
+    }
+
+    fn free_slot(&mut self, handle: ProcessHandle) -> Option<ProcessState> {
+        let slot = &mut self.slots[handle.idx];
+        let state = slot.state.take()?;
+        slot.generation = slot.generation.wrapping_add(1);
+        slot.live_children = 0;
+        slot.parent = None;
+        self.free.push(handle.idx);
+        if self.index.get(&state.pid) == Some(&handle) {
+            self.index.remove(&state.pid);
+        }
+        Some(state)
+    }
+
+    /// Evict the oldest retained processes when there are too many of them
+    fn enforce_budget(&mut self) {
+        let Some(budget) = self.budget else {
+            return;
+        };
+        while self.retained > budget {
+            let handle = self.retained_queue.pop_front().unwrap();
+            if self.slots[handle.idx].generation != handle.generation {
+                continue;
+            }
+            self.retained -= 1;
+            let next = self.unlink_parent(handle);
+            let state = self.free_slot(handle).unwrap();
+            self.spill(&state);
+            if let Some(parent) = next {
+                self.retained -= 1;
+                self.reclaim(parent);
+            }
+        }
+        if self.retained_queue.len() > 2 * self.retained + 64 {
+            let slots = &self.slots;
+            self.retained_queue
+                .retain(|x| slots[x.idx].generation == x.generation);
+        }
+    }
+
+    fn spill(&mut self, state: &ProcessState) {
+        let Some(file) = self.spill.as_mut() else {
+            return;
+        };
+        let ppid = state.ppid.map_or(-1, |x| x.as_raw());
+        let line = format!(
+            "{} {} {:?} {:?}\n",
+            state.pid, ppid, state.comm, state.status
+        );
+        if let Err(e) = file.write_all(line.as_bytes()) {
+            log::warn!("Failed to spill process state: {e}");
+            self.spill = None;
+        }
     }
 }
 
@@ -67,12 +328,55 @@ impl ProcessState {
             ppid: None,
             status: ProcessStatus::Running,
             comm: read_comm(pid)?,
-            argv: read_argv(pid)?,
             start_time,
             presyscall: true,
             is_exec_successful: false,
             syscall: -1,
-            exec_data: None,
+            raw_exec: None,
+            env: None,
+            proc_dir: None,
+            depth: 0,
+            pruned: false,
         })
     }
+
+    /// Create a state without reading anything from /proc.
+    ///
+    /// This is used for children that inherit the comm of their parent,
+    /// and by backends that observe processes when they might be already gone.
+    pub fn with_comm(pid: Pid, comm: Arc<str>) -> Self {
+        Self {
+            pid,
+            ppid: None,
+            status: ProcessStatus::Running,
+            comm,
+            start_time: 0,
+            presyscall: true,
+            is_exec_successful: false,
+            syscall: -1,
+            raw_exec: None,
+            env: None,
+            proc_dir: None,
+            depth: 0,
+            pruned: false,
+        }
+    }
+
+    /// The /proc directory of the process, opened on first use
+    pub fn proc_dir(&mut self) -> std::io::Result<&ProcDir> {
+        if self.proc_dir.is_none() {
+            self.proc_dir = Some(ProcDir::open(self.pid)?);
+        }
+        Ok(self.proc_dir.as_ref().unwrap())
+    }
+
+    pub fn is_exited(&self) -> bool {
+        matches!(self.status, ProcessStatus::Exited(_))
+    }
+
+    /// Record the environment of a successful exec and return the previous one
+    pub fn replace_env(&mut self, envp: &[Arc<str>]) -> Option<Arc<EnvSnapshot>> {
+        let env = EnvSnapshot::share(self.env.as_ref(), envp);
+        self.env.replace(env)
+    }
 }
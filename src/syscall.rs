@@ -0,0 +1,145 @@
+//! Arch-neutral access to the syscall number, arguments and return value of a stopped tracee.
+//!
+//! PTRACE_GET_SYSCALL_INFO(Linux 5.3+) is used when available, which only copies
+//! the few fields we need. On older kernels, we fall back to dumping the registers.
+
+use std::sync::atomic::{AtomicBool, Ordering};
+
+use cfg_if::cfg_if;
+use nix::{errno::Errno, libc, unistd::Pid};
+
+use crate::arch::{
+    syscall_arg, syscall_no_from_regs, syscall_res_from_regs, PtraceRegisters, AUDIT_ARCH,
+};
+
+const PTRACE_GET_SYSCALL_INFO: libc::c_uint = 0x420e;
+
+const PTRACE_SYSCALL_INFO_ENTRY: u8 = 1;
+const PTRACE_SYSCALL_INFO_EXIT: u8 = 2;
+const PTRACE_SYSCALL_INFO_SECCOMP: u8 = 3;
+
+/// struct ptrace_syscall_info from linux/ptrace.h
+///
+/// The union is flattened into `data`:
+/// - entry/seccomp: `data[0]` is nr, `data[1..7]` are args
+/// - exit: `data[0]` is rval, low byte of `data[1]` is is_error
+#[repr(C)]
+#[derive(Debug, Default)]
+struct RawSyscallInfo {
+    op: u8,
+    pad: [u8; 3],
+    arch: u32,
+    instruction_pointer: u64,
+    stack_pointer: u64,
+    data: [u64; 8],
+}
+
+static SYSCALL_INFO_SUPPORTED: AtomicBool = AtomicBool::new(true);
+
+#[derive(Debug, Clone, Copy)]
+pub struct SyscallEntry {
+    /// Syscall number. -1 if the syscall is from a foreign ABI.
+    pub no: i64,
+    pub args: [u64; 6],
+}
+
+fn ptrace_get_syscall_info(pid: Pid) -> Result<Option<RawSyscallInfo>, Errno> {
+    if !SYSCALL_INFO_SUPPORTED.load(Ordering::Relaxed) {
+        return Ok(None);
+    }
+    let mut info = RawSyscallInfo::default();
+    let ret = unsafe {
+        libc::ptrace(
+            PTRACE_GET_SYSCALL_INFO,
+            pid.as_raw(),
+            std::mem::size_of::<RawSyscallInfo>(),
+            &mut info as *mut RawSyscallInfo,
+        )
+    };
+    if ret == -1 {
+        match Errno::last() {
+            Errno::EIO => {
+                log::debug!("PTRACE_GET_SYSCALL_INFO is not supported, falling back to registers");
+                SYSCALL_INFO_SUPPORTED.store(false, Ordering::Relaxed);
+                return Ok(None);
+            }
+            e => return Err(e),
+        }
+    }
+    Ok(Some(info))
+}
+
+pub fn get_syscall_entry(pid: Pid) -> Result<SyscallEntry, Errno> {
+    if let Some(info) = ptrace_get_syscall_info(pid)? {
+        if info.op == PTRACE_SYSCALL_INFO_ENTRY || info.op == PTRACE_SYSCALL_INFO_SECCOMP {
+            let mut args = [0; 6];
+            args.copy_from_slice(&info.data[1..7]);
+            return Ok(SyscallEntry {
+                no: if info.arch == AUDIT_ARCH {
+                    info.data[0] as i64
+                } else {
+                    -1
+                },
+                args,
+            });
+        }
+        log::debug!("unexpected syscall info op {} at entry: {pid}", info.op);
+    }
+    let regs = ptrace_getregs(pid)?;
+    Ok(SyscallEntry {
+        no: syscall_no_from_regs!(regs),
+        args: [
+            syscall_arg!(regs, 0) as u64,
+            syscall_arg!(regs, 1) as u64,
+            syscall_arg!(regs, 2) as u64,
+            syscall_arg!(regs, 3) as u64,
+            syscall_arg!(regs, 4) as u64,
+            syscall_arg!(regs, 5) as u64,
+        ],
+    })
+}
+
+/// Get the return value at syscall-exit stop
+pub fn get_syscall_result(pid: Pid) -> Result<i64, Errno> {
+    if let Some(info) = ptrace_get_syscall_info(pid)? {
+        if info.op == PTRACE_SYSCALL_INFO_EXIT {
+            return Ok(info.data[0] as i64);
+        }
+        log::debug!("unexpected syscall info op {} at exit: {pid}", info.op);
+    }
+    let regs = ptrace_getregs(pid)?;
+    Ok(syscall_res_from_regs!(regs))
+}
+
+fn ptrace_getregs(pid: Pid) -> Result<PtraceRegisters, Errno> {
+    // Don't use GETREGSET on x86_64.
+    // In some cases(it usually happens several times at and after exec syscall exit),
+    // we only got 68/216 bytes into `regs`, which seems unreasonable. Not sure why.
+    cfg_if! {
+        if #[cfg(target_arch = "x86_64")] {
+            nix::sys::ptrace::getregs(pid)
+        } else {
+            let mut regs = std::mem::MaybeUninit::<PtraceRegisters>::uninit();
+            let iovec = nix::libc::iovec {
+                iov_base: regs.as_mut_ptr() as nix::sys::ptrace::AddressType,
+                iov_len: std::mem::size_of::<PtraceRegisters>(),
+            };
+            let ptrace_result = unsafe {
+                nix::libc::ptrace(
+                    nix::libc::PTRACE_GETREGSET,
+                    pid.as_raw(),
+                    nix::libc::NT_PRSTATUS,
+                    &iovec as *const _ as *const nix::libc::c_void,
+                )
+            };
+            let regs = if -1 == ptrace_result {
+                let errno = nix::errno::Errno::last();
+                return Err(errno);
+            } else {
+                assert_eq!(iovec.iov_len, std::mem::size_of::<PtraceRegisters>());
+                unsafe { regs.assume_init() }
+            };
+            Ok(regs)
+        }
+    }
+}
@@ -1,33 +1,177 @@
-use std::{collections::HashMap, ffi::CString, io::Write, path::PathBuf, process::exit};
+use std::{
+    collections::{HashMap, HashSet},
+    io::Write,
+    process::exit,
+    sync::Arc,
+    time::{Duration, Instant},
+};
 
-use cfg_if::cfg_if;
+use color_eyre::eyre::bail;
 use nix::{
     errno::Errno,
-    libc::{pid_t, raise, tcsetpgrp, SYS_clone, SYS_clone3, AT_EMPTY_PATH, SIGSTOP, STDIN_FILENO},
+    libc::{self, pid_t, tcsetpgrp, SYS_clone, SYS_clone3, STDIN_FILENO},
     sys::{
-        ptrace::{self, traceme, AddressType},
+        ptrace::{self, Options},
         signal::Signal,
         wait::{waitpid, WaitPidFlag, WaitStatus},
     },
-    unistd::{execvp, getpid, setpgid, ForkResult, Pid},
+    unistd::{getpid, Pid},
 };
 
 use crate::{
-    arch::{syscall_arg, syscall_no_from_regs, syscall_res_from_regs, PtraceRegisters},
-    cli::TracingArgs,
-    inspect::{read_pathbuf, read_string, read_string_array},
-    printer::{print_exec_trace, print_new_child, ColorLevel, EnvPrintFormat, PrinterArgs},
-    proc::{read_comm, read_cwd, read_fd, read_interpreter_recursive},
-    state::{ExecData, ProcessState, ProcessStateStore, ProcessStatus},
+    attach::{read_tracer, scan, AttachTarget},
+    capture::{CapturePool, ExecRequest, RawExec},
+    cli::{SeccompBpf, TracingArgs},
+    control::{block_detach_signal, spawn_control_thread, unblock_detach_signal},
+    inspect::{PtraceMemory, StringArena},
+    intern::intern_str,
+    pipeline::{ExecEvent, Pipeline, TracerEvent},
+    printer::PrinterArgs,
+    proc::{comm_from_filename, count_avoided_reads, raise_fd_limit},
+    prune::PruneRules,
+    seccomp::{
+        is_seccomp_trace_supported, load_seccomp_filters, needs_no_new_privs,
+        no_new_privs_restricts_tracees,
+    },
+    shard::Shards,
+    spawn::spawn_gated,
+    state::{ProcessState, ProcessStateStore, ProcessStatus},
+    syscall::{get_syscall_entry, get_syscall_result},
 };
 
 pub struct Tracer {
     pub store: ProcessStateStore,
     args: PrinterArgs,
-    env: HashMap<String, String>,
-    cwd: std::path::PathBuf,
     print_children: bool,
-    output: Box<dyn Write>,
+    seccomp_bpf: bool,
+    pipeline: Pipeline,
+    prune: PruneRules,
+    /// Arenas for the strings of the execs, reused once decoded
+    spare_arenas: Vec<StringArena>,
+    shards: Arc<Shards>,
+    /// Index of this tracer thread
+    shard: usize,
+    /// The other tracer threads, before they are started
+    workers: Vec<Tracer>,
+    /// New children to hand over to other threads once their initial stop arrives -> target thread.
+    /// Their parents are held until then.
+    pending_handoffs: HashMap<Pid, usize>,
+    /// Order of the tracees in the current batch -> (most expensive event, first event)
+    batch_order: HashMap<Pid, (EventCost, usize)>,
+    capture_threads: usize,
+    /// Reads execs in other threads, if enabled
+    capture_pool: Option<CapturePool>,
+    /// When the stops of the current batch were collected
+    batch_started: Instant,
+    /// Kill the tracees when tracexec exits. Not done for the processes it attached to.
+    exit_kill: bool,
+    /// Exit once no thread has tracees. Used when there is no root child.
+    exit_when_idle: bool,
+    max_duration: Option<Duration>,
+    /// Tracing was stopped, but the tracees need a tracer for their seccomp-bpf filters.
+    /// Their execs are let through without reading them.
+    passthrough: bool,
+    /// Detaching from the tracees. Handed over processes are released instead of seized.
+    detaching: bool,
+    output_finished: bool,
+}
+
+/// Upper bound of the events handled in one batch, so that a busy tree can't starve
+/// the tracees that became ready after the batch was collected.
+const MAX_WAIT_BATCH: usize = 256;
+
+/// Upper bound of the kept arenas. One is in use per tracee between exec entry and exit.
+const MAX_SPARE_ARENAS: usize = 64;
+
+/// Order of the events in a batch
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+enum EventCost {
+    /// Events that are handled by restarting the tracee right away
+    Cheap,
+    /// Exec syscall stops, which read the memory of the tracee
+    Expensive,
+    /// Termination of the root child, which ends the tracer
+    Last,
+}
+
+/// Where the events of a tracee go in a batch
+fn event_cost(status: &WaitStatus, root_child: Option<Pid>) -> EventCost {
+    match status {
+        WaitStatus::Exited(pid, _) | WaitStatus::Signaled(pid, _, _)
+            if Some(*pid) == root_child =>
+        {
+            EventCost::Last
+        }
+        WaitStatus::PtraceSyscall(_)
+        | WaitStatus::PtraceEvent(_, _, nix::libc::PTRACE_EVENT_SECCOMP) => EventCost::Expensive,
+        _ => EventCost::Cheap,
+    }
+}
+
+#[derive(Debug, Default)]
+pub struct LoopStats {
+    batches: u64,
+    events: u64,
+    max_batch: usize,
+    /// Time spent handling the batches
+    busy: Duration,
+    /// Longest time from collecting a batch to having handled all of it
+    max_latency: Duration,
+    exec_stops: u64,
+    /// Time the tracees spent stopped at exec entries, from collecting the stop to resuming them
+    exec_stopped: Duration,
+    max_exec_stopped: Duration,
+}
+
+impl LoopStats {
+    pub fn record(&mut self, len: usize, latency: Duration) {
+        self.batches += 1;
+        self.events += len as u64;
+        self.max_batch = self.max_batch.max(len);
+        self.busy += latency;
+        self.max_latency = self.max_latency.max(latency);
+    }
+
+    pub fn record_exec_stop(&mut self, stopped: Duration) {
+        self.exec_stops += 1;
+        self.exec_stopped += stopped;
+        self.max_exec_stopped = self.max_exec_stopped.max(stopped);
+    }
+
+    pub fn merge(&mut self, other: &Self) {
+        self.batches += other.batches;
+        self.events += other.events;
+        self.max_batch = self.max_batch.max(other.max_batch);
+        self.busy += other.busy;
+        self.max_latency = self.max_latency.max(other.max_latency);
+        self.exec_stops += other.exec_stops;
+        self.exec_stopped += other.exec_stopped;
+        self.max_exec_stopped = self.max_exec_stopped.max(other.max_exec_stopped);
+    }
+
+    pub fn log(&self, threads: usize) {
+        if self.batches == 0 {
+            return;
+        }
+        log::info!(
+            "event loop: {} events in {} batches (avg {:.1}, max {}), avg latency {:?}, max latency {:?}, {} tracer threads",
+            self.events,
+            self.batches,
+            self.events as f64 / self.batches as f64,
+            self.max_batch,
+            self.busy / self.batches as u32,
+            self.max_latency,
+            threads
+        );
+        if self.exec_stops != 0 {
+            log::info!(
+                "exec entry stops: {}, avg stopped {:?}, max stopped {:?}",
+                self.exec_stops,
+                self.exec_stopped / self.exec_stops as u32,
+                self.max_exec_stopped
+            );
+        }
+    }
 }
 
 fn ptrace_syscall_with_signal(pid: Pid, sig: Signal) -> Result<(), Errno> {
@@ -50,394 +194,1059 @@ fn ptrace_syscall(pid: Pid) -> Result<(), Errno> {
     }
 }
 
-fn ptrace_getregs(pid: Pid) -> Result<PtraceRegisters, Errno> {
-    // Don't use GETREGSET on x86_64.
-    // In some cases(it usually happens several times at and after exec syscall exit),
-    // we only got 68/216 bytes into `regs`, which seems unreasonable. Not sure why.
-    cfg_if! {
-        if #[cfg(target_arch = "x86_64")] {
-            ptrace::getregs(pid)
-        } else {
-            let mut regs = std::mem::MaybeUninit::<PtraceRegisters>::uninit();
-            let iovec = nix::libc::iovec {
-                iov_base: regs.as_mut_ptr() as AddressType,
-                iov_len: std::mem::size_of::<PtraceRegisters>(),
-            };
-            let ptrace_result = unsafe {
-                nix::libc::ptrace(
-                    nix::libc::PTRACE_GETREGSET,
-                    pid.as_raw(),
-                    nix::libc::NT_PRSTATUS,
-                    &iovec as *const _ as *const nix::libc::c_void,
-                )
-            };
-            let regs = if -1 == ptrace_result {
-                let errno = nix::errno::Errno::last();
-                return Err(errno);
-            } else {
-                assert_eq!(iovec.iov_len, std::mem::size_of::<PtraceRegisters>());
-                unsafe { regs.assume_init() }
-            };
-            Ok(regs)
+fn ptrace_cont_with_signal(pid: Pid, sig: Signal) -> Result<(), Errno> {
+    match ptrace::cont(pid, Some(sig)) {
+        Err(Errno::ESRCH) => {
+            log::info!("ptrace cont failed: {pid}, ESRCH, child probably gone!");
+            Ok(())
         }
+        other => other,
+    }
+}
+
+/// Keep a tracee in its group-stop, but get notified when it is continued.
+/// Only works for tracees attached with PTRACE_SEIZE.
+fn ptrace_listen(pid: Pid) -> Result<(), Errno> {
+    // Not wrapped by nix
+    let result = Errno::result(unsafe {
+        libc::ptrace(
+            libc::PTRACE_LISTEN,
+            pid.as_raw(),
+            std::ptr::null_mut::<libc::c_void>(),
+            std::ptr::null_mut::<libc::c_void>(),
+        )
+    });
+    match result {
+        Err(Errno::ESRCH) => {
+            log::info!("ptrace listen failed: {pid}, ESRCH, child probably gone!");
+            Ok(())
+        }
+        other => other.map(drop),
+    }
+}
+
+fn is_stop_signal(sig: Signal) -> bool {
+    matches!(
+        sig,
+        Signal::SIGSTOP | Signal::SIGTSTP | Signal::SIGTTIN | Signal::SIGTTOU
+    )
+}
+
+fn ptrace_cont(pid: Pid) -> Result<(), Errno> {
+    match ptrace::cont(pid, None) {
+        Err(Errno::ESRCH) => {
+            log::info!("ptrace cont failed: {pid}, ESRCH, child probably gone!");
+            Ok(())
+        }
+        other => other,
     }
 }
 
 impl Tracer {
-    pub fn new(tracing_args: TracingArgs, output: Box<dyn Write>) -> color_eyre::Result<Self> {
+    pub fn new(
+        tracing_args: TracingArgs,
+        output: Box<dyn Write + Send>,
+    ) -> color_eyre::Result<Self> {
+        // Before any thread is spawned, so that only the control thread receives it
+        block_detach_signal();
+        if tracing_args.tracer_threads > 1 && !tracing_args.hand_over_children {
+            log::warn!("Without --hand-over-children, all tracees stay on the first tracer thread");
+        }
+        let shards = Arc::new(Shards::new(
+            tracing_args.tracer_threads,
+            tracing_args.max_events,
+            tracing_args.hand_over_children,
+        ));
+        let pipeline = Pipeline::new(&tracing_args, output)?;
+        let workers = (1..shards.len())
+            .map(|shard| Self::with_shard(&tracing_args, pipeline.sender(), shards.clone(), shard))
+            .collect::<color_eyre::Result<_>>()?;
+        let mut tracer = Self::with_shard(&tracing_args, pipeline, shards, 0)?;
+        tracer.workers = workers;
+        if tracing_args.seccomp_bpf != SeccompBpf::Off && no_new_privs_restricts_tracees() {
+            match tracing_args.seccomp_bpf {
+                SeccompBpf::On => log::warn!(
+                    "Loading the seccomp-bpf filter without CAP_SYS_ADMIN sets PR_SET_NO_NEW_PRIVS. setuid/setgid programs and file capabilities won't raise the privileges of the tracees"
+                ),
+                _ => log::warn!(
+                    "Not using seccomp-bpf: without CAP_SYS_ADMIN it would set PR_SET_NO_NEW_PRIVS, which keeps setuid/setgid programs from raising the privileges of the tracees. Use --seccomp-bpf=on to use it anyway"
+                ),
+            }
+        }
+        Ok(tracer)
+    }
+
+    fn with_shard(
+        tracing_args: &TracingArgs,
+        pipeline: Pipeline,
+        shards: Arc<Shards>,
+        shard: usize,
+    ) -> color_eyre::Result<Self> {
         Ok(Self {
-            store: ProcessStateStore::new(),
-            env: std::env::vars().collect(),
-            cwd: std::env::current_dir()?,
+            store: ProcessStateStore::from_cli(tracing_args)?,
+            pipeline,
             print_children: tracing_args.show_children,
-            args: PrinterArgs {
-                trace_comm: !tracing_args.no_show_comm,
-                trace_argv: !tracing_args.no_show_argv && !tracing_args.show_cmdline,
-                trace_env: match (
-                    tracing_args.show_cmdline,
-                    tracing_args.diff_env,
-                    tracing_args.no_diff_env,
-                    tracing_args.show_env,
-                ) {
-                    (true, ..) => EnvPrintFormat::None,
-                    (false, .., true) | (false, _, true, _) => EnvPrintFormat::Raw,
-                    _ => EnvPrintFormat::Diff, // diff_env is enabled by default
-                },
-                trace_cwd: tracing_args.show_cwd,
-                print_cmdline: tracing_args.show_cmdline,
-                successful_only: tracing_args.successful_only || tracing_args.show_cmdline,
-                trace_interpreter: tracing_args.show_interpreter,
-                trace_filename: match (
-                    tracing_args.show_filename,
-                    tracing_args.no_show_filename,
-                    tracing_args.show_cmdline,
-                ) {
-                    (true, _, _) => true,
-                    // show filename by default, but not in show-cmdline mode
-                    (false, _, true) => false,
-                    _ => true,
-                },
-                decode_errno: !tracing_args.no_decode_errno,
-                color: match (tracing_args.more_colors, tracing_args.less_colors) {
-                    (false, false) => ColorLevel::Normal,
-                    (true, false) => ColorLevel::More,
-                    (false, true) => ColorLevel::Less,
-                    _ => unreachable!(),
-                },
+            seccomp_bpf: match tracing_args.seccomp_bpf {
+                SeccompBpf::On => true,
+                SeccompBpf::Off => false,
+                SeccompBpf::Auto => {
+                    is_seccomp_trace_supported() && !no_new_privs_restricts_tracees()
+                }
             },
-            output,
+            args: PrinterArgs::from_cli(tracing_args),
+            prune: PruneRules::from_cli(tracing_args),
+            spare_arenas: Vec::new(),
+            shards,
+            shard,
+            workers: Vec::new(),
+            pending_handoffs: HashMap::new(),
+            batch_order: HashMap::new(),
+            capture_threads: tracing_args.capture_threads,
+            capture_pool: None,
+            batch_started: Instant::now(),
+            exit_kill: true,
+            exit_when_idle: false,
+            max_duration: tracing_args.max_duration.map(Duration::from_secs),
+            passthrough: false,
+            detaching: false,
+            output_finished: false,
         })
     }
 
+    fn ptrace_options(&self) -> Options {
+        Options::PTRACE_O_TRACEEXEC
+            | Options::PTRACE_O_TRACEEXIT
+            | Options::PTRACE_O_TRACESYSGOOD
+            | Options::PTRACE_O_TRACEFORK
+            | Options::PTRACE_O_TRACECLONE
+            | Options::PTRACE_O_TRACEVFORK
+            | if self.seccomp_bpf {
+                Options::PTRACE_O_TRACESECCOMP
+            } else {
+                Options::empty()
+            }
+            | if self.exit_kill {
+                Options::PTRACE_O_EXITKILL
+            } else {
+                Options::empty()
+            }
+    }
+
     pub fn start_root_process(&mut self, args: Vec<String>) -> color_eyre::Result<()> {
         log::trace!("start_root_process: {:?}", args);
-        if let ForkResult::Parent { child: root_child } = unsafe { nix::unistd::fork()? } {
-            waitpid(root_child, Some(WaitPidFlag::WSTOPPED))?; // wait for child to stop
-            log::trace!("child stopped");
-            let mut root_child_state = ProcessState::new(root_child, 0)?;
-            root_child_state.ppid = Some(getpid());
-            self.store.insert(root_child_state);
-            // Set foreground process group of the terminal
-            if -1 == unsafe { tcsetpgrp(STDIN_FILENO, root_child.as_raw()) } {
-                return Err(Errno::last().into());
-            }
-            // restart child
-            log::trace!("resuming child");
-            ptrace::setoptions(root_child, {
-                use nix::sys::ptrace::Options;
-                Options::PTRACE_O_TRACEEXEC
-                    | Options::PTRACE_O_TRACEEXIT
-                    | Options::PTRACE_O_EXITKILL
-                    | Options::PTRACE_O_TRACESYSGOOD
-                    | Options::PTRACE_O_TRACEFORK
-                    | Options::PTRACE_O_TRACECLONE
-                    | Options::PTRACE_O_TRACEVFORK
-            })?;
-            ptrace_syscall(root_child)?; // restart child
-            loop {
-                let status = waitpid(None, Some(WaitPidFlag::__WALL))?;
-                // log::trace!("waitpid: {:?}", status);
-                match status {
-                    WaitStatus::Stopped(pid, sig) => {
-                        log::trace!("stopped: {pid}, sig {:?}", sig);
-                        match sig {
-                            Signal::SIGSTOP => {
-                                log::trace!("sigstop event, child: {pid}");
-                                if let Some(state) = self.store.get_current_mut(pid) {
-                                    if state.status == ProcessStatus::PtraceForkEventReceived {
-                                        log::trace!("sigstop event received after ptrace fork event, pid: {pid}");
-                                        ptrace_syscall(pid)?;
-                                        state.status = ProcessStatus::Running;
-                                    } else if pid != root_child {
-                                        log::error!("Unexpected SIGSTOP: {state:?}")
-                                    }
-                                } else {
-                                    log::trace!("sigstop event received before ptrace fork event, pid: {pid}");
-                                    let mut state = ProcessState::new(pid, 0)?;
-                                    state.status = ProcessStatus::SigstopReceived;
-                                    self.store.insert(state);
-                                }
-                                // https://stackoverflow.com/questions/29997244/occasionally-missing-ptrace-event-vfork-when-running-ptrace
-                                // DO NOT send PTRACE_SYSCALL until we receive the PTRACE_EVENT_FORK, etc.
-                            }
-                            Signal::SIGCHLD => {
-                                // From lurk:
-                                //
-                                // The SIGCHLD signal is sent to a process when a child process terminates, interrupted, or resumes after being interrupted
-                                // This means, that if our tracee forked and said fork exits before the parent, the parent will get stopped.
-                                // Therefor issue a PTRACE_SYSCALL request to the parent to continue execution.
-                                // This is also important if we trace without the following forks option.
-                                ptrace_syscall_with_signal(pid, Signal::SIGCHLD)?;
-                            }
-                            _ => {
-                                // Just deliver the signal to tracee
-                                ptrace_syscall_with_signal(pid, sig)?;
-                            }
+        raise_fd_limit();
+        let seccomp_bpf = self.seccomp_bpf;
+        let no_new_privs = needs_no_new_privs();
+        // The child waits for the tracer to seize it before going on
+        let (root_child, gate) = spawn_gated(args, || {
+            unblock_detach_signal();
+            if seccomp_bpf {
+                load_seccomp_filters(no_new_privs)?;
+            }
+            Ok(())
+        })?;
+        ptrace::seize(root_child, self.ptrace_options())?;
+        // Stop it, so that it can be restarted with PTRACE_SYSCALL
+        ptrace::interrupt(root_child)?;
+        let status = waitpid(root_child, Some(WaitPidFlag::__WALL))?;
+        log::trace!("child stopped: {status:?}");
+        let mut root_child_state = ProcessState::new(root_child, 0)?;
+        root_child_state.ppid = Some(getpid());
+        self.store.insert(root_child_state);
+        // Set foreground process group of the terminal
+        if -1 == unsafe { tcsetpgrp(STDIN_FILENO, root_child.as_raw()) } {
+            return Err(Errno::last().into());
+        }
+        // restart child
+        log::trace!("resuming child");
+        self.seccomp_aware_cont(root_child)?; // restart child
+        gate.open()?;
+        // Started after the fork, which is simpler in a single-threaded process
+        self.start_threads()?;
+        self.run(Some(root_child))
+    }
+
+    fn start_threads(&mut self) -> color_eyre::Result<()> {
+        if self.capture_threads > 0 {
+            self.capture_pool = Some(CapturePool::new(
+                self.capture_threads,
+                &self.args,
+                self.shards.clone(),
+            )?);
+        }
+        spawn_control_thread(self.shards.clone(), self.max_duration)?;
+        for mut worker in self.workers.drain(..) {
+            worker.capture_pool = self.capture_pool.clone();
+            worker.seccomp_bpf = self.seccomp_bpf;
+            worker.exit_kill = self.exit_kill;
+            std::thread::Builder::new()
+                .name(format!("tracer-{}", worker.shard))
+                .spawn(move || worker.run_worker())?;
+        }
+        Ok(())
+    }
+
+    /// Attach to running processes and trace them and their descendants until they are all gone
+    pub fn attach(&mut self, target: AttachTarget) -> color_eyre::Result<()> {
+        log::trace!("attach: {:?}", target);
+        raise_fd_limit();
+        if self.seccomp_bpf {
+            log::info!(
+                "seccomp-bpf filters can't be loaded into running processes, not using them"
+            );
+            self.seccomp_bpf = false;
+        }
+        // Leave them running when tracexec is gone
+        self.exit_kill = false;
+        self.exit_when_idle = true;
+        let me = getpid();
+        let scan_threads = std::thread::available_parallelism().map_or(1, |x| x.get().min(8));
+        let mut traced = HashSet::new();
+        let mut seized = Vec::new();
+        let mut attached = 0;
+        loop {
+            let found = scan(&target, &traced, scan_threads)?;
+            if found.is_empty() {
+                break;
+            }
+            log::debug!("attach: found {} new threads", found.len());
+            for thread in found {
+                let tid = thread.tid;
+                traced.insert(tid);
+                if thread.tgid == me {
+                    continue;
+                }
+                match ptrace::seize(tid, self.ptrace_options()) {
+                    Ok(()) => seized.push(thread),
+                    Err(Errno::ESRCH) => {}
+                    // Attached automatically when its parent forked after being seized
+                    Err(Errno::EPERM) if read_tracer(tid) == Some(me) => {}
+                    Err(e) => log::warn!("Failed to attach to {tid}: {e}"),
+                }
+            }
+            attached += seized.len();
+            for thread in seized.iter() {
+                let tid = thread.tid;
+                let mut state = match ProcessState::new(tid, 0) {
+                    Ok(state) => state,
+                    // Gone. Its exit is reported later.
+                    Err(_) => ProcessState::with_comm(tid, intern_str("")),
+                };
+                if self.args.track_env() && tid == thread.tgid {
+                    match state.proc_dir().and_then(|x| x.read_environ()) {
+                        Ok(envp) => {
+                            state.replace_env(&envp);
                         }
+                        Err(e) => log::debug!("Failed to read the environment of {tid}: {e}"),
                     }
-                    WaitStatus::Exited(pid, code) => {
-                        log::trace!("exited: pid {}, code {:?}", pid, code);
-                        self.store.get_current_mut(pid).unwrap().status =
-                            ProcessStatus::Exited(code);
-                        if pid == root_child {
-                            exit(code)
-                        }
+                }
+                self.store.insert(state);
+            }
+            // Parents might be seized after their children
+            for thread in seized.iter() {
+                let ppid = match thread.tid == thread.tgid {
+                    true => thread.ppid,
+                    false => thread.tgid,
+                };
+                self.store.set_parent(thread.tid, ppid);
+            }
+            // Stop them, so that they can be restarted with PTRACE_SYSCALL
+            for thread in seized.drain(..) {
+                match ptrace::interrupt(thread.tid) {
+                    Ok(()) | Err(Errno::ESRCH) => {}
+                    Err(e) => return Err(e.into()),
+                }
+            }
+            // Serve the seized ones while scanning again
+            self.drain_events()?;
+        }
+        if attached == 0 {
+            bail!("No process to attach to");
+        }
+        log::debug!("attach: attached to {attached} threads");
+        self.start_threads()?;
+        self.run(None)
+    }
+
+    /// Handle the pending events without blocking
+    fn drain_events(&mut self) -> color_eyre::Result<()> {
+        let flags = WaitPidFlag::__WALL | WaitPidFlag::__WNOTHREAD | WaitPidFlag::WNOHANG;
+        loop {
+            match waitpid(None, Some(flags)) {
+                Ok(WaitStatus::StillAlive) | Err(Errno::ECHILD) => return Ok(()),
+                Ok(status) => self.on_wait_status(status, None)?,
+                Err(Errno::EINTR) => continue,
+                Err(e) => return Err(e.into()),
+            }
+        }
+    }
+
+    fn run_worker(mut self) {
+        if let Err(e) = self.run(None) {
+            // Nobody else can trace its tracees
+            log::error!("tracer thread {} failed: {e:?}", self.shard);
+            exit(1)
+        }
+    }
+
+    /// The event loop of a tracer thread. Only the thread of the root child ever returns,
+    /// by exiting the process when the root child terminates.
+    fn run(&mut self, root_child: Option<Pid>) -> color_eyre::Result<()> {
+        self.shards
+            .register(self.shard, unsafe { libc::pthread_self() });
+        let mut batch = Vec::new();
+        loop {
+            if self.shards.detach_requested() && !self.passthrough {
+                self.shards.acknowledge_detach(self.shard);
+                if !self.seccomp_bpf {
+                    return self.detach_all();
+                }
+                self.start_passthrough()?;
+            }
+            if self.passthrough && !self.output_finished && self.shards.others_stopped(self.shard) {
+                self.finish_output()?;
+            }
+            self.accept_handoffs()?;
+            self.accept_captures()?;
+            self.pipeline.flush_coalesced()?;
+            self.wait_batch(&mut batch)?;
+            if batch.is_empty() {
+                continue;
+            }
+            self.batch_started = Instant::now();
+            // Restart the tracees that only need a cheap decision first,
+            // so that they don't wait for the exec decoding of the others.
+            // The events of a tracee move together and keep their order,
+            // as a tracee can be killed while it waits in a stop of the same batch.
+            self.batch_order.clear();
+            for (idx, status) in batch.iter().enumerate() {
+                let Some(pid) = status.pid() else {
+                    continue;
+                };
+                let cost = event_cost(status, root_child);
+                let order = self.batch_order.entry(pid).or_insert((cost, idx));
+                order.0 = order.0.max(cost);
+            }
+            batch.sort_by_key(|status| {
+                status
+                    .pid()
+                    .and_then(|pid| self.batch_order.get(&pid).copied())
+                    .unwrap_or((EventCost::Cheap, 0))
+            });
+            let len = batch.len();
+            for status in batch.drain(..) {
+                self.on_wait_status(status, root_child)?;
+            }
+            self.shards.set_load(self.shard, self.store.live());
+            self.shards
+                .record(self.shard, len, self.batch_started.elapsed());
+        }
+    }
+
+    /// Block until a tracee changes state, then collect all other ready ones without blocking.
+    /// The batch is left empty when woken up for handed over processes.
+    fn wait_batch(&mut self, batch: &mut Vec<WaitStatus>) -> color_eyre::Result<()> {
+        // Only wait for the tracees of this thread
+        let flags = WaitPidFlag::__WALL | WaitPidFlag::__WNOTHREAD;
+        match waitpid(None, Some(flags)) {
+            Ok(status) => batch.push(status),
+            Err(Errno::EINTR) => return Ok(()),
+            Err(Errno::ECHILD) => {
+                if !self.exit_when_idle {
+                    self.shards.wait_for_handoff(self.shard, None);
+                } else if self.shards.others_idle(self.shard) {
+                    // All tracees are gone
+                    self.finish(0)?;
+                } else {
+                    // The other threads don't tell when they become idle
+                    self.shards
+                        .wait_for_handoff(self.shard, Some(Duration::from_millis(100)));
+                }
+                return Ok(());
+            }
+            Err(e) => return Err(e.into()),
+        }
+        while batch.len() < MAX_WAIT_BATCH {
+            match waitpid(None, Some(flags | WaitPidFlag::WNOHANG)) {
+                Ok(WaitStatus::StillAlive) | Err(Errno::ECHILD) => break,
+                Ok(status) => batch.push(status),
+                Err(e) => return Err(e.into()),
+            }
+        }
+        Ok(())
+    }
+
+    fn recycle_arena(&mut self, arena: StringArena) {
+        if self.spare_arenas.len() < MAX_SPARE_ARENAS {
+            self.spare_arenas.push(arena);
+        }
+    }
+
+    /// Resume the tracees whose execs are read by the capture threads
+    fn accept_captures(&mut self) -> color_eyre::Result<()> {
+        for capture in self.shards.take_captures(self.shard) {
+            let Some(p) = self.store.get_mut(capture.handle) else {
+                continue;
+            };
+            if p.is_exited() {
+                // Killed meanwhile
+                continue;
+            }
+            p.proc_dir = capture.proc_dir;
+            let pid = p.pid;
+            match capture.result {
+                Ok(raw_exec) => p.raw_exec = Some(raw_exec),
+                Err(e) => {
+                    let comm = p.comm.clone();
+                    self.lose_exec(pid, comm, e)?;
+                }
+            }
+            self.syscall_enter_cont(pid)?;
+            self.shards
+                .record_exec_stop(self.shard, capture.stopped_at.elapsed());
+        }
+        Ok(())
+    }
+
+    /// Seize the processes handed over by the other tracer threads
+    fn accept_handoffs(&mut self) -> color_eyre::Result<()> {
+        let states = self.shards.take_handoffs(self.shard);
+        if states.is_empty() {
+            return Ok(());
+        }
+        let count = states.len();
+        let result = states
+            .into_iter()
+            .try_for_each(|state| match self.detaching {
+                true => self.release(state),
+                false => self.seize(state),
+            });
+        // Release the waiting threads even on errors
+        self.shards.accepted(self.shard, count);
+        self.shards.set_load(self.shard, self.store.live());
+        result
+    }
+
+    fn seize(&mut self, mut state: ProcessState) -> color_eyre::Result<()> {
+        let pid = state.pid;
+        match ptrace::seize(pid, self.ptrace_options()) {
+            Err(Errno::ESRCH) => {
+                log::info!("ptrace seize failed: {pid}, ESRCH, child probably gone!");
+                return Ok(());
+            }
+            other => other?,
+        }
+        log::trace!("seized {pid}, handed over to tracer thread {}", self.shard);
+        // It keeps running after the seize. Stop it to restart it with the syscall stops.
+        match ptrace::interrupt(pid) {
+            Ok(()) => {}
+            Err(Errno::ESRCH) => {
+                log::info!("ptrace interrupt failed: {pid}, ESRCH, child probably gone!");
+                return Ok(());
+            }
+            Err(e) => return Err(e.into()),
+        }
+        state.status = ProcessStatus::HandedOver;
+        self.store.insert(state);
+        Ok(())
+    }
+
+    /// Leave a process handed over after this thread detached from its tracees untraced
+    fn release(&mut self, state: ProcessState) -> color_eyre::Result<()> {
+        log::trace!("not seizing {}, detaching", state.pid);
+        Ok(())
+    }
+
+    /// Start a new child after its initial stop, on this thread or on the target thread
+    fn start_child(&mut self, pid: Pid, target: Option<usize>) -> color_eyre::Result<()> {
+        if !self.seccomp_bpf && self.store.get_current_mut(pid).is_some_and(|x| x.pruned) {
+            log::debug!("pruning {pid} at its initial stop");
+            self.detach_pruned(pid)?;
+            self.store.remove(pid);
+            return Ok(());
+        }
+        match target {
+            Some(target) => self.hand_over(pid, target),
+            None => Ok(self.seccomp_aware_cont(pid)?),
+        }
+    }
+
+    /// Let a pruned process run untraced. Its future children are not traced either.
+    fn detach_pruned(&mut self, pid: Pid) -> color_eyre::Result<()> {
+        match ptrace::detach(pid, None) {
+            Ok(()) | Err(Errno::ESRCH) => Ok(()),
+            Err(e) => Err(e.into()),
+        }
+    }
+
+    /// Detach a new child in its initial stop and hand it over to another tracer thread.
+    /// Returns once the other thread has seized it.
+    ///
+    /// The child runs untraced until then, see [`crate::shard`].
+    fn hand_over(&mut self, pid: Pid, target: usize) -> color_eyre::Result<()> {
+        let Some(state) = self.store.remove(pid) else {
+            return Ok(());
+        };
+        match ptrace::detach(pid, None) {
+            Err(Errno::ESRCH) => {
+                log::info!("ptrace detach failed: {pid}, ESRCH, child probably gone!");
+                return Ok(());
+            }
+            other => other?,
+        }
+        log::trace!("handing over {pid} to tracer thread {target}");
+        let ticket = self.shards.hand_over(target, state);
+        while !self.shards.wait_accepted(target, ticket) {
+            // The target might be handing over to this thread at the same time
+            self.accept_handoffs()?;
+        }
+        self.shards.set_load(self.shard, self.store.live());
+        Ok(())
+    }
+
+    fn on_exit(&mut self, pid: Pid, code: i32, root_child: Option<Pid>) -> color_eyre::Result<()> {
+        if self.pending_handoffs.remove(&pid).is_some() {
+            // It died before its initial stop. Release its parent.
+            if let Some(ppid) = self.store.get_current_mut(pid).and_then(|x| x.ppid) {
+                self.seccomp_aware_cont(ppid)?;
+            }
+        }
+        self.store.mark_exited(pid, Some(code));
+        if Some(pid) == root_child {
+            self.finish(code)?;
+        }
+        Ok(())
+    }
+
+    fn finish(&mut self, code: i32) -> color_eyre::Result<()> {
+        if !self.output_finished {
+            self.finish_output()?;
+        }
+        exit(code)
+    }
+
+    /// Hand over the rest of the output. The thread of the root child also writes it out,
+    /// so it should be the last one.
+    fn finish_output(&mut self) -> color_eyre::Result<()> {
+        self.output_finished = true;
+        if self.shard == 0 {
+            self.shards.log_stats();
+        }
+        self.pipeline.finish()
+    }
+
+    /// Stop tracing with seccomp-bpf. Detaching would make the exec syscalls of the tracees
+    /// fail with ENOSYS, as their filters return SECCOMP_RET_TRACE. So they are still traced,
+    /// but their execs are let through until the root child exits.
+    fn start_passthrough(&mut self) -> color_eyre::Result<()> {
+        self.passthrough = true;
+        if self.shard == 0 {
+            log::info!(
+                "The tracees can't run without a tracer because of their seccomp-bpf filters, letting them run until the command exits"
+            );
+        } else {
+            self.finish_output()?;
+            self.shards.mark_stopped(self.shard);
+        }
+        Ok(())
+    }
+
+    /// Detach from all tracees of the thread and hand over the rest of the output.
+    /// Never returns: the thread of the root child exits the process once all threads
+    /// have detached, and the other threads keep releasing the processes handed over to them.
+    fn detach_all(&mut self) -> color_eyre::Result<()> {
+        self.detaching = true;
+        self.pending_handoffs.clear();
+        self.detach_tracees()?;
+        // The tracees of the captures are detached
+        self.shards.take_captures(self.shard);
+        if self.shard != 0 {
+            self.finish_output()?;
+        }
+        self.shards.mark_stopped(self.shard);
+        loop {
+            self.accept_handoffs()?;
+            if self.shard == 0 && self.shards.others_stopped(self.shard) {
+                log::info!("Detached from all tracees");
+                return self.finish(0);
+            }
+            // Only the thread of the root child has something else to wait for
+            let timeout = (self.shard == 0).then_some(Duration::from_millis(10));
+            self.shards.wait_for_handoff(self.shard, timeout);
+        }
+    }
+
+    fn detach_tracees(&mut self) -> color_eyre::Result<()> {
+        let flags = WaitPidFlag::__WALL | WaitPidFlag::__WNOTHREAD;
+        // Pids whose next stop should be detached
+        let mut waiting = HashSet::new();
+        let mut detached = HashSet::new();
+        // The stops that were not collected yet might carry signals for the tracees
+        loop {
+            match waitpid(None, Some(flags | WaitPidFlag::WNOHANG)) {
+                Ok(WaitStatus::StillAlive) | Err(Errno::ECHILD) => break,
+                Ok(status) => self.detach_stopped(status, &mut waiting, &mut detached)?,
+                Err(Errno::EINTR) => continue,
+                Err(e) => return Err(e.into()),
+            }
+        }
+        for pid in self.store.live_pids() {
+            if detached.contains(&pid) {
+                continue;
+            }
+            match ptrace::detach(pid, None) {
+                Ok(()) => {
+                    detached.insert(pid);
+                }
+                // Running, or listening in a group-stop
+                Err(Errno::ESRCH) => match ptrace::interrupt(pid) {
+                    Ok(()) => {
+                        waiting.insert(pid);
                     }
-                    WaitStatus::PtraceEvent(pid, sig, evt) => {
-                        log::trace!("ptrace event: {:?} {:?}", sig, evt);
-                        match evt {
-                            nix::libc::PTRACE_EVENT_FORK
-                            | nix::libc::PTRACE_EVENT_VFORK
-                            | nix::libc::PTRACE_EVENT_CLONE => {
-                                let new_child = Pid::from_raw(ptrace::getevent(pid)? as pid_t);
-                                log::trace!(
-                                    "ptrace fork event, evt {evt}, pid: {pid}, child: {new_child}"
-                                );
-                                if self.print_children {
-                                    let parent = self.store.get_current_mut(pid).unwrap();
-                                    print_new_child(
-                                        self.output.as_mut(),
-                                        parent,
-                                        &self.args,
-                                        new_child,
-                                    )?;
-                                }
-                                if let Some(state) = self.store.get_current_mut(new_child) {
-                                    if state.status == ProcessStatus::SigstopReceived {
-                                        log::trace!("ptrace fork event received after sigstop, pid: {pid}, child: {new_child}");
-                                        state.status = ProcessStatus::Running;
-                                        state.ppid = Some(pid);
-                                        ptrace_syscall(new_child)?;
-                                    } else if new_child != root_child {
-                                        log::error!("Unexpected fork event: {state:?}")
-                                    }
-                                } else {
-                                    log::trace!("ptrace fork event received before sigstop, pid: {pid}, child: {new_child}");
-                                    let mut state = ProcessState::new(new_child, 0)?;
-                                    state.status = ProcessStatus::PtraceForkEventReceived;
-                                    state.ppid = Some(pid);
-                                    self.store.insert(state);
-                                }
-                                // Resume parent
-                                ptrace_syscall(pid)?;
-                            }
-                            nix::libc::PTRACE_EVENT_EXEC => {
-                                log::trace!("exec event");
-                                let p = self.store.get_current_mut(pid).unwrap();
-                                assert!(!p.presyscall);
-                                // After execve or execveat, in syscall exit event,
-                                // the registers might be clobbered(e.g. aarch64).
-                                // So we need to determine whether exec is successful here.
-                                // PTRACE_EVENT_EXEC only happens for successful exec.
-                                p.is_exec_successful = true;
-                                ptrace_syscall(pid)?;
-                            }
-                            nix::libc::PTRACE_EVENT_EXIT => {
-                                log::trace!("exit event");
-                                ptrace_syscall(pid)?;
-                            }
-                            _ => {
-                                log::trace!("other event");
-                                ptrace_syscall(pid)?;
-                            }
+                    Err(Errno::ESRCH) => {}
+                    Err(e) => return Err(e.into()),
+                },
+                Err(e) => return Err(e.into()),
+            }
+        }
+        while !waiting.is_empty() {
+            match waitpid(None, Some(flags)) {
+                Ok(status) => self.detach_stopped(status, &mut waiting, &mut detached)?,
+                Err(Errno::EINTR) => continue,
+                Err(Errno::ECHILD) => break,
+                Err(e) => return Err(e.into()),
+            }
+        }
+        log::debug!(
+            "tracer thread {} detached from {} tracees",
+            self.shard,
+            detached.len()
+        );
+        Ok(())
+    }
+
+    fn detach_stopped(
+        &mut self,
+        status: WaitStatus,
+        waiting: &mut HashSet<Pid>,
+        detached: &mut HashSet<Pid>,
+    ) -> color_eyre::Result<()> {
+        let (pid, sig) = match status {
+            WaitStatus::Exited(pid, _) | WaitStatus::Signaled(pid, _, _) => {
+                waiting.remove(&pid);
+                return Ok(());
+            }
+            // A signal-delivery-stop. Deliver the signal.
+            WaitStatus::Stopped(pid, sig) => (pid, Some(sig)),
+            WaitStatus::PtraceEvent(pid, _, evt) => {
+                if matches!(
+                    evt,
+                    nix::libc::PTRACE_EVENT_FORK
+                        | nix::libc::PTRACE_EVENT_VFORK
+                        | nix::libc::PTRACE_EVENT_CLONE
+                ) {
+                    // The new child is traced too, until its initial stop
+                    if let Ok(child) = ptrace::getevent(pid) {
+                        let child = Pid::from_raw(child as pid_t);
+                        if !detached.contains(&child) {
+                            waiting.insert(child);
                         }
                     }
-                    WaitStatus::Signaled(pid, sig, _) => {
-                        log::debug!("signaled: {pid}, {:?}", sig);
-                        if pid == root_child {
-                            exit(128 + (sig as i32))
-                        }
+                }
+                (pid, None)
+            }
+            WaitStatus::PtraceSyscall(pid) => (pid, None),
+            _ => return Ok(()),
+        };
+        waiting.remove(&pid);
+        detached.insert(pid);
+        match ptrace::detach(pid, sig) {
+            Ok(()) | Err(Errno::ESRCH) => Ok(()),
+            Err(e) => Err(e.into()),
+        }
+    }
+
+    fn on_wait_status(
+        &mut self,
+        status: WaitStatus,
+        root_child: Option<Pid>,
+    ) -> color_eyre::Result<()> {
+        // log::trace!("waitpid: {:?}", status);
+        match status {
+            WaitStatus::Stopped(pid, sig) => {
+                log::trace!("stopped: {pid}, sig {:?}", sig);
+                match sig {
+                    Signal::SIGCHLD => {
+                        // From lurk:
+                        //
+                        // The SIGCHLD signal is sent to a process when a child process terminates, interrupted, or resumes after being interrupted
+                        // This means, that if our tracee forked and said fork exits before the parent, the parent will get stopped.
+                        // Therefor issue a PTRACE_SYSCALL request to the parent to continue execution.
+                        // This is also important if we trace without the following forks option.
+                        self.seccomp_aware_cont_with_signal(pid, Signal::SIGCHLD)?;
                     }
-                    WaitStatus::PtraceSyscall(pid) => {
-                        let p = self.store.get_current_mut(pid).unwrap();
-                        if p.presyscall {
-                            p.presyscall = !p.presyscall;
-                            // SYSCALL ENTRY
-                            let regs = match ptrace_getregs(pid) {
-                                Ok(regs) => regs,
-                                Err(Errno::ESRCH) => {
-                                    log::info!(
-                                        "ptrace getregs failed: {pid}, ESRCH, child probably gone!"
-                                    );
-                                    continue;
-                                }
-                                e => e?,
-                            };
-                            let syscallno = syscall_no_from_regs!(regs);
-                            p.syscall = syscallno;
-                            // log::trace!("pre syscall: {syscallno}");
-                            if syscallno == nix::libc::SYS_execveat {
-                                log::trace!("pre execveat {syscallno}");
-                                // int execveat(int dirfd, const char *pathname,
-                                //              char *const _Nullable argv[],
-                                //              char *const _Nullable envp[],
-                                //              int flags);
-                                let dirfd = syscall_arg!(regs, 0) as i32;
-                                let pathname =
-                                    read_string(pid, syscall_arg!(regs, 1) as AddressType)?;
-                                let pathname_is_empty = pathname.is_empty();
-                                let pathname = PathBuf::from(pathname);
-                                let argv =
-                                    read_string_array(pid, syscall_arg!(regs, 2) as AddressType)?;
-                                let envp =
-                                    read_string_array(pid, syscall_arg!(regs, 3) as AddressType)?;
-                                let flags = syscall_arg!(regs, 4) as i32;
-                                let filename = match (
-                                    pathname.is_absolute(),
-                                    pathname_is_empty && ((flags & AT_EMPTY_PATH) != 0),
-                                ) {
-                                    (true, _) => {
-                                        // If pathname is absolute, then dirfd is ignored.
-                                        pathname
-                                    }
-                                    (false, true) => {
-                                        // If  pathname  is an empty string and the AT_EMPTY_PATH flag is specified, then the file descriptor dirfd
-                                        // specifies the file to be executed
-                                        read_fd(pid, dirfd)?
-                                    }
-                                    (false, false) => {
-                                        // pathname is relative to dirfd
-                                        let dir = read_fd(pid, dirfd)?;
-                                        dir.join(pathname)
-                                    }
-                                };
-                                let interpreters = if self.args.trace_interpreter {
-                                    read_interpreter_recursive(&filename)
-                                } else {
-                                    vec![]
-                                };
-                                p.exec_data = Some(ExecData {
-                                    filename,
-                                    argv,
-                                    envp,
-                                    cwd: read_cwd(pid)?,
-                                    interpreters,
-                                });
-                            } else if syscallno == nix::libc::SYS_execve {
-                                log::trace!("pre execve {syscallno}",);
-                                let filename =
-                                    read_pathbuf(pid, syscall_arg!(regs, 0) as AddressType)?;
-                                let argv =
-                                    read_string_array(pid, syscall_arg!(regs, 1) as AddressType)?;
-                                let envp =
-                                    read_string_array(pid, syscall_arg!(regs, 2) as AddressType)?;
-                                let interpreters = if self.args.trace_interpreter {
-                                    read_interpreter_recursive(&filename)
-                                } else {
-                                    vec![]
-                                };
-                                p.exec_data = Some(ExecData {
-                                    filename,
-                                    argv,
-                                    envp,
-                                    cwd: read_cwd(pid)?,
-                                    interpreters,
-                                });
-                            } else if syscallno == SYS_clone || syscallno == SYS_clone3 {
+                    _ => {
+                        // Just deliver the signal to tracee
+                        self.seccomp_aware_cont_with_signal(pid, sig)?;
+                    }
+                }
+            }
+            WaitStatus::Exited(pid, code) => {
+                log::trace!("exited: pid {}, code {:?}", pid, code);
+                self.on_exit(pid, code, root_child)?;
+            }
+            WaitStatus::PtraceEvent(pid, sig, evt) => {
+                log::trace!("ptrace event: {:?} {:?}", sig, evt);
+                match evt {
+                    nix::libc::PTRACE_EVENT_FORK
+                    | nix::libc::PTRACE_EVENT_VFORK
+                    | nix::libc::PTRACE_EVENT_CLONE => {
+                        let new_child = Pid::from_raw(ptrace::getevent(pid)? as pid_t);
+                        log::trace!("ptrace fork event, evt {evt}, pid: {pid}, child: {new_child}");
+                        let parent = self.store.get_current_mut(pid).unwrap();
+                        let (comm, env) = (parent.comm.clone(), parent.env.clone());
+                        let depth = match evt {
+                            nix::libc::PTRACE_EVENT_CLONE => parent.depth,
+                            _ => parent.depth + 1,
+                        };
+                        let parent_pruned = parent.pruned;
+                        let pruned = parent_pruned || self.prune.prunes_depth(depth);
+                        let target = match evt {
+                            // Threads stay with their process
+                            nix::libc::PTRACE_EVENT_CLONE => None,
+                            // Detached right away
+                            _ if pruned && !self.seccomp_bpf => None,
+                            // Its execs would fail with ENOSYS while it is untraced
+                            _ if self.seccomp_bpf => None,
+                            _ => self.shards.pick_target(self.shard),
+                        };
+                        if self.print_children && !parent_pruned && !self.shards.detach_requested()
+                        {
+                            self.pipeline.submit(TracerEvent::NewChild {
+                                pid,
+                                comm: comm.clone(),
+                                child: new_child,
+                            })?;
+                        }
+                        if let Some(state) = self.store.get_current_mut(new_child) {
+                            if state.status == ProcessStatus::InitialStopReceived {
+                                log::trace!("ptrace fork event received after initial stop, pid: {pid}, child: {new_child}");
+                                state.status = ProcessStatus::Running;
+                                state.comm = comm;
+                                state.env = env;
+                                state.depth = depth;
+                                state.pruned = pruned;
+                                self.store.set_parent(new_child, pid);
+                                self.start_child(new_child, target)?;
+                            } else if Some(new_child) != root_child {
+                                log::error!("Unexpected fork event: {state:?}")
                             }
                         } else {
-                            // SYSCALL EXIT
-                            // log::trace!("post syscall {}", p.syscall);
-                            p.presyscall = !p.presyscall;
-
-                            let regs = match ptrace_getregs(pid) {
-                                Ok(regs) => regs,
-                                Err(Errno::ESRCH) => {
-                                    log::info!(
-                                        "ptrace getregs failed: {pid}, ESRCH, child probably gone!"
-                                    );
-                                    continue;
-                                }
-                                e => e?,
-                            };
-                            let result = syscall_res_from_regs!(regs);
-                            let exec_result = if p.is_exec_successful { 0 } else { result };
-                            match p.syscall {
-                                nix::libc::SYS_execve => {
-                                    log::trace!("post execve in exec");
-                                    if self.args.successful_only && !p.is_exec_successful {
-                                        p.exec_data = None;
-                                        ptrace_syscall(pid)?;
-                                        continue;
-                                    }
-                                    // SAFETY: p.preexecve is false, so p.exec_data is Some
-                                    print_exec_trace(
-                                        self.output.as_mut(),
-                                        p,
-                                        exec_result,
-                                        &self.args,
-                                        &self.env,
-                                        &self.cwd,
-                                    )?;
-                                    p.exec_data = None;
-                                    p.is_exec_successful = false;
-                                    // update comm
-                                    p.comm = read_comm(pid)?;
-                                }
-                                nix::libc::SYS_execveat => {
-                                    log::trace!("post execveat in exec");
-                                    if self.args.successful_only && !p.is_exec_successful {
-                                        p.exec_data = None;
-                                        ptrace_syscall(pid)?;
-                                        continue;
-                                    }
-                                    print_exec_trace(
-                                        self.output.as_mut(),
-                                        p,
-                                        exec_result,
-                                        &self.args,
-                                        &self.env,
-                                        &self.cwd,
-                                    )?;
-                                    p.exec_data = None;
-                                    p.is_exec_successful = false;
-                                    // update comm
-                                    p.comm = read_comm(pid)?;
-                                }
-                                _ => (),
+                            log::trace!("ptrace fork event received before initial stop, pid: {pid}, child: {new_child}");
+                            let mut state = ProcessState::with_comm(new_child, comm);
+                            count_avoided_reads(2);
+                            state.status = ProcessStatus::PtraceForkEventReceived;
+                            state.ppid = Some(pid);
+                            state.env = env;
+                            state.depth = depth;
+                            state.pruned = pruned;
+                            self.store.insert(state);
+                            if let Some(target) = target {
+                                // Hold the parent until the child is handed over,
+                                // so that it doesn't wait for the child while it is untraced.
+                                self.pending_handoffs.insert(new_child, target);
+                                return Ok(());
                             }
                         }
-                        ptrace_syscall(pid)?;
+                        // Resume parent
+                        self.seccomp_aware_cont(pid)?;
+                    }
+                    nix::libc::PTRACE_EVENT_STOP => self.on_event_stop(pid, sig)?,
+                    nix::libc::PTRACE_EVENT_EXEC => {
+                        log::trace!("exec event");
+                        let Some(p) = self.store.get_current_mut(pid) else {
+                            log::info!("exec event of {pid}, which is already gone");
+                            return Ok(());
+                        };
+                        if p.presyscall {
+                            // Attached in the middle of the exec. Skip it.
+                            p.presyscall = false;
+                        }
+                        // After execve or execveat, in syscall exit event,
+                        // the registers might be clobbered(e.g. aarch64).
+                        // So we need to determine whether exec is successful here.
+                        // PTRACE_EVENT_EXEC only happens for successful exec.
+                        p.is_exec_successful = true;
+                        // We are still inside the exec syscall
+                        self.syscall_enter_cont(pid)?;
+                    }
+                    nix::libc::PTRACE_EVENT_EXIT => {
+                        log::trace!("exit event");
+                        self.seccomp_aware_cont(pid)?;
+                    }
+                    nix::libc::PTRACE_EVENT_SECCOMP => {
+                        log::trace!("seccomp event");
+                        // The filter only returns SECCOMP_RET_TRACE for exec syscalls.
+                        // Handle it as the syscall-entry stop.
+                        self.on_syscall_enter(pid)?;
                     }
-                    _ => {}
+                    _ => {
+                        log::trace!("other event");
+                        self.seccomp_aware_cont(pid)?;
+                    }
+                }
+            }
+            WaitStatus::Signaled(pid, sig, _) => {
+                log::debug!("signaled: {pid}, {:?}", sig);
+                self.on_exit(pid, 128 + (sig as i32), root_child)?;
+            }
+            WaitStatus::PtraceSyscall(pid) => {
+                let Some(p) = self.store.get_current_mut(pid) else {
+                    log::info!("syscall stop of {pid}, which is already gone");
+                    return Ok(());
+                };
+                if p.presyscall {
+                    self.on_syscall_enter(pid)?;
+                } else {
+                    self.on_syscall_exit(pid)?;
                 }
             }
+            _ => {}
+        }
+        Ok(())
+    }
+
+    /// PTRACE_EVENT_STOP is reported for the initial stop of new children, for group-stops,
+    /// and for PTRACE_INTERRUPT or the end of a group-stop.
+    fn on_event_stop(&mut self, pid: Pid, sig: Signal) -> color_eyre::Result<()> {
+        let Some(state) = self.store.get_current_mut(pid) else {
+            log::trace!("initial stop received before ptrace fork event, pid: {pid}");
+            // comm is inherited from the parent at the fork event
+            let mut state = ProcessState::with_comm(pid, intern_str(""));
+            count_avoided_reads(2);
+            state.status = ProcessStatus::InitialStopReceived;
+            self.store.insert(state);
+            // https://stackoverflow.com/questions/29997244/occasionally-missing-ptrace-event-vfork-when-running-ptrace
+            // DO NOT send PTRACE_SYSCALL until we receive the PTRACE_EVENT_FORK, etc.
+            return Ok(());
+        };
+        if state.status == ProcessStatus::PtraceForkEventReceived {
+            log::trace!("initial stop received after ptrace fork event, pid: {pid}");
+            state.status = ProcessStatus::Running;
+            let ppid = state.ppid;
+            let target = self.pending_handoffs.remove(&pid);
+            self.start_child(pid, target)?;
+            if let (Some(_), Some(ppid)) = (target, ppid) {
+                // Held until the handover
+                self.seccomp_aware_cont(ppid)?;
+            }
+        } else if state.status == ProcessStatus::HandedOver {
+            log::trace!("interrupted {pid} after seizing it");
+            state.status = ProcessStatus::Running;
+            self.seccomp_aware_cont(pid)?;
+        } else if is_stop_signal(sig) {
+            log::trace!("group-stop: {pid}, sig {sig:?}");
+            // Restarting it would undo the stop. Wait for SIGCONT instead.
+            ptrace_listen(pid)?;
         } else {
-            let me = getpid();
-            setpgid(me, me)?;
-            traceme()?;
-            log::trace!("traceme setup!");
-            if 0 != unsafe { raise(SIGSTOP) } {
-                log::error!("raise failed!");
-                exit(-1);
-            }
-            log::trace!("raise success!");
-            let args = args
-                .into_iter()
-                .map(CString::new)
-                .collect::<Result<Vec<CString>, _>>()?;
-            execvp(&args[0], &args)?;
+            self.seccomp_aware_cont(pid)?;
+        }
+        Ok(())
+    }
+
+    fn on_syscall_enter(&mut self, pid: Pid) -> color_eyre::Result<()> {
+        let Some((handle, p)) = self
+            .store
+            .handle(pid)
+            .and_then(|handle| Some((handle, self.store.get_mut(handle)?)))
+        else {
+            log::info!("syscall entry of {pid}, which is already gone");
+            return Ok(());
+        };
+        if self.passthrough || p.pruned {
+            // Only the seccomp stops of exec syscalls arrive here
+            self.seccomp_aware_cont(pid)?;
+            return Ok(());
+        }
+        p.presyscall = !p.presyscall;
+        // SYSCALL ENTRY
+        let entry = match get_syscall_entry(pid) {
+            Ok(entry) => entry,
+            Err(Errno::ESRCH) => {
+                log::info!("ptrace get syscall info failed: {pid}, ESRCH, child probably gone!");
+                return Ok(());
+            }
+            e => e?,
+        };
+        let syscallno = entry.no;
+        p.syscall = syscallno;
+        // log::trace!("pre syscall: {syscallno}");
+        if syscallno == nix::libc::SYS_execveat || syscallno == nix::libc::SYS_execve {
+            let mut request = ExecRequest {
+                handle,
+                pid,
+                shard: self.shard,
+                syscall: syscallno,
+                args: entry.args,
+                proc_dir: p.proc_dir.take(),
+                stopped_at: self.batch_started,
+                arena: self.spare_arenas.pop().unwrap_or_default(),
+                comm: p.comm.clone(),
+            };
+            if let Some(pool) = self.capture_pool.as_ref() {
+                // The tracee is resumed when the capture comes back
+                pool.submit(request);
+                return Ok(());
+            }
+            let result = request.read(&self.args, &mut PtraceMemory(pid));
+            p.proc_dir = request.proc_dir;
+            match result {
+                Ok(raw_exec) => p.raw_exec = Some(raw_exec),
+                Err(e) => {
+                    let comm = p.comm.clone();
+                    self.lose_exec(pid, comm, e)?;
+                }
+            }
+            self.syscall_enter_cont(pid)?;
+            self.shards
+                .record_exec_stop(self.shard, self.batch_started.elapsed());
+            return Ok(());
+        } else if syscallno == SYS_clone || syscallno == SYS_clone3 {
+        }
+        self.syscall_enter_cont(pid)?;
+        Ok(())
+    }
+
+    fn on_syscall_exit(&mut self, pid: Pid) -> color_eyre::Result<()> {
+        // SYSCALL EXIT
+        let Some(p) = self.store.get_current_mut(pid) else {
+            log::info!("syscall exit of {pid}, which is already gone");
+            return Ok(());
+        };
+        // log::trace!("post syscall {}", p.syscall);
+        p.presyscall = !p.presyscall;
+
+        let result = match get_syscall_result(pid) {
+            Ok(result) => result,
+            Err(Errno::ESRCH) => {
+                log::info!("ptrace get syscall info failed: {pid}, ESRCH, child probably gone!");
+                return Ok(());
+            }
+            e => e?,
+        };
+        let exec_result = if p.is_exec_successful { 0 } else { result };
+        match p.syscall {
+            nix::libc::SYS_execve | nix::libc::SYS_execveat => {
+                log::trace!("post exec syscall {}", p.syscall);
+                let raw_exec = p.raw_exec.take();
+                let is_exec_successful = std::mem::take(&mut p.is_exec_successful);
+                let Some(raw_exec) = raw_exec else {
+                    // Attached after the syscall entry, or the exec is lost
+                    self.seccomp_aware_cont(pid)?;
+                    return Ok(());
+                };
+                let prune = is_exec_successful && self.prune.prunes_exec(&raw_exec.filename);
+                // Nothing below needs the tracee stopped
+                if prune && !self.seccomp_bpf {
+                    log::debug!("pruning {pid} after its exec of {:?}", raw_exec.filename);
+                    self.detach_pruned(pid)?;
+                    let result = self.show_exec(pid, raw_exec, exec_result, is_exec_successful);
+                    self.store.remove(pid);
+                    return result;
+                }
+                if prune {
+                    self.store.get_current_mut(pid).unwrap().pruned = true;
+                }
+                self.seccomp_aware_cont(pid)?;
+                return self.show_exec(pid, raw_exec, exec_result, is_exec_successful);
+            }
+            _ => (),
+        }
+        self.seccomp_aware_cont(pid)?;
+        Ok(())
+    }
+
+    fn show_exec(
+        &mut self,
+        pid: Pid,
+        mut raw_exec: RawExec,
+        exec_result: i64,
+        is_exec_successful: bool,
+    ) -> color_eyre::Result<()> {
+        if (self.args.successful_only && !is_exec_successful)
+            || !raw_exec.accepted(&self.args, exec_result)
+            || !self.shards.count_exec()
+        {
+            if is_exec_successful {
+                // Later execs of the process are shown with its new comm and environment
+                let p = self.store.get_current_mut(pid).unwrap();
+                p.comm = comm_from_filename(&raw_exec.filename);
+                if self.args.track_env() {
+                    p.replace_env(&raw_exec.strings.intern(raw_exec.envp.clone()));
+                }
+            }
+            self.recycle_arena(raw_exec.strings);
+            return Ok(());
         }
+        let (exec_data, arena) = raw_exec.decode(&self.args);
+        self.recycle_arena(arena);
+        let p = self.store.get_current_mut(pid).unwrap();
+        // The kernel sets comm to the basename of the filename
+        let comm = if is_exec_successful {
+            std::mem::replace(&mut p.comm, comm_from_filename(&exec_data.filename))
+        } else {
+            p.comm.clone()
+        };
+        count_avoided_reads(1);
+        let event = ExecEvent {
+            pid,
+            comm,
+            result: exec_result,
+            env: match self.args.track_env() && is_exec_successful {
+                true => p.replace_env(&exec_data.envp),
+                false => p.env.clone(),
+            },
+            exec_data,
+        };
+        self.pipeline.submit(TracerEvent::Exec(event))?;
         Ok(())
     }
+
+    /// Report an exec that could not be read at its syscall-entry stop.
+    /// Most likely the tracee was killed meanwhile, which is no reason to stop tracing the others.
+    /// The tracee is still resumed, and its syscall-exit stop finds no exec to show.
+    fn lose_exec(
+        &mut self,
+        pid: Pid,
+        comm: Arc<str>,
+        error: color_eyre::Report,
+    ) -> color_eyre::Result<()> {
+        let reason = error.to_string();
+        log::debug!("{pid}: exec details lost: {reason}");
+        self.pipeline
+            .submit(TracerEvent::LostExec { pid, comm, reason })
+    }
+
+    /// Resume the tracee until the next syscall-exit stop.
+    fn syscall_enter_cont(&self, pid: Pid) -> Result<(), Errno> {
+        ptrace_syscall(pid)
+    }
+
+    /// When seccomp-bpf is enabled, we use `ptrace::cont` instead of `ptrace::syscall`.
+    /// The seccomp stop is then used as the syscall-entry stop of exec syscalls.
+    fn seccomp_aware_cont(&self, pid: Pid) -> Result<(), Errno> {
+        if self.seccomp_bpf {
+            ptrace_cont(pid)
+        } else {
+            ptrace_syscall(pid)
+        }
+    }
+
+    fn seccomp_aware_cont_with_signal(&self, pid: Pid, sig: Signal) -> Result<(), Errno> {
+        if self.seccomp_bpf {
+            ptrace_cont_with_signal(pid, sig)
+        } else {
+            ptrace_syscall_with_signal(pid, sig)
+        }
+    }
 }
@@ -0,0 +1,520 @@
+//! seccomp user notification backend.
+//!
+//! The child installs a `SECCOMP_RET_USER_NOTIF` filter for exec syscalls and
+//! sends the listener fd to us. Every exec then blocks until one of the worker
+//! threads has read its arguments from /proc/<pid>/mem and let the kernel continue it.
+//! We are not the ptracer of the tracees, so debuggers still work inside them.
+//!
+//! The kernel doesn't tell us the result of the exec. The proc connector is used
+//! to find it out: an exec event means success, while an exit or another exec attempt
+//! of the same process means failure, with an unknown errno.
+//!
+//! Execs of the tracees fail with ENOSYS once nobody is listening anymore. So tracexec
+//! keeps serving them after the root process exits, until the listener tells that no task
+//! uses the filter anymore, which daemonizing commands rely on. Kernels before 5.9 don't
+//! tell it, so tracexec exits with the root process and the descendants that outlive it
+//! can't exec anymore.
+
+use std::{
+    collections::HashMap,
+    ffi::CStr,
+    io::Write,
+    os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd},
+    path::Path,
+    process::exit,
+    sync::{Arc, Mutex},
+    time::Duration,
+};
+
+use color_eyre::eyre::WrapErr;
+use nix::{
+    errno::Errno,
+    libc::{self, tcsetpgrp, STDIN_FILENO},
+    sys::wait::{waitpid, WaitStatus},
+    unistd::Pid,
+};
+
+use crate::{
+    cli::TracingArgs,
+    inspect::{ProcMem, StringArena},
+    intern::intern_path,
+    pipeline::{ExecEvent, Pipeline, TracerEvent},
+    printer::{PrinterArgs, UNKNOWN_EXEC_ERROR, UNKNOWN_EXEC_RESULT},
+    proc::{read_comm, read_cwd, read_interpreter_recursive, read_tgid, resolve_execveat_filename},
+    proc_connector::{ProcConnectorSocket, ProcEvent},
+    seccomp::{
+        is_seccomp_user_notif_supported, load_user_notif_filters, needs_no_new_privs,
+        notif_continue, notif_id_valid, notif_recv, SeccompNotif,
+    },
+    spawn::{child_fail, spawn_gated},
+    state::ExecData,
+};
+
+const MAX_WORKER_THREADS: usize = 8;
+
+struct Output {
+    pipeline: Pipeline,
+    /// Execs waiting for their results, keyed by tgid as in the proc connector events
+    pending: HashMap<Pid, ExecEvent>,
+}
+
+struct Shared {
+    args: PrinterArgs,
+    /// Whether the results of execs are known
+    track_results: bool,
+    output: Mutex<Output>,
+}
+
+pub struct UserNotifTracer {
+    shared: Arc<Shared>,
+}
+
+impl UserNotifTracer {
+    pub fn new(
+        tracing_args: TracingArgs,
+        output: Box<dyn Write + Send>,
+    ) -> color_eyre::Result<Self> {
+        if !is_seccomp_user_notif_supported() {
+            color_eyre::eyre::bail!("seccomp user notification is not supported by the kernel");
+        }
+        if !supports_continue() {
+            // Without SECCOMP_USER_NOTIF_FLAG_CONTINUE, every exec would fail
+            color_eyre::eyre::bail!(
+                "The seccomp-user-notif backend requires Linux 5.5 or later to let the execs continue"
+            );
+        }
+        if tracing_args.show_children {
+            log::warn!("--show-children is not supported by the seccomp-user-notif backend");
+        }
+        if needs_no_new_privs() {
+            log::warn!(
+                "Loading the seccomp filter without CAP_SYS_ADMIN sets PR_SET_NO_NEW_PRIVS. setuid/setgid programs and file capabilities won't raise the privileges of the tracees"
+            );
+        }
+        Ok(Self {
+            shared: Arc::new(Shared {
+                args: PrinterArgs::from_cli(&tracing_args),
+                track_results: false,
+                output: Mutex::new(Output {
+                    pipeline: Pipeline::new(&tracing_args, output)?,
+                    pending: HashMap::new(),
+                }),
+            }),
+        })
+    }
+
+    pub fn start_root_process(mut self, args: Vec<String>) -> color_eyre::Result<()> {
+        // Subscribe before the child is spawned so that no exec event is missed
+        let socket = match ProcConnectorSocket::subscribe() {
+            Ok(socket) => Some(socket),
+            Err(e) => {
+                log::warn!(
+                    "Cannot subscribe to the proc connector: {e}. Results of execs are unknown."
+                );
+                if self.shared.args.successful_only {
+                    log::warn!(
+                        "--successful-only and --show-cmdline hide the execs with unknown results"
+                    );
+                }
+                None
+            }
+        };
+        Arc::get_mut(&mut self.shared).unwrap().track_results = socket.is_some();
+        let (root_child, listener) = spawn_with_listener(args)?;
+        // Set foreground process group of the terminal
+        if -1 == unsafe { tcsetpgrp(STDIN_FILENO, root_child.as_raw()) } {
+            return Err(Errno::last().into());
+        }
+        let listener = Arc::new(listener);
+        let threads = std::thread::available_parallelism()
+            .map(|x| x.get().min(MAX_WORKER_THREADS))
+            .unwrap_or(1);
+        for _ in 0..threads {
+            let shared = self.shared.clone();
+            let listener = listener.clone();
+            std::thread::spawn(move || shared.serve(listener.as_raw_fd()));
+        }
+        let wait_for_descendants = reports_unused_filter();
+        if !wait_for_descendants {
+            log::warn!(
+                "The kernel doesn't tell when all tracees are gone. Execs of the processes that outlive the command will fail with ENOSYS after tracexec exits"
+            );
+        }
+        let code = match socket {
+            Some(mut socket) => {
+                let mut code = None;
+                loop {
+                    if socket.poll(100)? {
+                        socket.recv_events(|event| self.shared.handle_event(event))?;
+                    }
+                    if code.is_none() {
+                        code = try_wait(root_child)?;
+                    }
+                    let Some(code) = code else {
+                        continue;
+                    };
+                    if !wait_for_descendants || is_unused(listener.as_raw_fd(), 0)? {
+                        // The events before the exit of the last tracee are already queued
+                        socket.recv_events(|event| self.shared.handle_event(event))?;
+                        break code;
+                    }
+                }
+            }
+            None => {
+                let code = loop {
+                    if let Some(code) = exit_code(waitpid(root_child, None)?) {
+                        break code;
+                    }
+                };
+                while wait_for_descendants && !is_unused(listener.as_raw_fd(), -1)? {}
+                code
+            }
+        };
+        let mut output = self.shared.output.lock().unwrap();
+        // The remaining execs failed, unless they are done by non-leader threads
+        let Output { pipeline, pending } = &mut *output;
+        for (_, mut event) in pending.drain() {
+            event.result = UNKNOWN_EXEC_ERROR;
+            self.shared.submit(pipeline, event)?;
+        }
+        pipeline.finish()?;
+        exit(code)
+    }
+}
+
+fn exit_code(status: WaitStatus) -> Option<i32> {
+    match status {
+        WaitStatus::Exited(_, code) => Some(code),
+        WaitStatus::Signaled(_, sig, _) => Some(128 + (sig as i32)),
+        _ => None,
+    }
+}
+
+/// Whether the listener reports POLLHUP once no task uses its filter, which is new in Linux 5.9
+fn reports_unused_filter() -> bool {
+    kernel_version() >= (5, 9)
+}
+
+/// Whether the kernel supports SECCOMP_USER_NOTIF_FLAG_CONTINUE, which is new in Linux 5.5
+fn supports_continue() -> bool {
+    kernel_version() >= (5, 5)
+}
+
+/// (major, minor) of the running kernel, (0, 0) if unknown
+fn kernel_version() -> (u32, u32) {
+    let mut uts: libc::utsname = unsafe { std::mem::zeroed() };
+    if -1 == unsafe { libc::uname(&mut uts) } {
+        return (0, 0);
+    }
+    let release = unsafe { CStr::from_ptr(uts.release.as_ptr()) }.to_string_lossy();
+    let mut version = release
+        .split(|c: char| !c.is_ascii_digit())
+        .map(|x| x.parse::<u32>().unwrap_or(0));
+    let major = version.next().unwrap_or(0);
+    let minor = version.next().unwrap_or(0);
+    (major, minor)
+}
+
+/// Wait up to `timeout_ms` for no task to use the filter of the listener anymore
+fn is_unused(listener: RawFd, timeout_ms: libc::c_int) -> Result<bool, Errno> {
+    // POLLHUP is reported even if not requested
+    let mut pollfd = libc::pollfd {
+        fd: listener,
+        events: 0,
+        revents: 0,
+    };
+    match unsafe { libc::poll(&mut pollfd, 1, timeout_ms) } {
+        -1 if Errno::last() == Errno::EINTR => Ok(false),
+        -1 => Err(Errno::last()),
+        _ => Ok(pollfd.revents & libc::POLLHUP != 0),
+    }
+}
+
+fn try_wait(pid: Pid) -> color_eyre::Result<Option<i32>> {
+    Ok(exit_code(waitpid(
+        pid,
+        Some(nix::sys::wait::WaitPidFlag::WNOHANG),
+    )?))
+}
+
+impl Shared {
+    /// Serve the notifications until tracexec exits. A worker never gives up,
+    /// as the exec of a tracee would block forever without an answer.
+    fn serve(&self, listener: RawFd) {
+        // Each worker reuses its own arena for capturing the strings of the execs
+        let mut arena = StringArena::default();
+        loop {
+            let notif = match notif_recv(listener) {
+                Ok(notif) => notif,
+                // The tracee died before we received the notification
+                Err(Errno::ENOENT) | Err(Errno::EINTR) => continue,
+                Err(e) => {
+                    log::error!("Failed to receive seccomp notification: {e}");
+                    // Don't spin if the error persists
+                    std::thread::sleep(Duration::from_millis(10));
+                    continue;
+                }
+            };
+            if let Err(e) = self.on_notif(listener, &notif, &mut arena) {
+                log::error!("Failed to handle the exec of {}: {e:#}", notif.pid);
+            }
+            loop {
+                match notif_continue(listener, notif.id) {
+                    // The tracee died while we are reading its memory
+                    Ok(()) | Err(Errno::ENOENT) => break,
+                    Err(Errno::EINTR) => continue,
+                    Err(e) => {
+                        log::error!("Failed to continue the exec of {}: {e}", notif.pid);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    fn on_notif(
+        &self,
+        listener: RawFd,
+        notif: &SeccompNotif,
+        arena: &mut StringArena,
+    ) -> color_eyre::Result<()> {
+        let pid = Pid::from_raw(notif.pid as i32);
+        let comm = read_comm(pid).unwrap_or_default();
+        // The exec might come from a non-leader thread
+        let tgid = match self.track_results {
+            true => read_tgid(pid).unwrap_or(pid),
+            false => pid,
+        };
+        arena.clear();
+        let exec_data = self.read_exec_data(listener, pid, notif, arena);
+        let mut output = self.output.lock().unwrap();
+        let Output { pipeline, pending } = &mut *output;
+        if let Some(mut event) = pending.remove(&tgid) {
+            // The last exec of this process failed
+            event.result = UNKNOWN_EXEC_ERROR;
+            self.submit(pipeline, event)
+                .wrap_err("failed to submit the previous exec of the process")?;
+        }
+        match exec_data {
+            Ok(exec_data) => {
+                let event = ExecEvent {
+                    pid,
+                    comm,
+                    // Found out from the proc connector events if possible
+                    result: UNKNOWN_EXEC_RESULT,
+                    // Processes are not tracked, so always diff against tracexec
+                    env: None,
+                    exec_data,
+                };
+                if self.track_results {
+                    pending.insert(tgid, event);
+                    Ok(())
+                } else {
+                    self.submit(pipeline, event)
+                        .wrap_err("failed to submit the exec")
+                }
+            }
+            Err(e) => {
+                log::debug!("{pid}: exec details lost: {e}");
+                pipeline
+                    .submit(TracerEvent::LostExec {
+                        pid,
+                        comm,
+                        reason: format!("failed to read memory: {e}"),
+                    })
+                    .wrap_err("failed to submit the lost exec")
+            }
+        }
+    }
+
+    fn read_exec_data(
+        &self,
+        listener: RawFd,
+        pid: Pid,
+        notif: &SeccompNotif,
+        arena: &mut StringArena,
+    ) -> std::io::Result<ExecData> {
+        let mem = ProcMem::open(pid)?;
+        // Make sure that we opened the memory of the tracee, not a process that reused its pid
+        if !notif_id_valid(listener, notif.id) {
+            return Err(std::io::Error::from_raw_os_error(libc::ESRCH));
+        }
+        let args = notif.args.map(|x| x as usize);
+        let (filename, argv, envp) = match notif.nr as libc::c_long {
+            nix::libc::SYS_execve => (mem.read_pathbuf(args[0])?, args[1], args[2]),
+            nix::libc::SYS_execveat => {
+                let pathname = mem.read_pathbuf(args[1])?;
+                let filename =
+                    resolve_execveat_filename(pid, args[0] as i32, pathname, args[4] as i32)?;
+                (filename, args[2], args[3])
+            }
+            nr => unreachable!("unexpected syscall {nr} from seccomp notification"),
+        };
+        let interpreters = if self.args.trace_interpreter {
+            read_interpreter_recursive(&filename)
+        } else {
+            Vec::new()
+        };
+        let argv = match self.args.needs_argv() {
+            true => mem.read_string_array(argv, arena)?,
+            false => 0..0,
+        };
+        let envp = match self.args.needs_envp() {
+            true => mem.read_string_array(envp, arena)?,
+            false => 0..0,
+        };
+        Ok(ExecData {
+            argv: arena.intern(argv),
+            envp: arena.intern(envp),
+            cwd: if self.args.trace_cwd || self.args.print_cmdline {
+                intern_path(&read_cwd(pid)?)
+            } else {
+                intern_path(Path::new(""))
+            },
+            filename: intern_path(&filename),
+            interpreters,
+        })
+    }
+
+    fn handle_event(&self, event: ProcEvent) -> color_eyre::Result<()> {
+        let (pid, result) = match event {
+            ProcEvent::Exec { pid } => (pid, 0),
+            ProcEvent::Exit { pid, .. } => (pid, UNKNOWN_EXEC_ERROR),
+            ProcEvent::Lost(_) => {
+                log::warn!("proc connector events are lost, exec results might be wrong");
+                return Ok(());
+            }
+            ProcEvent::Fork { .. } => return Ok(()),
+        };
+        let mut output = self.output.lock().unwrap();
+        let Output { pipeline, pending } = &mut *output;
+        if let Some(mut event) = pending.remove(&pid) {
+            event.result = result;
+            self.submit(pipeline, event)?;
+        }
+        Ok(())
+    }
+
+    fn submit(&self, pipeline: &mut Pipeline, event: ExecEvent) -> color_eyre::Result<()> {
+        // Unknown results are not known to be successful
+        if self.args.successful_only && event.result != 0 {
+            return Ok(());
+        }
+        let exec = &event.exec_data;
+        if !self.args.accepts(
+            &exec.filename,
+            &event.comm,
+            &exec.argv,
+            &exec.envp,
+            event.result,
+        ) {
+            return Ok(());
+        }
+        pipeline.submit(TracerEvent::Exec(event))
+    }
+}
+
+/// Spawn the child in a new process group with the user notification filter loaded.
+///
+/// The listener is created in the child and sent back through a unix socket.
+fn spawn_with_listener(args: Vec<String>) -> color_eyre::Result<(Pid, OwnedFd)> {
+    let mut fds = [0; 2];
+    if -1
+        == unsafe {
+            libc::socketpair(
+                libc::AF_UNIX,
+                libc::SOCK_SEQPACKET | libc::SOCK_CLOEXEC,
+                0,
+                fds.as_mut_ptr(),
+            )
+        }
+    {
+        return Err(Errno::last().into());
+    }
+    let [parent_sock, child_sock] = fds.map(|fd| unsafe { OwnedFd::from_raw_fd(fd) });
+    let no_new_privs = needs_no_new_privs();
+    // The parent's copy of child_sock is closed with the closure,
+    // so that recv_fd sees the end of the socket if the child fails
+    let (child, gate) = spawn_gated(args, move || {
+        let listener = match load_user_notif_filters(no_new_privs) {
+            Ok(fd) => unsafe { OwnedFd::from_raw_fd(fd) },
+            Err(_) => child_fail(b"tracexec: failed to load the seccomp filter\n"),
+        };
+        if send_fd(child_sock.as_raw_fd(), listener.as_raw_fd()).is_err() {
+            child_fail(b"tracexec: failed to send the seccomp listener\n");
+        }
+        Ok(())
+    })?;
+    gate.open()?;
+    match recv_fd(parent_sock.as_raw_fd())? {
+        Some(listener) => Ok((child, listener)),
+        None => {
+            // The child has reported the error
+            waitpid(child, None)?;
+            color_eyre::eyre::bail!("Failed to load the seccomp filter in the child");
+        }
+    }
+}
+
+fn send_fd(sock: RawFd, fd: RawFd) -> Result<(), Errno> {
+    let mut data = [0u8; 1];
+    let mut iov = libc::iovec {
+        iov_base: data.as_mut_ptr() as *mut libc::c_void,
+        iov_len: data.len(),
+    };
+    let space = unsafe { libc::CMSG_SPACE(std::mem::size_of::<RawFd>() as u32) } as usize;
+    // On the stack, as it runs between fork and exec. u64 for the alignment of cmsghdr.
+    let mut control = [0u64; 4];
+    debug_assert!(space <= std::mem::size_of_val(&control));
+    let mut msg: libc::msghdr = unsafe { std::mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+    msg.msg_controllen = space as _;
+    unsafe {
+        let cmsg = libc::CMSG_FIRSTHDR(&msg);
+        (*cmsg).cmsg_level = libc::SOL_SOCKET;
+        (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+        (*cmsg).cmsg_len = libc::CMSG_LEN(std::mem::size_of::<RawFd>() as u32) as _;
+        std::ptr::write_unaligned(libc::CMSG_DATA(cmsg) as *mut RawFd, fd);
+    }
+    if -1 == unsafe { libc::sendmsg(sock, &msg, 0) } {
+        return Err(Errno::last());
+    }
+    Ok(())
+}
+
+/// Returns None if the peer closed the socket without sending a fd
+fn recv_fd(sock: RawFd) -> Result<Option<OwnedFd>, Errno> {
+    let mut data = [0u8; 1];
+    let mut iov = libc::iovec {
+        iov_base: data.as_mut_ptr() as *mut libc::c_void,
+        iov_len: data.len(),
+    };
+    let space = unsafe { libc::CMSG_SPACE(std::mem::size_of::<RawFd>() as u32) } as usize;
+    let mut control = vec![0u8; space];
+    let mut msg: libc::msghdr = unsafe { std::mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+    msg.msg_controllen = space as _;
+    loop {
+        match unsafe { libc::recvmsg(sock, &mut msg, libc::MSG_CMSG_CLOEXEC) } {
+            -1 if Errno::last() == Errno::EINTR => continue,
+            -1 => return Err(Errno::last()),
+            0 => return Ok(None),
+            _ => break,
+        }
+    }
+    unsafe {
+        let cmsg = libc::CMSG_FIRSTHDR(&msg);
+        if cmsg.is_null()
+            || (*cmsg).cmsg_level != libc::SOL_SOCKET
+            || (*cmsg).cmsg_type != libc::SCM_RIGHTS
+        {
+            return Ok(None);
+        }
+        let fd = std::ptr::read_unaligned(libc::CMSG_DATA(cmsg) as *const RawFd);
+        Ok(Some(OwnedFd::from_raw_fd(fd)))
+    }
+}
@@ -0,0 +1,115 @@
+//! Allocations of reading argv and envp into a `StringArena`.
+//!
+//! The counting allocator replaces the allocator of the whole binary,
+//! so this test has its own binary and runs without the test harness, on one thread.
+//!
+//! cargo test --release --test arena_alloc -- --nocapture
+
+// Only the arena is used. The unit tests of the modules are compiled without the harness,
+// but not run.
+#![allow(dead_code, unused_imports)]
+
+#[path = "../src/inspect.rs"]
+mod inspect;
+#[path = "../src/intern.rs"]
+mod intern;
+
+use std::{
+    alloc::{GlobalAlloc, Layout, System},
+    hint::black_box,
+    sync::atomic::{AtomicUsize, Ordering},
+    time::Instant,
+};
+
+use inspect::{RemoteMemory, StringArena, TraceeMemory};
+use nix::unistd::Pid;
+
+struct CountingAlloc;
+
+static ALLOCATIONS: AtomicUsize = AtomicUsize::new(0);
+
+unsafe impl GlobalAlloc for CountingAlloc {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        System.alloc(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        System.realloc(ptr, layout, new_size)
+    }
+}
+
+#[global_allocator]
+static ALLOCATOR: CountingAlloc = CountingAlloc;
+
+const ITERATIONS: usize = 1000;
+
+/// Strings packed back to back like argv and envp, and a NULL-terminated array of pointers to them
+fn packed(strings: &[Vec<u8>]) -> (Vec<u8>, Vec<usize>) {
+    let mut blob = Vec::new();
+    let mut offsets = Vec::new();
+    for s in strings {
+        offsets.push(blob.len());
+        blob.extend_from_slice(s);
+        blob.push(0);
+    }
+    let base = blob.as_ptr() as usize;
+    let mut pointers: Vec<usize> = offsets.into_iter().map(|x| base + x).collect();
+    pointers.push(0);
+    (blob, pointers)
+}
+
+/// Read an exec with a 1000-entry environment. The process reads its own memory.
+fn read_exec(arena: &mut StringArena, argv: &[usize], envp: &[usize]) {
+    let mut mem = RemoteMemory::new(Pid::this());
+    arena.clear();
+    let argv = mem.read_string_array(argv.as_ptr() as usize, arena);
+    let envp = mem.read_string_array(envp.as_ptr() as usize, arena);
+    assert_eq!(argv.unwrap().len() + envp.unwrap().len(), 1003);
+}
+
+/// Allocations in all iterations, and time per exec in µs
+fn measure(mut read: impl FnMut()) -> (usize, f64) {
+    let before = ALLOCATIONS.load(Ordering::Relaxed);
+    let start = Instant::now();
+    for _ in 0..ITERATIONS {
+        read();
+    }
+    let elapsed = start.elapsed().as_secs_f64() * 1e6 / ITERATIONS as f64;
+    let allocations = ALLOCATIONS.load(Ordering::Relaxed) - before;
+    (allocations, elapsed)
+}
+
+fn main() {
+    let (_argv_blob, argv) = packed(&[b"cc".to_vec(), b"-c".to_vec(), b"main.c".to_vec()]);
+    let env: Vec<Vec<u8>> = (0..1000)
+        .map(|i| format!("KEY{i}=value{i}").into_bytes())
+        .collect();
+    let (_envp_blob, envp) = packed(&env);
+
+    let (fresh_allocations, fresh_time) = measure(|| {
+        let mut arena = StringArena::default();
+        read_exec(&mut arena, &argv, &envp);
+        black_box(&arena);
+    });
+    let mut arena = StringArena::default();
+    // Warm up
+    read_exec(&mut arena, &argv, &envp);
+    read_exec(&mut arena, &argv, &envp);
+    let (reused_allocations, reused_time) = measure(|| {
+        read_exec(&mut arena, &argv, &envp);
+        black_box(&arena);
+    });
+    println!(
+        "1000-entry envp, per exec: fresh arena {} allocations, {fresh_time:.1}µs; \
+         reused arena {} allocations, {reused_time:.1}µs",
+        fresh_allocations / ITERATIONS,
+        reused_allocations / ITERATIONS,
+    );
+    assert_eq!(reused_allocations, 0, "a warmed-up arena must not allocate");
+}